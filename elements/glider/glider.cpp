@@ -23,7 +23,7 @@
 namespace CPGL {
     Glider::Glider(YAML::Node& c, BaseElement* p) : core::BaseElement(c, p) {
         program = tools::load_shaders("glider", "glider.vert", "glider.frag");
-        object = tools::load_model("glider", config["model"].as<std::string>(), program, "inPosition", "inNormal", "inTexCoord");
+        object = tools::load_model("glider", config["model"].as<std::string>(), program, "inPosition", "inNormal", "inTexCoord", config["residency"].as<std::string>(""));
         std::cout << "Getting terrain" << std::endl;
         terrain = dynamic_cast<Terrain*>(get("ground"));
         std::cout << "Got terrain: " << terrain << std::endl;
@@ -49,7 +49,7 @@ namespace CPGL {
         glUniformMatrix4fv(glGetUniformLocation(program, "projectionMatrix"), 1, GL_FALSE, get_projection());
         glUniformMatrix4fv(glGetUniformLocation(program, "baseMatrix"), 1, GL_FALSE, get_base().data());
 
-        DrawModel(object);
+        tools::draw_model(object, get_base().data(), get_projection());
     }
 }
 
@@ -41,12 +41,26 @@ namespace CPGL {
         glUniformMatrix4fv(glGetUniformLocation(program, "baseMatrix"), 1, GL_FALSE, get_base().data());
         print_error("display ground1");
 
-        glActiveTexture(GL_TEXTURE0);
-        glBindTexture(GL_TEXTURE_2D, texture);
-        glUniform1i(glGetUniformLocation(program, "texUnit"), 0); // Texture unit 0
-        print_error("display ground3");
         glBindVertexArray(groundVertexArrayObjectID);   // Select VAO
+        if(virtual_texture) {
+            const GLfloat repeat = 1.0f / config["virtual_repeat"].as<float>(100.0f);
+            const GLfloat transform[] = {repeat, repeat, 0.0f, 0.0f};
+            glUniform4fv(glGetUniformLocation(program, "texTransform"), 1, transform);
+            virtual_texture->bind(program);
+            virtual_texture->begin_feedback(program);
+            glDrawElements(GL_TRIANGLES, 6, GL_UNSIGNED_INT, 0L);
+            virtual_texture->end_feedback(program);
+            drawStats.drawCalls++;
+        } else {
+            bind_texture_layer(texture, GL_TEXTURE0);
+            glUniform1i(glGetUniformLocation(program, "texUnit"), 0); // Texture unit 0
+            glUniform1f(glGetUniformLocation(program, "layer"), texture.layer);
+            glUniform4fv(glGetUniformLocation(program, "texTransform"), 1, texture.transform);
+        }
+        print_error("display ground3");
         glDrawElements(GL_TRIANGLES, 6, GL_UNSIGNED_INT, 0L);
+        drawStats.drawCalls++;
+        drawStats.triangles += 2;
 
         print_error("display ground4");
     }
@@ -3,9 +3,10 @@
 out vec4 out_Color;
 
 in vec2 v_TexCoord;
-uniform sampler2D texUnit;
+uniform sampler2DArray texUnit;
+uniform float layer;
 
 void main(void)
 {
-    out_Color = texture(texUnit, v_TexCoord);
+    out_Color = texture(texUnit, vec3(v_TexCoord, layer));
 }
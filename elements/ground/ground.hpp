@@ -28,7 +28,8 @@ namespace CPGL {
     class Ground : public BaseElement {
         private:
             GLuint program;
-            GLuint texture;
+            TextureLayer texture;
+            streaming::VirtualTexture* virtual_texture;
             GLuint groundVertexArrayObjectID;
 
         public:
@@ -46,12 +47,20 @@ namespace CPGL {
                                               100, 100,
                                               0, 100};
 
-                program = load_shaders("ground", "ground.vert", "ground.frag");
+                // A virtual_texture: made by tga2vt repeats every virtual_repeat:
+                // (100) texture coordinates, of two length units each
+                virtual_texture = NULL;
+                if(config["virtual_texture"]) {
+                    virtual_texture = streaming::load_virtual_texture(texture_path("ground", config["virtual_texture"].as<std::string>()));
+                }
+                if(virtual_texture) {
+                    program = load_shaders("ground", "ground.vert", "ground_vt.frag", streaming::virtual_texture_shader());
+                } else {
+                    program = load_shaders("ground", "ground.vert", "ground.frag");
+                }
                 print_error("init ground-1");
-                texture = load_texture("ground", config["texture"].as<std::string>("grass.tga"));
+                if(!virtual_texture) texture = load_texture_layer("ground", config["texture"].as<std::string>("grass.tga"));
                 print_error("init ground0");
-                glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
-                glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
 
                 GLuint vertexBufferID, indexBufferID, texCoordBufferID;
                 print_error("init ground1");
@@ -8,9 +8,10 @@ out vec2 v_TexCoord;
 uniform mat4 projectionMatrix; // World to screen
 uniform mat4 baseMatrix; // To world
 uniform vec3 camera_position;
+uniform vec4 texTransform; // Scale and offset within the texture layer
 
 void main(void)
 {
     gl_Position = projectionMatrix * baseMatrix * vec4(inPosition, 1.0);
-    v_TexCoord = vec2(inTexCoord.s + camera_position[0]/2, inTexCoord.t - camera_position[2]/2);
+    v_TexCoord = vec2(inTexCoord.s + camera_position[0]/2, inTexCoord.t - camera_position[2]/2) * texTransform.xy + texTransform.zw;
 }
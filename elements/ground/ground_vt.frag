@@ -0,0 +1,14 @@
+#version 150
+
+out vec4 out_Color;
+
+in vec2 v_TexCoord;
+uniform bool vt_feedback;
+
+vec4 vt_sample(vec2 uv);
+vec4 vt_request(vec2 uv);
+
+void main(void)
+{
+    out_Color = vt_feedback ? vt_request(v_TexCoord) : vt_sample(v_TexCoord);
+}
@@ -31,10 +31,11 @@ namespace CPGL {
         glUniformMatrix4fv(glGetUniformLocation(program, "baseMatrix"), 1, GL_FALSE, parent->base.data());
 
         print_error("draw skybox1");
-        glActiveTexture(GL_TEXTURE0);
-        glBindTexture(GL_TEXTURE_2D, texture);
+        bind_texture_layer(texture, GL_TEXTURE0);
         print_error("draw skybox2");
         glUniform1i(glGetUniformLocation(program, "texUnit"), 0); // Texture unit 0
+        glUniform1f(glGetUniformLocation(program, "layer"), texture.layer);
+        glUniform4fv(glGetUniformLocation(program, "texTransform"), 1, texture.transform);
         print_error("draw skybox3");
         glDisable(GL_DEPTH_TEST);
         glDisable(GL_CULL_FACE);
@@ -29,13 +29,13 @@ namespace CPGL {
         private:
             GLuint program;
             Model* object;
-            GLuint texture;
+            TextureLayer texture;
 
         public:
             Skybox(YAML::Node& c, BaseElement* p) : BaseElement(c, p) {
                 program = load_shaders("skybox", "skybox.vert", "skybox.frag");
                 object = load_model("skybox", "skybox.obj", program, "inPosition", "inNormal", "inTexCoord");
-                texture = load_texture("skybox", "SkyBox512.tga");
+                texture = load_texture_layer("skybox", "SkyBox512.tga");
             }
 
             void draw();
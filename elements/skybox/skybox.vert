@@ -8,9 +8,10 @@ out vec2 v_TexCoord;
 
 uniform mat4 projectionMatrix; // World to screen
 uniform mat4 baseMatrix; // World to view
+uniform vec4 texTransform; // Scale and offset within the texture layer
 
 void main(void)
 {
     gl_Position =  projectionMatrix * mat4(mat3(baseMatrix)) * vec4( inPosition, 1.0);
-    v_TexCoord = inTexCoord;
+    v_TexCoord = inTexCoord * texTransform.xy + texTransform.zw;
 }
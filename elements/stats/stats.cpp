@@ -0,0 +1,215 @@
+/**
+ * Copyright 2012 Jonatan Olofsson
+ *
+ * This file is part of C++ GL Framework (CPGL).
+ *
+ * CPGL is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * CPGL is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with CPGL.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "stats.hpp"
+#include <cstdio>
+#include <cctype>
+#include <algorithm>
+#include <iostream>
+
+namespace CPGL {
+    // 5x7 column-major glyphs for ' ' through 'Z', bit 0 at the top
+    static const unsigned char font5x7[][5] = {
+        {0x00,0x00,0x00,0x00,0x00}, {0x00,0x00,0x5F,0x00,0x00}, {0x00,0x07,0x00,0x07,0x00}, {0x14,0x7F,0x14,0x7F,0x14},
+        {0x24,0x2A,0x7F,0x2A,0x12}, {0x23,0x13,0x08,0x64,0x62}, {0x36,0x49,0x55,0x22,0x50}, {0x00,0x05,0x03,0x00,0x00},
+        {0x00,0x1C,0x22,0x41,0x00}, {0x00,0x41,0x22,0x1C,0x00}, {0x08,0x2A,0x1C,0x2A,0x08}, {0x08,0x08,0x3E,0x08,0x08},
+        {0x00,0x50,0x30,0x00,0x00}, {0x08,0x08,0x08,0x08,0x08}, {0x00,0x60,0x60,0x00,0x00}, {0x20,0x10,0x08,0x04,0x02},
+        {0x3E,0x51,0x49,0x45,0x3E}, {0x00,0x42,0x7F,0x40,0x00}, {0x42,0x61,0x51,0x49,0x46}, {0x21,0x41,0x45,0x4B,0x31},
+        {0x18,0x14,0x12,0x7F,0x10}, {0x27,0x45,0x45,0x45,0x39}, {0x3C,0x4A,0x49,0x49,0x30}, {0x01,0x71,0x09,0x05,0x03},
+        {0x36,0x49,0x49,0x49,0x36}, {0x06,0x49,0x49,0x29,0x1E}, {0x00,0x36,0x36,0x00,0x00}, {0x00,0x56,0x36,0x00,0x00},
+        {0x00,0x08,0x14,0x22,0x41}, {0x14,0x14,0x14,0x14,0x14}, {0x41,0x22,0x14,0x08,0x00}, {0x02,0x01,0x51,0x09,0x06},
+        {0x32,0x49,0x79,0x41,0x3E}, {0x7E,0x11,0x11,0x11,0x7E}, {0x7F,0x49,0x49,0x49,0x36}, {0x3E,0x41,0x41,0x41,0x22},
+        {0x7F,0x41,0x41,0x22,0x1C}, {0x7F,0x49,0x49,0x49,0x41}, {0x7F,0x09,0x09,0x01,0x01}, {0x3E,0x41,0x41,0x51,0x32},
+        {0x7F,0x08,0x08,0x08,0x7F}, {0x00,0x41,0x7F,0x41,0x00}, {0x20,0x40,0x41,0x3F,0x01}, {0x7F,0x08,0x14,0x22,0x41},
+        {0x7F,0x40,0x40,0x40,0x40}, {0x7F,0x02,0x04,0x02,0x7F}, {0x7F,0x04,0x08,0x10,0x7F}, {0x3E,0x41,0x41,0x41,0x3E},
+        {0x7F,0x09,0x09,0x09,0x06}, {0x3E,0x41,0x51,0x21,0x5E}, {0x7F,0x09,0x19,0x29,0x46}, {0x46,0x49,0x49,0x49,0x31},
+        {0x01,0x01,0x7F,0x01,0x01}, {0x3F,0x40,0x40,0x40,0x3F}, {0x1F,0x20,0x40,0x20,0x1F}, {0x7F,0x20,0x18,0x20,0x7F},
+        {0x63,0x14,0x08,0x14,0x63}, {0x03,0x04,0x78,0x04,0x03}, {0x61,0x51,0x49,0x45,0x43}
+    };
+    static const int NUM_GLYPHS = sizeof(font5x7) / sizeof(font5x7[0]);
+
+    // Atlas of 16x4 cells of 6x8 texels, the last cell is solid and used for bars
+    static const int CELL_W = 6, CELL_H = 8, COLS = 16, ROWS = 4;
+    static const int ATLAS_W = CELL_W * COLS, ATLAS_H = CELL_H * ROWS;
+    static const int SOLID = COLS * ROWS - 1;
+    static const int FLOATS_PER_VERTEX = 8;
+
+    static const float white[] = {1.0, 1.0, 1.0, 1.0};
+    static const float panel[] = {0.0, 0.0, 0.0, 0.6};
+    static const float under[] = {0.3, 0.9, 0.3, 0.9};
+    static const float over[] = {1.0, 0.25, 0.2, 0.9};
+    static const float budget_line[] = {1.0, 0.9, 0.2, 0.8};
+
+    GLuint Stats::create_atlas() {
+        std::vector<GLubyte> texels(ATLAS_W * ATLAS_H, 0);
+        for(int g = 0; g < NUM_GLYPHS; ++g) {
+            int x0 = (g % COLS) * CELL_W, y0 = (g / COLS) * CELL_H;
+            for(int col = 0; col < 5; ++col) {
+                for(int row = 0; row < 7; ++row) {
+                    if(font5x7[g][col] & (1 << row)) texels[(y0 + row) * ATLAS_W + x0 + col] = 255;
+                }
+            }
+        }
+        int x0 = (SOLID % COLS) * CELL_W, y0 = (SOLID / COLS) * CELL_H;
+        for(int row = 0; row < CELL_H; ++row) {
+            for(int col = 0; col < CELL_W; ++col) texels[(y0 + row) * ATLAS_W + x0 + col] = 255;
+        }
+
+        GLuint tex;
+        GLint alignment;
+        glGetIntegerv(GL_UNPACK_ALIGNMENT, &alignment);
+        glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+        glGenTextures(1, &tex);
+        glBindTexture(GL_TEXTURE_2D, tex);
+        glTexImage2D(GL_TEXTURE_2D, 0, GL_R8, ATLAS_W, ATLAS_H, 0, GL_RED, GL_UNSIGNED_BYTE, &texels[0]);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+        glPixelStorei(GL_UNPACK_ALIGNMENT, alignment);
+        return tex;
+    }
+
+    Stats::Stats(YAML::Node& c, BaseElement* p) : BaseElement(c, p),
+        width(glutGet(GLUT_WINDOW_WIDTH)),
+        height(glutGet(GLUT_WINDOW_HEIGHT)),
+        budget_ms(config["budget_ms"].as<float>(stats::budget_ms())),
+        graph_ms(config["graph_ms"].as<float>(33.3)),
+        history(config["history"].as<int>(120))
+    {
+        program = load_shaders("stats", "stats.vert", "stats.frag");
+        glUniform1i(glGetUniformLocation(program, "glyphs"), 0); // Texture unit 0
+        glActiveTexture(GL_TEXTURE0);
+        atlas = create_atlas();
+
+        glGenVertexArrays(1, &vao);
+        glGenBuffers(1, &vbo);
+        glBindVertexArray(vao);
+        glBindBuffer(GL_ARRAY_BUFFER, vbo);
+
+        GLsizei stride = FLOATS_PER_VERTEX * sizeof(GLfloat);
+        GLint position = glGetAttribLocation(program, "inPosition");
+        GLint texcoord = glGetAttribLocation(program, "inTexCoord");
+        GLint color = glGetAttribLocation(program, "inColor");
+        glVertexAttribPointer(position, 2, GL_FLOAT, GL_FALSE, stride, 0);
+        glEnableVertexAttribArray(position);
+        glVertexAttribPointer(texcoord, 2, GL_FLOAT, GL_FALSE, stride, (GLvoid*)(2 * sizeof(GLfloat)));
+        glEnableVertexAttribArray(texcoord);
+        glVertexAttribPointer(color, 4, GL_FLOAT, GL_FALSE, stride, (GLvoid*)(4 * sizeof(GLfloat)));
+        glEnableVertexAttribArray(color);
+        print_error("init stats");
+    }
+
+    void Stats::quad(float x, float y, float w, float h, int glyph, const float* color) {
+        // Pixels, origin in the upper left corner, to normalized device coordinates
+        float x0 = 2.0 * x / width - 1.0, x1 = 2.0 * (x + w) / width - 1.0;
+        float y0 = 1.0 - 2.0 * y / height, y1 = 1.0 - 2.0 * (y + h) / height;
+        float u0 = float((glyph % COLS) * CELL_W) / ATLAS_W, u1 = u0 + 5.0 / ATLAS_W;
+        float v0 = float((glyph / COLS) * CELL_H) / ATLAS_H, v1 = v0 + 7.0 / ATLAS_H;
+        const float corners[6][4] = {
+            {x0, y0, u0, v0}, {x0, y1, u0, v1}, {x1, y0, u1, v0},
+            {x1, y0, u1, v0}, {x0, y1, u0, v1}, {x1, y1, u1, v1}
+        };
+        for(int i = 0; i < 6; ++i) {
+            vertices.insert(vertices.end(), corners[i], corners[i] + 4);
+            vertices.insert(vertices.end(), color, color + 4);
+        }
+    }
+
+    void Stats::text(float x, float y, const std::string& s, const float* color) {
+        float scale = config["scale"].as<float>(2.0);
+        for(std::string::const_iterator it = s.begin(); it != s.end(); ++it, x += CELL_W * scale) {
+            int g = std::toupper(*it) - ' ';
+            if(g <= 0 || g >= NUM_GLYPHS) continue;
+            quad(x, y, 5 * scale, 7 * scale, g, color);
+        }
+    }
+
+    bool Stats::keyboard(unsigned char key, int, int) {
+        if(key == 'p') stats::print_stutters(std::cout);
+        return false;
+    }
+
+    void Stats::draw()
+    {
+        const stats::FrameStats& frame = stats::last_frame();
+        history.push_back(frame.frame_ms);
+
+        float scale = config["scale"].as<float>(2.0);
+        float x = config["x"].as<float>(8.0), y = config["y"].as<float>(8.0);
+        float line = CELL_H * scale + 2;
+        float graph_h = config["graph_height"].as<float>(48.0);
+        float bar_w = std::max(1.0f, scale);
+        float panel_w = std::max(history.capacity() * bar_w, 30 * CELL_W * scale) + 8;
+        float panel_h = graph_h + 6 * line + 12;
+
+        vertices.clear();
+        quad(x, y, panel_w, panel_h, SOLID, panel);
+
+        // Frame time graph, newest frame to the right
+        float gx = x + 4, gy = y + 4 + graph_h;
+        for(size_t i = 0; i < history.size(); ++i) {
+            float h = std::min(history[i] / graph_ms, 1.0f) * graph_h;
+            quad(gx + i * bar_w, gy - h, bar_w, h, SOLID, history[i] > budget_ms ? over : under);
+        }
+        if(budget_ms < graph_ms) {
+            quad(gx, gy - budget_ms / graph_ms * graph_h, history.capacity() * bar_w, 1, SOLID, budget_line);
+        }
+
+        char buf[64];
+        float ty = gy + 6;
+        snprintf(buf, sizeof(buf), "FRAME %6.2f MS %6.1f FPS", frame.frame_ms, frame.frame_ms > 0 ? 1000.0 / frame.frame_ms : 0.0);
+        text(gx, ty, buf, white); ty += line;
+        snprintf(buf, sizeof(buf), "CPU   %6.2f MS", frame.draw_ms);
+        text(gx, ty, buf, white); ty += line;
+        snprintf(buf, sizeof(buf), "DRAWS %u TRIS %u", frame.draw.drawCalls, frame.draw.triangles);
+        text(gx, ty, buf, white); ty += line;
+        snprintf(buf, sizeof(buf), "STATE %u CULLED %u", frame.draw.stateChanges, frame.draw.culled);
+        text(gx, ty, buf, white); ty += line;
+        snprintf(buf, sizeof(buf), "MEM   %.1f MB", frame.resident_kb / 1024.0);
+        text(gx, ty, buf, white); ty += line;
+        if(stats::stutters().empty()) {
+            snprintf(buf, sizeof(buf), "STUTTER 0");
+        } else {
+            const stats::Stutter& s = stats::stutters().back();
+            snprintf(buf, sizeof(buf), "STUTTER %lu LAST %.0f MS %s", stats::stutter_count(), s.frame_ms, s.element.c_str());
+        }
+        text(gx, ty, buf, stats::stutters().empty() ? white : over);
+
+        glUseProgram(program);
+        glActiveTexture(GL_TEXTURE0);
+        glBindTexture(GL_TEXTURE_2D, atlas);
+        glBindVertexArray(vao);
+        glBindBuffer(GL_ARRAY_BUFFER, vbo);
+        glBufferData(GL_ARRAY_BUFFER, vertices.size() * sizeof(GLfloat), &vertices[0], GL_STREAM_DRAW);
+
+        glDisable(GL_DEPTH_TEST);
+        glEnable(GL_BLEND);
+        glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+        glDrawArrays(GL_TRIANGLES, 0, vertices.size() / FLOATS_PER_VERTEX);
+        glDisable(GL_BLEND);
+        glEnable(GL_DEPTH_TEST);
+        print_error("draw stats");
+    }
+}
+
+extern "C" {
+    using namespace CPGL::core;
+    BaseElement* factory(YAML::Node& c, BaseElement* p) {
+        return dynamic_cast<BaseElement*>(new CPGL::Stats(c,p));
+    }
+}
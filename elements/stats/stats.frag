@@ -0,0 +1,12 @@
+#version 150
+
+out vec4 out_Color;
+
+in vec2 v_TexCoord;
+in vec4 v_Color;
+uniform sampler2D glyphs;
+
+void main(void)
+{
+    out_Color = vec4(v_Color.rgb, v_Color.a * texture(glyphs, v_TexCoord).r);
+}
@@ -0,0 +1,60 @@
+/**
+ * Copyright 2012 Jonatan Olofsson
+ *
+ * This file is part of C++ GL Framework (CPGL).
+ *
+ * CPGL is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * CPGL is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with CPGL.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef STATS_ELEMENT_HPP_
+#define STATS_ELEMENT_HPP_
+
+#include "cpgl/cpgl.hpp"
+#include <boost/circular_buffer.hpp>
+#include <vector>
+#include <string>
+
+namespace CPGL {
+    using namespace core;
+    using namespace tools;
+    /**
+     * On-screen overlay with frame time graph and draw counters.
+     * Everything is batched into a single draw call against a glyph atlas,
+     * so place it last among the children of the window.
+     * Press 'p' to print the log of frames over the budget.
+     */
+    class Stats : public BaseElement {
+        private:
+            GLuint program;
+            GLuint atlas;
+            GLuint vao, vbo;
+            int width, height;
+            float budget_ms, graph_ms;
+            boost::circular_buffer<float> history;
+            std::vector<GLfloat> vertices;
+
+            void quad(float x, float y, float w, float h, int glyph, const float* color);
+            void text(float x, float y, const std::string& s, const float* color);
+            GLuint create_atlas();
+
+        public:
+            Stats(YAML::Node& c, BaseElement* p);
+
+            void draw();
+            bool reshape(int w, int h) {width = w; height = h; return false;}
+            bool keyboard(unsigned char key, int x, int y);
+    };
+}
+
+#endif
@@ -0,0 +1,15 @@
+#version 150
+
+in vec2 inPosition;
+in vec2 inTexCoord;
+in vec4 inColor;
+
+out vec2 v_TexCoord;
+out vec4 v_Color;
+
+void main(void)
+{
+    gl_Position = vec4(inPosition, 0.0, 1.0);
+    v_TexCoord = inTexCoord;
+    v_Color = inColor;
+}
@@ -20,24 +20,29 @@
 #include "terrain.hpp"
 #include <Eigen/Core>
 #include <Eigen/Geometry>
+#include <algorithm>
+#include <iostream>
 
 namespace CPGL {
-    Model* GenerateTerrain(TextureData *tex,
+    Model* GenerateTerrain(const Heightmap *map,
                             GLuint program,
                             char* vertexVariableName,
                             char* normalVariableName,
                             char* texCoordVariableName,
-                            double yscale)
+                            double yscale,
+                            int chunk,
+                            bool interleaved,
+                            bool compact_positions)
     {
-        int vertexCount = tex->width * tex->height;
-        int triangleCount = (tex->width-1) * (tex->height-1) * 2;
-        unsigned int x, z;
+        const int width = map->width;
+        const int height = map->height;
+        int vertexCount = width * height;
+        int triangleCount = (width-1) * (height-1) * 2;
+        int x, z;
 
         Model* model = (Model*)malloc(sizeof(Model));
         memset(model, 0, sizeof(Model));
 
-        model->vertexArray = (GLfloat*)malloc(sizeof(Model));
-
         model->vertexArray = (GLfloat*)malloc(sizeof(GLfloat) * 3 * vertexCount);
         model->normalArray = (GLfloat*)malloc(sizeof(GLfloat) * 3 * vertexCount);
         model->texCoordArray = (GLfloat*)malloc(sizeof(GLfloat) * 2 * vertexCount);
@@ -46,97 +51,73 @@ namespace CPGL {
         model->numVertices = vertexCount;
         model->numIndices = triangleCount*3;
 
-        printf("bpp %d\n", tex->bpp);
-        for (x = 0; x < tex->width; x++)
-            for (z = 0; z < tex->height; z++)
+        // Row by row, so that a mapped heightmap is read front to back
+        for (z = 0; z < height; z++)
+            for (x = 0; x < width; x++)
             {
-    // Vertex array. You need to scale this properly
-                model->vertexArray[(x + z * tex->width)*3 + 0] = x / 1.0;
-                model->vertexArray[(x + z * tex->width)*3 + 1] = tex->imageData[(x + z * tex->width) * (tex->bpp/8)] / 100.0 * yscale;
-                model->vertexArray[(x + z * tex->width)*3 + 2] = z / 1.0;
-    // Normal vectors. You need to calculate these.
-                model->normalArray[(x + z * tex->width)*3 + 0] = 0.0;
-                model->normalArray[(x + z * tex->width)*3 + 1] = 1.0;
-                model->normalArray[(x + z * tex->width)*3 + 2] = 0.0;
+                model->vertexArray[(x + z * width)*3 + 0] = x / 1.0;
+                model->vertexArray[(x + z * width)*3 + 1] = HeightAt(map, x, z) * yscale;
+                model->vertexArray[(x + z * width)*3 + 2] = z / 1.0;
     // Texture coordinates. You may want to scale them.
-                model->texCoordArray[(x + z * tex->width)*2 + 0] = x; // (float)x / tex->width;
-                model->texCoordArray[(x + z * tex->width)*2 + 1] = z; // (float)z / tex->height;
+                model->texCoordArray[(x + z * width)*2 + 0] = x; // (float)x / width;
+                model->texCoordArray[(x + z * width)*2 + 1] = z; // (float)z / height;
             }
 
-        int xp[] = {1, 1, 0, -1, -1, 0, 1};
-        int zp[] = {0, -1, -1, 0, 1, 1, 0};
-        float scales[] = {1/8., 1/8., 2/8., 1/8., 1/8., 2/8.};
-
-        for (x = 1; x < tex->width-1; x++)
-            for (z = 1; z < tex->height-1; z++)
+        // Normal vectors, from the heights in the vertex array
+        GridNormals(&model->vertexArray[1], 3, width, height, model->normalArray);
+
+        // Chunks of chunk by chunk quads, each a range of the index array
+        // with bounds of its own, for culling against the frustum. The last
+        // row and column of chunks may be smaller.
+        if (chunk <= 0) chunk = std::max(width, height);
+        int chunksX = (width - 2) / chunk + 1;
+        int chunksZ = (height - 2) / chunk + 1;
+        std::vector<GLuint> ranges;
+        GLuint* index = model->indexArray;
+        for (int cz = 0; cz < chunksZ; ++cz)
+            for (int cx = 0; cx < chunksX; ++cx)
             {
-    // Normal vectors. You need to calculate these.
-                Vector3f sum; sum.setZero();
-                Map<Vector3f> p(&model->vertexArray[(x + z * tex->width)*3]);
-                for (int n = 0; n < 6; ++n) {
-                    Map<Vector3f> p1(&model->vertexArray[(x + xp[n] + (z + zp[n]) * tex->width)*3]);
-                    Map<Vector3f> p2(&model->vertexArray[(x + xp[n+1] + (z + zp[n+1]) * tex->width)*3]);
-                    sum += scales[n] * ((p1-p).cross((p2-p))).normalized();
-                }
-                Map<Vector3f> normal(&model->normalArray[(x + z * tex->width)*3]);
-                normal = sum.normalized();
-                //~ model->normalArray[(x + z * tex->width)*3 + 0] = 0.0;
-                //~ model->normalArray[(x + z * tex->width)*3 + 1] = 1.0;
-                //~ model->normalArray[(x + z * tex->width)*3 + 2] = 0.0;
-            }
-
-        for (x = 0; x < tex->width-1; x++)
-            for (z = 0; z < tex->height-1; z++)
-            {
-            // Triangle 1
-                model->indexArray[(x + z * (tex->width-1))*6 + 0] = x + z * tex->width;
-                model->indexArray[(x + z * (tex->width-1))*6 + 1] = x + (z+1) * tex->width;
-                model->indexArray[(x + z * (tex->width-1))*6 + 2] = x+1 + z * tex->width;
-            // Triangle 2
-                model->indexArray[(x + z * (tex->width-1))*6 + 3] = x+1 + z * tex->width;
-                model->indexArray[(x + z * (tex->width-1))*6 + 4] = x + (z+1) * tex->width;
-                model->indexArray[(x + z * (tex->width-1))*6 + 5] = x+1 + (z+1) * tex->width;
+                ranges.push_back(index - model->indexArray);
+                for (z = cz * chunk; z < std::min((cz + 1) * chunk, height-1); z++)
+                    for (x = cx * chunk; x < std::min((cx + 1) * chunk, width-1); x++)
+                    {
+                    // Triangle 1
+                        *index++ = x + z * width;
+                        *index++ = x + (z+1) * width;
+                        *index++ = x+1 + z * width;
+                    // Triangle 2
+                        *index++ = x+1 + z * width;
+                        *index++ = x + (z+1) * width;
+                        *index++ = x+1 + (z+1) * width;
+                    }
+                ranges.push_back(index - model->indexArray - ranges.back());
             }
+        if (ranges.size() > 2) {
+            SetModelMeshlets(model, ranges.size() / 2, &ranges[0]);
+        }
 
         // End of terrain generation
 
         // Upload and set variables like LoadModelPlus
-        glGenVertexArrays(1, &model->vao);
-        glGenBuffers(1, &model->vb);
-        glGenBuffers(1, &model->ib);
-        glGenBuffers(1, &model->nb);
-        if (model->texCoordArray != NULL)
-            glGenBuffers(1, &model->tb);
-
-        glBindVertexArray(model->vao);
-
-        // VBO for vertex data
-        glBindBuffer(GL_ARRAY_BUFFER, model->vb);
-        glBufferData(GL_ARRAY_BUFFER, model->numVertices*3*sizeof(GLfloat), model->vertexArray, GL_STATIC_DRAW);
-        glVertexAttribPointer(glGetAttribLocation(program, vertexVariableName), 3, GL_FLOAT, GL_FALSE, 0, 0);
-        glEnableVertexAttribArray(glGetAttribLocation(program, vertexVariableName));
-
-        // VBO for normal data
-        glBindBuffer(GL_ARRAY_BUFFER, model->nb);
-        glBufferData(GL_ARRAY_BUFFER, model->numVertices*3*sizeof(GLfloat), model->normalArray, GL_STATIC_DRAW);
-        glVertexAttribPointer(glGetAttribLocation(program, normalVariableName), 3, GL_FLOAT, GL_FALSE, 0, 0);
-        glEnableVertexAttribArray(glGetAttribLocation(program, normalVariableName));
-
-        // VBO for texture coordinate data
-        if (model->texCoordArray != NULL)
-        {
-            glBindBuffer(GL_ARRAY_BUFFER, model->tb);
-            glBufferData(GL_ARRAY_BUFFER, model->numVertices*2*sizeof(GLfloat), model->texCoordArray, GL_STATIC_DRAW);
-            glVertexAttribPointer(glGetAttribLocation(program, texCoordVariableName), 2, GL_FLOAT, GL_FALSE, 0, 0);
-            glEnableVertexAttribArray(glGetAttribLocation(program, texCoordVariableName));
+        if (interleaved) {
+            VertexFormat format = tools::vertex_format(vertexVariableName, normalVariableName, texCoordVariableName);
+            if (compact_positions) format.attribs[0].encoding = kVertexCompact;
+            UploadModelInterleaved(model, program, &format);
+        } else {
+            UploadModel(model, program, vertexVariableName, normalVariableName, texCoordVariableName);
         }
 
-        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, model->ib);
-        glBufferData(GL_ELEMENT_ARRAY_BUFFER, model->numIndices*sizeof(GLuint), model->indexArray, GL_STATIC_DRAW);
-
         return model;
     }
 
+    float Terrain::height_at(int x, int z) {
+        if (!heightmap.samples) return 0.0;
+        // Clamped, as the samples are read straight from the mapped file
+        x = std::max(0, std::min(x, heightmap.width - 1));
+        z = std::max(0, std::min(z, heightmap.height - 1));
+        return HeightAt(&heightmap, x, z) * scale;
+    }
+
     void Terrain::get_height(Vector3f& position, Vector2f& direction) {
         using std::floor;
         using std::ceil;
@@ -147,18 +128,18 @@ namespace CPGL {
 
         float y1, y2, y3, dydx, dydz, height;
 
-        y1 = object->vertexArray[(int(x) + (int(z) + 1) * ttex.width)*3 + 1]; // Lower left
-        y2 = object->vertexArray[((int(x)+1) + int(z) * ttex.width)*3 + 1]; // Upper right
+        y1 = height_at(int(x), int(z) + 1); // Lower left
+        y2 = height_at(int(x) + 1, int(z)); // Upper right
         float dx = x-floor(x);
         float dz = z-floor(z);
         if(dx + dz > 1) { // Lower triangle
-            y3 = object->vertexArray[((int(x)+1) + (int(z)+1) * ttex.width)*3 + 1];
+            y3 = height_at(int(x) + 1, int(z) + 1);
 
             dydx = (y3 - y1)/x_scale;
             dydz = (y3 - y2)/z_scale;
             height = y3 - (1-dx)*dydx - (1-dz)*dydz;
         } else {
-            y3 = object->vertexArray[(int(x) + int(z) * ttex.width)*3 + 1];
+            y3 = height_at(int(x), int(z));
 
             dydx = (y2 - y3)/x_scale;
             dydz = (y1 - y3)/z_scale;
@@ -169,32 +150,106 @@ namespace CPGL {
     }
 
     Terrain::Terrain(YAML::Node& c, BaseElement* p) : core::BaseElement(c, p) {
-        program = tools::load_shaders("terrain", "terrain.vert", "terrain.frag");
-        texture = tools::load_texture("terrain", config["texture"].as<std::string>("maskros512.tga"));
-        tools::generate_mipmaps(texture);
+        // A virtual_texture: made by tga2vt covers the whole terrain once
+        virtual_texture = NULL;
+        object = NULL;
+        lod = NULL;
+        memset(&heightmap, 0, sizeof(heightmap));
+        // lod: true draws a quadtree of patches displaced on the GPU, and
+        // displaced: true the same patches, all at full resolution
+        const bool displaced = config["lod"].as<bool>(false) || config["displaced"].as<bool>(false);
+        const std::string vertex_shader = displaced ? "terrain_lod.vert" : "terrain.vert";
+        if (config["virtual_texture"]) {
+            virtual_texture = streaming::load_virtual_texture(tools::texture_path("terrain", config["virtual_texture"].as<std::string>()));
+        }
+        if (virtual_texture) {
+            program = tools::load_shaders("terrain", vertex_shader, "terrain_vt.frag", streaming::virtual_texture_shader());
+        } else {
+            program = tools::load_shaders("terrain", vertex_shader, "terrain.frag");
+            texture = tools::load_texture_layer("terrain", config["texture"].as<std::string>("maskros512.tga"));
+        }
 
         glUniform1i(glGetUniformLocation(program, "tex"), 0); // Texture unit 0
 
     // Load terrain data
+        // TGA images, or raw .r16 and .r32 heights of terrain_width by
+        // terrain_height samples; square if not given
+        std::string path = tools::texture_path("terrain", config["terrain"].as<std::string>());
+        std::cout << "Loading heightmap: " << path << std::endl;
+        if (!LoadHeightmap(const_cast<char*>(path.c_str()), config["terrain_width"].as<int>(0), config["terrain_height"].as<int>(0), &heightmap)) {
+            std::cerr << "Failed to load heightmap: " << path << std::endl;
+            return;
+        }
+        scale = config["scale"].as<double>(1.0);
+        if (displaced) {
+            // 16 bit heights, unless the heightmap is float; height_texture:
+            // r16 or r32f chooses
+            std::string format = config["height_texture"].as<std::string>(heightmap.format == kHeightFloat ? "r32f" : "r16");
+            lod = new TerrainLod(&heightmap, scale, program, format == "r16" ? GL_R16 : GL_R32F, config["patch_size"].as<int>(32),
+                                 config["lod"].as<bool>(false) ? config["lod_pixels"].as<float>(2.0) : 0.0f, config["geomorph"].as<bool>(true));
+            tools::print_error("init terrain");
+            return;
+        }
+        object = GenerateTerrain(&heightmap, program, "inPosition", "inNormal", "inTexCoord", scale, config["chunk_size"].as<int>(64), config["interleaved"].as<bool>(true), config["compact_positions"].as<bool>(false));
 
-        ttex = tools::load_texture_struct("terrain", config["terrain"].as<std::string>());
-        object = GenerateTerrain(&ttex, program, "inPosition", "inNormal", "inTexCoord", config["scale"].as<double>(1.0));
+        // Heights are read from the heightmap itself, so the model arrays
+        // are only kept on the CPU with residency: keep
+        if (config["residency"].as<std::string>("heights") != "keep") {
+            ReleaseModelArrays(object);
+        }
         tools::print_error("init terrain");
     }
 
 
+    Terrain::~Terrain() {
+        delete lod;
+        FreeHeightmap(&heightmap);
+    }
+
+
+    void Terrain::draw_terrain(const Transform<float, 3, Projective>& modelview)
+    {
+        if (lod) {
+            lod->draw(modelview, get_projection());
+        } else {
+            // Frustum only: the terrain is seen from below and from beside
+            // slopes facing away, without back faces culled
+            DrawModelMeshlets(object, modelview.data(), get_projection(), 0);
+        }
+    }
+
     void Terrain::draw()
     {
+        if (!object && !lod) return;
         glUseProgram(program);
 
         // Send in additional params
         glUniformMatrix4fv(glGetUniformLocation(program, "projectionMatrix"), 1, GL_FALSE, get_projection());
         //~ std::cout << "Base matrix: " << get_base().matrix() << std::endl;
-        glUniformMatrix4fv(glGetUniformLocation(program, "baseMatrix"), 1, GL_FALSE, get_base().data());
-
-
-        glBindTexture(GL_TEXTURE_2D, texture);     // Bind Our Texture tex1
-        DrawModel(object);
+        Transform<float, 3, Projective> base = get_base();
+        // Chunks are culled in model space, before compact positions are
+        // scaled to it
+        Transform<float, 3, Projective> modelview = base;
+        if (object) {
+            base.translate(Map<Vector3f>(object->positionOffset)).scale(Map<Vector3f>(object->positionScale));
+        }
+        glUniformMatrix4fv(glGetUniformLocation(program, "baseMatrix"), 1, GL_FALSE, base.data());
+
+
+        if (virtual_texture) {
+            const GLfloat drape[] = {1.0f / (heightmap.width - 1), 1.0f / (heightmap.height - 1), 0.0f, 0.0f};
+            glUniform4fv(glGetUniformLocation(program, "texTransform"), 1, drape);
+            virtual_texture->bind(program);
+            virtual_texture->begin_feedback(program);
+            draw_terrain(modelview);
+            virtual_texture->end_feedback(program);
+            draw_terrain(modelview);
+            return;
+        }
+        tools::bind_texture_layer(texture, GL_TEXTURE0);
+        glUniform1f(glGetUniformLocation(program, "layer"), texture.layer);
+        glUniform4fv(glGetUniformLocation(program, "texTransform"), 1, texture.transform);
+        draw_terrain(modelview);
     }
 }
 
@@ -18,19 +18,28 @@
  */
 
 #include "cpgl/cpgl.hpp"
+#include "terrain_lod.hpp"
 #include <Eigen/Core>
+#include <vector>
 
 namespace CPGL {
     using namespace core;
     class Terrain : public BaseElement {
         private:
             GLuint program;
-            GLuint texture;
+            tools::TextureLayer texture;
+            streaming::VirtualTexture* virtual_texture; // Draped instead, if not NULL
             Model* object;
-            TextureData ttex;
+            TerrainLod* lod;                // Drawn instead, with lod: true
+            Heightmap heightmap;            // Mapped, and read in place
+            double scale;
+
+            void draw_terrain(const Transform<float, 3, Projective>& modelview);
 
         public:
             Terrain(YAML::Node& c, BaseElement* p);
+            ~Terrain();
+            float height_at(int x, int z);
             void get_height(Vector3f& position, Vector2f& direction);
             void draw();
     };
@@ -9,11 +9,12 @@ out vec3 transformedNormal;
 // NY
 uniform mat4 projectionMatrix;
 uniform mat4 baseMatrix;
+uniform vec4 texTransform; // Scale and offset within the texture layer
 
 void main(void)
 {
     mat3 normalMatrix = mat3(baseMatrix);
     transformedNormal = inNormal;
-    texCoord = inTexCoord;
+    texCoord = inTexCoord * texTransform.xy + texTransform.zw;
     gl_Position = projectionMatrix * baseMatrix * vec4(inPosition, 1.0);
 }
@@ -0,0 +1,330 @@
+/**
+ * Copyright 2012 Jonatan Olofsson
+ *
+ * This file is part of C++ GL Framework (CPGL).
+ *
+ * CPGL is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * CPGL is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with CPGL.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "terrain_lod.hpp"
+#include <algorithm>
+#include <cmath>
+#include <iostream>
+
+namespace CPGL {
+    static const GLuint height_unit = 3;   // After the layer, page table and tile cache
+    static const int upload_rows = 64;
+    static const int instance_floats = 6;
+
+    // Height of a sample, clamped to the heightmap as in terrain_lod.vert
+    static inline float sample(const Heightmap* map, const double scale, int x, int z) {
+        x = std::max(0, std::min(x, map->width - 1));
+        z = std::max(0, std::min(z, map->height - 1));
+        return HeightAt(map, x, z) * scale;
+    }
+
+    TerrainLod::TerrainLod(const Heightmap* map, const double scale, const GLuint program_, const GLenum format_,
+                           const int patch_size, const float pixels_, const bool geomorph_)
+        : program(program_), format(format_), width(map->width), height(map->height), pixels(pixels_), geomorph(geomorph_)
+    {
+        stats::Scope s("terrain_lod");
+
+        // Patches of a power of two quads, few enough for 16 bit indices
+        patch = 2;
+        while (patch * 2 <= std::min(patch_size, 128)) patch *= 2;
+        int step = 1;
+        while (patch * step < std::max(width, height) - 1) step *= 2;
+        build(map, scale, 0, 0, step);
+        std::cout << "Terrain quadtree: " << nodes.size() << " patches of " << patch << " quads, "
+            << "root error " << (nodes.empty() ? 0 : nodes[0].error) << std::endl;
+
+        // Heights, uploaded a few rows at a time from the heightmap. R16
+        // texels hold 8 and 16 bit samples exactly, and float samples
+        // spread over the heights of the terrain.
+        range[0] = 0;
+        range[1] = 1;
+        if (format == GL_R16 && map->format == kHeightFloat && !nodes.empty()) {
+            range[0] = nodes[0].lo;
+            range[1] = std::max(nodes[0].hi - nodes[0].lo, 1e-6f);
+        } else if (format == GL_R16) {
+            range[1] = 65535 / 25700.0 * scale;
+        }
+        glGenTextures(1, &heights);
+        glActiveTexture(GL_TEXTURE0 + height_unit);
+        glBindTexture(GL_TEXTURE_2D, heights);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, 0);
+        glTexImage2D(GL_TEXTURE_2D, 0, format, width, height, 0, GL_RED, format == GL_R16 ? GL_UNSIGNED_SHORT : GL_FLOAT, NULL);
+        std::vector<GLfloat> rows(width * upload_rows);
+        for (int z = 0; z < height; z += upload_rows) {
+            const int count = std::min(upload_rows, height - z);
+            for (int r = 0; r < count; ++r) {
+                for (int x = 0; x < width; ++x) {
+                    rows[r * width + x] = HeightAt(map, x, z + r) * scale;
+                }
+            }
+            upload(0, z, width, count, &rows[0]);
+        }
+
+        // Selected patches, as instances of the grid: first sample x, z,
+        // samples per quad and skirt depth, and the geomorph distances
+        glGenBuffers(1, &instances);
+
+        // The patch grid, followed by the skirts: the border vertices once
+        // more, flagged to hang down
+        std::vector<GLfloat> grid;
+        std::vector<GLushort> indices;
+        const int side = patch + 1;
+        for (int j = 0; j <= patch; ++j) {
+            for (int i = 0; i <= patch; ++i) {
+                grid.push_back(i); grid.push_back(j); grid.push_back(0);
+            }
+        }
+        for (int edge = 0; edge < 4; ++edge) {
+            for (int k = 0; k <= patch; ++k) {
+                grid.push_back(edge < 2 ? k : (edge == 2 ? 0 : patch));
+                grid.push_back(edge < 2 ? (edge == 0 ? 0 : patch) : k);
+                grid.push_back(1);
+            }
+        }
+        for (int j = 0; j < patch; ++j) {
+            for (int i = 0; i < patch; ++i) {
+                const GLushort v = i + j * side;
+                const GLushort quad[] = {v, GLushort(v + side), GLushort(v + 1),
+                                         GLushort(v + 1), GLushort(v + side), GLushort(v + side + 1)};
+                indices.insert(indices.end(), quad, quad + 6);
+            }
+        }
+        for (int edge = 0; edge < 4; ++edge) {
+            for (int k = 0; k < patch; ++k) {
+                GLushort a, b;
+                if (edge < 2) {
+                    a = k + (edge == 0 ? 0 : patch) * side;
+                    b = a + 1;
+                } else {
+                    a = (edge == 2 ? 0 : patch) + k * side;
+                    b = a + side;
+                }
+                const GLushort s = side * side + edge * side + k;
+                const GLushort quad[] = {a, s, b, b, s, GLushort(s + 1)};
+                indices.insert(indices.end(), quad, quad + 6);
+            }
+        }
+        grid_indices = indices.size();
+
+        glGenVertexArrays(1, &vao);
+        glBindVertexArray(vao);
+        glGenBuffers(1, &vb);
+        glBindBuffer(GL_ARRAY_BUFFER, vb);
+        glBufferData(GL_ARRAY_BUFFER, grid.size() * sizeof(GLfloat), &grid[0], GL_STATIC_DRAW);
+        GLint location = glGetAttribLocation(program, "inGrid");
+        glVertexAttribPointer(location, 3, GL_FLOAT, GL_FALSE, 0, 0);
+        glEnableVertexAttribArray(location);
+        glGenBuffers(1, &ib);
+        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, ib);
+        glBufferData(GL_ELEMENT_ARRAY_BUFFER, indices.size() * sizeof(GLushort), &indices[0], GL_STATIC_DRAW);
+        glBindBuffer(GL_ARRAY_BUFFER, instances);
+        location = glGetAttribLocation(program, "inPatch");
+        glVertexAttribPointer(location, 4, GL_FLOAT, GL_FALSE, sizeof(GLfloat) * instance_floats, 0);
+        glVertexAttribDivisor(location, 1);
+        glEnableVertexAttribArray(location);
+        location = glGetAttribLocation(program, "inMorph");
+        glVertexAttribPointer(location, 2, GL_FLOAT, GL_FALSE, sizeof(GLfloat) * instance_floats, (GLvoid*)(sizeof(GLfloat) * 4));
+        glVertexAttribDivisor(location, 1);
+        glEnableVertexAttribArray(location);
+        glBindVertexArray(0);
+
+        eye_location = glGetUniformLocation(program, "eye");
+        range_location = glGetUniformLocation(program, "heightRange");
+    }
+
+    TerrainLod::~TerrainLod() {
+        glDeleteTextures(1, &heights);
+        glDeleteBuffers(1, &vb);
+        glDeleteBuffers(1, &ib);
+        glDeleteBuffers(1, &instances);
+        glDeleteVertexArrays(1, &vao);
+    }
+
+    int TerrainLod::build(const Heightmap* map, const double scale, const int x, const int z, const int step) {
+        if (x >= width - 1 || z >= height - 1) return -1;
+        const int index = nodes.size();
+        nodes.push_back(Node());
+
+        Node n;
+        n.x = x;
+        n.z = z;
+        n.step = step;
+        n.error = 0;
+        std::fill(n.children, n.children + 4, -1);
+        if (step == 1) {
+            n.lo = n.hi = sample(map, scale, x, z);
+            for (int j = z; j <= std::min(z + patch, height - 1); ++j) {
+                for (int i = x; i <= std::min(x + patch, width - 1); ++i) {
+                    const float h = sample(map, scale, i, j);
+                    n.lo = std::min(n.lo, h);
+                    n.hi = std::max(n.hi, h);
+                }
+            }
+        } else {
+            const int half = step / 2;
+            float below = 0;
+            n.lo = HUGE_VALF;
+            n.hi = -HUGE_VALF;
+            for (int c = 0; c < 4; ++c) {
+                n.children[c] = build(map, scale, x + (c & 1) * patch * half, z + (c >> 1) * patch * half, half);
+                if (n.children[c] < 0) continue;
+                const Node& child = nodes[n.children[c]];
+                n.lo = std::min(n.lo, child.lo);
+                n.hi = std::max(n.hi, child.hi);
+                below = std::max(below, child.error);
+            }
+
+            // How far the samples of the level below are from this level,
+            // whose triangles split each quad from x + step, z to x, z + step
+            float own = 0;
+            for (int j = 0; j <= 2 * patch; ++j) {
+                for (int i = j & 1 ? 0 : 1; i <= 2 * patch; i += j & 1 ? 1 : 2) {
+                    const int sx = x + i * half, sz = z + j * half;
+                    if (sx > width - 1 || sz > height - 1) continue;
+                    const int dx = (i & 1) * half, dz = -(j & 1) * half;
+                    const float coarse = 0.5f * (sample(map, scale, sx + dx, sz + dz) + sample(map, scale, sx - dx, sz - dz));
+                    own = std::max(own, std::abs(sample(map, scale, sx, sz) - coarse));
+                }
+            }
+            n.error = own + below;
+        }
+        nodes[index] = n;
+        return index;
+    }
+
+    void TerrainLod::draw(const Transform<float, 3, Projective>& modelview, const float* projection) {
+        if (nodes.empty()) return;
+
+        // Frustum planes and the eye in model space, and the pixels one
+        // length unit at unit distance covers, as in tools::select_lod
+        Matrix4f mvp = Map<const Matrix4f>(projection) * modelview.matrix();
+        for (int i = 0; i < 6; ++i) {
+            planes[i] = mvp.row(3).transpose() + (i % 2 ? -1.0f : 1.0f) * mvp.row(i / 2).transpose();
+            planes[i] /= planes[i].head<3>().norm();
+        }
+        Vector4f origin = modelview.matrix().inverse() * Vector4f(0, 0, 0, 1);
+        eye = origin.head<3>() / origin[3];
+        float scale = 0;
+        for (int i = 0; i < 3; ++i) {
+            scale = std::max(scale, modelview.matrix().block<3, 1>(0, i).norm());
+        }
+        GLint viewport[4];
+        glGetIntegerv(GL_VIEWPORT, viewport);
+        pixels_per_unit = scale * projection[5] * viewport[3] / 2;
+
+        glActiveTexture(GL_TEXTURE0 + height_unit);
+        glBindTexture(GL_TEXTURE_2D, heights);
+        glActiveTexture(GL_TEXTURE0);
+        glUniform1i(glGetUniformLocation(program, "heights"), height_unit);
+        glUniform3fv(eye_location, 1, eye.data());
+        glUniform2fv(range_location, 1, range);
+
+        selected.clear();
+        select(0, 0, 0, 0);
+        const GLsizei count = selected.size() / instance_floats;
+        if (count == 0) return;
+
+        glBindVertexArray(vao);
+        glBindBuffer(GL_ARRAY_BUFFER, instances);
+        glBufferData(GL_ARRAY_BUFFER, selected.size() * sizeof(GLfloat), &selected[0], GL_STREAM_DRAW);
+        glDrawElementsInstanced(GL_TRIANGLES, grid_indices, GL_UNSIGNED_SHORT, 0, count);
+        drawStats.stateChanges += 2;
+        drawStats.drawCalls++;
+        drawStats.triangles += grid_indices / 3 * count;
+    }
+
+    void TerrainLod::edit(const int x, const int z, const int w, const int h, const float* data) {
+        if (w <= 0 || h <= 0) return;
+        upload(x, z, w, h, data);
+        const float lo = *std::min_element(data, data + w * h);
+        const float hi = *std::max_element(data, data + w * h);
+        if (!nodes.empty()) widen(0, x, z, x + w - 1, z + h - 1, lo, hi);
+    }
+
+    void TerrainLod::upload(const int x, const int z, const int w, const int h, const float* data) {
+        GLint alignment;
+        glGetIntegerv(GL_UNPACK_ALIGNMENT, &alignment);
+        glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+        glActiveTexture(GL_TEXTURE0 + height_unit);
+        glBindTexture(GL_TEXTURE_2D, heights);
+        if (format == GL_R16) {
+            std::vector<GLushort> texels(w * h);
+            for (int i = 0; i < w * h; ++i) {
+                const float t = (data[i] - range[0]) / range[1] * 65535 + 0.5f;
+                texels[i] = GLushort(std::max(0.0f, std::min(t, 65535.0f)));
+            }
+            glTexSubImage2D(GL_TEXTURE_2D, 0, x, z, w, h, GL_RED, GL_UNSIGNED_SHORT, &texels[0]);
+        } else {
+            glTexSubImage2D(GL_TEXTURE_2D, 0, x, z, w, h, GL_RED, GL_FLOAT, data);
+        }
+        glActiveTexture(GL_TEXTURE0);
+        glPixelStorei(GL_UNPACK_ALIGNMENT, alignment);
+    }
+
+    void TerrainLod::widen(const int index, const int x0, const int z0, const int x1, const int z1, const float lo, const float hi) {
+        Node& n = nodes[index];
+        const int extent = patch * n.step;
+        if (x1 < n.x || z1 < n.z || x0 > n.x + extent || z0 > n.z + extent) return;
+
+        // No height changed by more than this, since the old ones were
+        // within the patch's range
+        const float change = std::max(0.0f, std::max(hi - n.lo, n.hi - lo));
+        n.error += 2 * change;
+        n.lo = std::min(n.lo, lo);
+        n.hi = std::max(n.hi, hi);
+        for (int c = 0; c < 4; ++c) {
+            if (n.children[c] >= 0) widen(n.children[c], x0, z0, x1, z1, lo, hi);
+        }
+    }
+
+    void TerrainLod::select(const int index, const float parent_distance, const float parent_error, const float skirt) {
+        const Node& n = nodes[index];
+        const Vector3f lo(n.x, n.lo, n.z);
+        const Vector3f hi(std::min(n.x + patch * n.step, width - 1), n.hi, std::min(n.z + patch * n.step, height - 1));
+
+        for (int i = 0; i < 6; ++i) {
+            const Vector3f p((planes[i][0] > 0 ? hi : lo)[0], (planes[i][1] > 0 ? hi : lo)[1], (planes[i][2] > 0 ? hi : lo)[2]);
+            if (planes[i].head<3>().dot(p) + planes[i][3] < 0) {
+                drawStats.culled++;
+                return;
+            }
+        }
+
+        // Closer than this, the patch is more than pixels off on screen
+        const float distance = (eye - eye.cwiseMax(lo).cwiseMin(hi)).norm();
+        const float split = pixels > 0 ? n.error * pixels_per_unit / pixels : HUGE_VALF;
+        if (distance < split && n.children[0] >= 0) {
+            for (int c = 0; c < 4; ++c) {
+                if (n.children[c] >= 0) select(n.children[c], split, n.error, parent_error);
+            }
+            return;
+        }
+
+        // Skirts as deep as neighbours two levels coarser may be off, and
+        // geomorphing over the second half of the distance to the parent
+        const bool morph = geomorph && parent_distance > 0 && parent_distance < HUGE_VALF;
+        const GLfloat instance[instance_floats] = {
+            GLfloat(n.x), GLfloat(n.z), GLfloat(n.step), std::max(skirt, parent_error),
+            morph ? 0.5f * parent_distance : 0.0f, morph ? parent_distance : 0.0f
+        };
+        selected.insert(selected.end(), instance, instance + instance_floats);
+    }
+}
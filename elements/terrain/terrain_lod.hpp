@@ -0,0 +1,97 @@
+/**
+ * Copyright 2012 Jonatan Olofsson
+ *
+ * This file is part of C++ GL Framework (CPGL).
+ *
+ * CPGL is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * CPGL is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with CPGL.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef CPGL_TERRAIN_LOD_HPP_
+#define CPGL_TERRAIN_LOD_HPP_
+
+#include "cpgl/cpgl.hpp"
+#include <Eigen/Core>
+#include <Eigen/Geometry>
+#include <vector>
+
+namespace CPGL {
+    using namespace Eigen;
+
+    /**
+     * Geomipmapped terrain: a quadtree of patches of patch_size quads, each
+     * level taking every other sample of the one below. The patches drawn
+     * are the coarsest whose error is at most lod_pixels on screen, or the
+     * finest with lod_pixels 0. Every patch is an instance of the same
+     * grid, placed and displaced by terrain_lod.vert from a GL_R16 or
+     * GL_R32F texture of the heights, so all are drawn at once. Skirts
+     * around the patches hide the cracks between levels, and with geomorph
+     * the vertices a level drops move onto the coarser surface before it
+     * is drawn instead.
+     */
+    class TerrainLod {
+        public:
+            TerrainLod(const Heightmap* map, const double scale, const GLuint program, const GLenum format,
+                       const int patch_size, const float pixels, const bool geomorph);
+            ~TerrainLod();
+
+            /**
+             * Select and draw the patches, with the program in use. The
+             * modelview excludes any scaling of compact positions.
+             */
+            void draw(const Transform<float, 3, Projective>& modelview, const float* projection);
+
+            /**
+             * Replace the w by h heights from sample x, z with data, in
+             * length units, row by row. Only the texture changes, not the
+             * heightmap. The errors of the patches that cover the edit
+             * grow by a bound on the change instead of being measured
+             * again. With GL_R16, heights outside the range of the
+             * terrain when it was loaded are clamped to it.
+             */
+            void edit(const int x, const int z, const int w, const int h, const float* data);
+
+        private:
+            struct Node {
+                int x, z, step;         // First sample, and samples per quad
+                float error;            // From the full heightmap, in length units
+                float lo, hi;           // Heights within
+                int children[4];        // Indices, or -1
+            };
+
+            GLuint program;
+            GLuint heights;             // One texel per sample
+            GLenum format;              // GL_R16 or GL_R32F
+            GLfloat range[2];           // Height of texel 0, and from 0 to 1
+            GLuint vao, vb, ib, instances;
+            GLsizei grid_indices;
+            int width, height, patch;
+            float pixels;
+            bool geomorph;
+            std::vector<Node> nodes;
+            GLint eye_location, range_location;
+
+            // Per draw
+            Vector4f planes[6];
+            Vector3f eye;
+            float pixels_per_unit;      // At unit distance
+            std::vector<GLfloat> selected;  // Instances
+
+            int build(const Heightmap* map, const double scale, const int x, const int z, const int step);
+            void select(const int node, const float parent_distance, const float parent_error, const float skirt);
+            void upload(const int x, const int z, const int w, const int h, const float* data);
+            void widen(const int node, const int x0, const int z0, const int x1, const int z1, const float lo, const float hi);
+    };
+}
+
+#endif
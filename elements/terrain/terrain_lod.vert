@@ -0,0 +1,44 @@
+#version 150
+
+in vec3 inGrid; // Vertex of the patch in quads, and 1 on the skirts
+in vec4 inPatch; // First sample x, z, samples per quad and skirt depth
+in vec2 inMorph; // Distances over which to morph to the coarser level
+out vec2 texCoord;
+out vec3 transformedNormal;
+
+uniform mat4 projectionMatrix;
+uniform mat4 baseMatrix;
+uniform vec4 texTransform; // Scale and offset within the texture layer
+
+uniform sampler2D heights;
+uniform vec2 heightRange; // Height of texel 0, and from 0 to 1
+uniform vec3 eye; // In model space
+
+float height(ivec2 p)
+{
+    return heightRange.x + heightRange.y * texelFetch(heights, clamp(p, ivec2(0), textureSize(heights, 0) - 1), 0).r;
+}
+
+void main(void)
+{
+    int step = int(inPatch.z);
+    ivec2 local = ivec2(inGrid.xy);
+    ivec2 p = min(ivec2(inPatch.xy) + local * step, textureSize(heights, 0) - 1);
+    float h = height(p);
+
+    // The vertices that the coarser level drops move onto its triangles,
+    // which split each quad from x + step, z to x, z + step
+    if (inMorph.y > inMorph.x) {
+        float k = clamp((distance(eye, vec3(p.x, h, p.y)) - inMorph.x) / (inMorph.y - inMorph.x), 0.0, 1.0);
+        ivec2 d = ivec2(local.x & 1, -(local.y & 1)) * step;
+        h = mix(h, 0.5 * (height(p + d) + height(p - d)), k);
+    }
+    h -= inGrid.z * inPatch.w;
+
+    vec3 normal = vec3(height(p - ivec2(step, 0)) - height(p + ivec2(step, 0)),
+                       2.0 * step,
+                       height(p - ivec2(0, step)) - height(p + ivec2(0, step)));
+    transformedNormal = normalize(normal);
+    texCoord = vec2(p) * texTransform.xy + texTransform.zw;
+    gl_Position = projectionMatrix * baseMatrix * vec4(p.x, h, p.y, 1.0);
+}
@@ -0,0 +1,21 @@
+#version 150
+
+out vec4 outColor;
+in vec2 texCoord;
+in vec3 transformedNormal;
+uniform bool vt_feedback;
+
+vec4 vt_sample(vec2 uv);
+vec4 vt_request(vec2 uv);
+
+void main(void)
+{
+    if (vt_feedback) {
+        outColor = vt_request(texCoord);
+        return;
+    }
+
+    const vec3 light = vec3(0.58, 0.58, 0.58);
+    float shade = clamp(dot(normalize(transformedNormal), light), 0, 1);
+    outColor = vec4(vec3(vt_sample(texCoord))*shade, 1.0);
+}
@@ -18,6 +18,18 @@ void printError(const char *functionName);
 GLuint loadShaders(const char *vertFileName, const char *fragFileName);
 void dumpInfo(void);
 
+// Per-frame draw statistics, bumped by DrawModel and reset by the frame loop
+typedef struct
+{
+    unsigned int drawCalls;
+    unsigned int triangles;
+    unsigned int stateChanges; // VAO, program and texture binds
+    unsigned int culled; // Elements or chunks rejected before drawing
+} DrawStats;
+
+extern DrawStats drawStats;
+void resetDrawStats(void);
+
 void initKeymapManager();
 char keyIsDown(unsigned char c);
 
@@ -48,6 +48,8 @@ bool LoadTGATexture(char *filename, TextureData *texture);
 void LoadTGATextureSimple(char *filename, GLuint *tex);
 
 bool LoadTGATextureData(char *filename, TextureData *texture);  // Loads A TGA File Into Memory but doesn't create the texture.
+bool LoadTGAHeader(char *filename, TextureData *texture);   // Size and depth only, imageData is NULL.
+bool HasTextureStorage(void);   // glTexStorage2D can be used
 void SaveTGA(TextureData *tex, char *filename);
 
 #endif
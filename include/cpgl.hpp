@@ -40,5 +40,8 @@ namespace CPGL {
 
 #include "BaseElement.hpp"
 #include "tools.hpp"
+#include "stats.hpp"
+#include "streaming.hpp"
+#include "virtual_texture.hpp"
 
 #endif
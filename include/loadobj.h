@@ -6,6 +6,20 @@
 #else
 	#include <GL/gl.h>
 #endif
+#include <stddef.h>
+
+#define kMeshletTriangles 124
+#define kMeshletVertices 64
+#define MeshletStride(n) (((n) + 3) & ~3)
+
+// A level of detail, as a range of the index array
+#define kMaxLods 8
+typedef struct
+{
+  int first;
+  int count;
+  float error; // Distance from the full mesh, in model units
+} ModelLod;
 
 typedef struct
 {
@@ -20,17 +34,109 @@ typedef struct
   // Space for saving VBO and VAO IDs
   GLuint vao; // VAO
   GLuint vb, ib, nb, tb; // VBOs
+  GLenum indexType; // Set by the uploaders, 16 bit when possible
+
+  // Compact positions are stored relative to the mesh bounds, and are
+  // positionOffset + positionScale * p in model space. Set by the uploaders.
+  GLfloat positionOffset[3];
+  GLfloat positionScale[3];
+
+  // Levels of detail (kModelLods), or numLods = 0 for just the mesh. Level 0
+  // is the full mesh, and the coarser levels follow it in indexArray.
+  int numLods;
+  ModelLod lods[kMaxLods];
+  GLfloat center[3]; // Bounding sphere, set with the levels
+  GLfloat radius;
+
+  // Meshlets of level 0 (kModelMeshlets): ranges of the index array as
+  // first, count pairs, and their bounds for culling as eight rows of
+  // MeshletStride(numMeshlets) floats: the bounding sphere centre x, y, z
+  // and radius, the normal cone axis x, y, z and cutoff. Unlike the other
+  // arrays they are not released with ReleaseModelArrays.
+  int numMeshlets;
+  GLuint* meshletRanges;
+  GLfloat* meshletBounds;
+
+  // Set when the arrays point into a mapped cache file
+  void* mapping;
+  size_t mappingSize;
 } Model;
 
+// Vertex format descriptor, naming the shader variable that each used
+// Model array is bound to. Arrays are interleaved in the listed order.
+#define kVertexPosition 0
+#define kVertexNormal 1
+#define kVertexTexCoord 2
+
+// Attribute encodings. Compact normals are GL_INT_2_10_10_10_REV, compact
+// texture coordinates normalized shorts when within [0, 1], else half
+// floats, and compact positions normalized shorts over the mesh bounds.
+#define kVertexFloat 0
+#define kVertexCompact 1
+
+typedef struct
+{
+  int array; // kVertexPosition, kVertexNormal or kVertexTexCoord
+  const char* name;
+  int encoding; // kVertexFloat or kVertexCompact
+} VertexAttrib;
+
+#define kMaxVertexAttribs 8
+typedef struct
+{
+  int numAttribs;
+  VertexAttrib attribs[kMaxVertexAttribs];
+} VertexFormat;
+
+// Bump when the processing in LoadModel changes, to invalidate caches
+#define MODEL_CACHE_VERSION 3
+
+// Parses and processes an OBJ file without touching GL, so several
+// models may be loaded in parallel from different threads.
 Model* LoadModel(char* name);
 
+// Options for LoadModelCached and OptimizeModel (meshopt.h)
+#define kModelOptimizeVertexCache 0x1 // Reorder for the post-transform cache
+#define kModelOptimizeOverdraw 0x2 // Also draw outward-facing clusters first
+#define kModelLods 0x4 // Build levels of detail by edge collapse
+#define kModelMeshlets 0x8 // Split the full mesh into meshlets for culling
+
+// As LoadModel, but through a binary cache file that is written on the
+// first load and memory-mapped on later ones. The cache is keyed by the
+// source file's size and modification time and by the options, which
+// are applied before the cache is written.
+Model* LoadModelCached(char* name, char* cacheName, unsigned int options);
+
+// Free (or unmap) the CPU copies of the arrays of an uploaded model. The
+// GL objects and levels of detail remain, so it can still be drawn.
+void ReleaseModelArrays(Model *m);
+
+// Load the arrays of a released model again, through the cache when
+// cacheName is not NULL. Returns 0 if the source no longer matches.
+int RefetchModelArrays(Model *m, char* name, char* cacheName, unsigned int options);
+
 // NEW:
 
 void DrawModel(Model *m);
+// Draw a level of detail, clamped to those the model has
+void DrawModelLod(Model *m, int level);
+// Draw the full mesh, leaving out meshlets that are outside the view
+// frustum, and with cones those facing away, culling back faces for the
+// draw so that the result does not change. Column major matrices.
+void DrawModelMeshlets(Model *m, const GLfloat *modelview, const GLfloat *projection, int cones);
 Model* LoadModelPlus(char* name,
 			GLuint program,
 			char* vertexVariableName,
 			char* normalVariableName,
 			char* texCoordVariableName);
+// Create the VAO and a single interleaved VBO of a loaded model, with the
+// attributes of the format (those unused by the program are left out)
+void UploadModelInterleaved(Model *m, GLuint program, const VertexFormat *format);
+// Create the VAO and VBOs of a loaded model
+void UploadModel(Model *m,
+			GLuint program,
+			char* vertexVariableName,
+			char* normalVariableName,
+			char* texCoordVariableName);
 
 #endif
@@ -28,7 +28,10 @@
 #include <GL/gl.h>
 #include <cstring>
 #include <vector>
+#include <map>
+#include <string>
 #include <iostream>
+#include "stats.hpp"
 
 namespace CPGL {
     namespace CL {
@@ -86,6 +89,26 @@ namespace CPGL {
             };
             return error_strings[-error];
         }
+        /**
+         * Aggregated timings of all profiled launches of one kernel
+         */
+        struct KernelProfile {
+            unsigned long count;
+            cl_ulong total_ns;      // Sum of end - start
+            cl_ulong max_ns;
+            cl_ulong queue_ns;      // Sum of start - queued
+            cl_ulong max_queue_ns;
+            cl_ulong submit_ns;     // Sum of submit - queued
+
+            KernelProfile() : count(0), total_ns(0), max_ns(0), queue_ns(0), max_queue_ns(0), submit_ns(0) {}
+            double mean_ms() const { return count ? total_ns / (1e6 * count) : 0.0; }
+            double max_ms() const { return max_ns / 1e6; }
+            double mean_queue_ms() const { return count ? queue_ns / (1e6 * count) : 0.0; }
+            double max_queue_ms() const { return max_queue_ns / 1e6; }
+            double mean_submit_ms() const { return count ? submit_ns / (1e6 * count) : 0.0; }
+        };
+        typedef std::map<std::string, KernelProfile> profile_map;
+
         template<int WORK_DIM>
         class Kernel;
         class Host {
@@ -110,6 +133,18 @@ namespace CPGL {
 
                 cl_int error_code;
 
+                /**
+                 * Opt-in (opencl: profiling: true in the configuration, or set
+                 * before loading kernels) creation of profiling command queues.
+                 * Finished launches are collected without blocking by Kernel::run
+                 * and Kernel::finish.
+                 */
+                bool profiling;
+                profile_map profiles;
+                void record_profile(const std::string& kernel_name, cl_event event);
+                const KernelProfile& profile(const std::string& kernel_name) { return profiles[kernel_name]; }
+                void print_profile(std::ostream& out) const;
+
                 void buildExecutable(const char*);
 
                 cl_mem bind_gl_vbo(GLuint buffer_id, cl_mem_flags flags = CL_MEM_WRITE_ONLY) {
@@ -124,6 +159,7 @@ namespace CPGL {
         class Kernel {
             private:
                 Host* host;
+                std::vector<cl_event> pending; // Profiled launches not yet completed
 
             public:
                 size_t global_work_size[WORK_DIM];
@@ -133,18 +169,19 @@ namespace CPGL {
                 cl_command_queue command_queue;
                 cl_event event;
                 cl_kernel kernel;
+                std::string name;
 
                 void set_work_size(const size_t* global_work_size_, const size_t* local_work_size_) {
                     std::memcpy(global_work_size, global_work_size_, sizeof(global_work_size));
                     std::memcpy(local_work_size, local_work_size_, sizeof(local_work_size));
                 }
 
-                Kernel(Host* host, const std::string kernel_name, const size_t* global_work_size_, const size_t* local_work_size_) {
+                Kernel(Host* host, const std::string kernel_name, const size_t* global_work_size_, const size_t* local_work_size_) : event(NULL), name(kernel_name) {
                     set_work_size(global_work_size_, local_work_size_);
                     this->host = host;
 
                     // Create the command queue we will use to execute OpenCL commands
-                    command_queue = clCreateCommandQueue(host->context, host->devices[host->deviceUsed], NULL, &err);
+                    command_queue = clCreateCommandQueue(host->context, host->devices[host->deviceUsed], queue_properties(), &err);
                     std::cout << "clCreateCommandQueue: " << error_string(err) << std::endl;
 
                     // Initialize our kernel from the program
@@ -152,11 +189,11 @@ namespace CPGL {
                     std::cout << "clCreateKernel: " << error_string(err) << std::endl;
                 }
 
-                Kernel(Host* host, const std::string kernel_name) {
+                Kernel(Host* host, const std::string kernel_name) : event(NULL), name(kernel_name) {
                     this->host = host;
 
                     // Create the command queue we will use to execute OpenCL commands
-                    command_queue = clCreateCommandQueue(host->context, host->devices[host->deviceUsed], NULL, &err);
+                    command_queue = clCreateCommandQueue(host->context, host->devices[host->deviceUsed], queue_properties(), &err);
                     std::cout << "clCreateCommandQueue: " << error_string(err) << std::endl;
 
                     // Initialize our kernel from the program
@@ -165,6 +202,9 @@ namespace CPGL {
                 }
                 ~Kernel() {
                     std::cout << "Releasing OpenCL App Memory" << std::endl;
+                    if(command_queue) finish();
+                    for(std::vector<cl_event>::iterator it = pending.begin(); it != pending.end(); ++it) clReleaseEvent(*it);
+                    if(event) clReleaseEvent(event);
                     if(kernel) clReleaseKernel(kernel);
                     if(command_queue) clReleaseCommandQueue(command_queue);
                     // Release any and all cl resources
@@ -186,19 +226,50 @@ namespace CPGL {
                 }
                 void operator()(bool) { run(); finish(); }
 
+                cl_command_queue_properties queue_properties() {
+                    return host->profiling ? CL_QUEUE_PROFILING_ENABLE : 0;
+                }
+
                 void run() {
+                    if(host->profiling) collect();
+                    if(event) clReleaseEvent(event);
                     cl_int err = clEnqueueNDRangeKernel(command_queue, kernel, WORK_DIM, NULL, global_work_size, local_work_size, 0, NULL, &event);
                     if(err) {
+                        event = NULL;
                         std::cerr << "Ran the kernel: " << error_string(err) << "\t global work size: " << global_work_size[0] << ", local: " << local_work_size[0] << std::endl;
+                    } else if(host->profiling) {
+                        clRetainEvent(event);
+                        pending.push_back(event);
+                    }
+                }
+
+                /**
+                 * Hand the timestamps of completed launches to the host, without waiting
+                 */
+                void collect() {
+                    std::vector<cl_event>::iterator it = pending.begin();
+                    while(it != pending.end()) {
+                        cl_int status;
+                        clGetEventInfo(*it, CL_EVENT_COMMAND_EXECUTION_STATUS, sizeof(status), &status, NULL);
+                        if(status > CL_COMPLETE) {
+                            ++it;
+                            continue;
+                        }
+                        if(status == CL_COMPLETE) host->record_profile(name, *it);
+                        clReleaseEvent(*it);
+                        it = pending.erase(it);
                     }
                 }
 
                 void finish() {
+                    stats::Scope s("clFinish");
                     clFinish(command_queue);
+                    if(host->profiling) collect();
                 }
 
                 void acquire_gl(cl_mem* vbo_cl) {
                     //~ std::cout << "Aqcuire gl" << std::endl;
+                    stats::Scope s("glFinish");
                     glFinish();
                     //~ std::cout << "gl finished" << std::endl;
                     cl_int err = clEnqueueAcquireGLObjects(command_queue, 1, vbo_cl, 0,0,0);
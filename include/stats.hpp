@@ -0,0 +1,114 @@
+/**
+ * Copyright 2012 Jonatan Olofsson
+ *
+ * This file is part of C++ GL Framework (CPGL).
+ *
+ * CPGL is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * CPGL is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with CPGL.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef CPGL_STATS_HPP_
+#define CPGL_STATS_HPP_
+
+#include <string>
+#include <vector>
+#include <ostream>
+#include <chrono>
+#include <boost/circular_buffer.hpp>
+#include "yaml-cpp/yaml.h"
+#include "GL_utilities.h"
+
+namespace CPGL {
+    namespace core {
+        class BaseElement;
+    }
+    namespace stats {
+        typedef std::chrono::steady_clock clock;
+
+        struct FrameStats {
+            float frame_ms;     // Time since the previous frame started
+            float draw_ms;      // Time spent traversing the scene-graph
+            DrawStats draw;     // Counters accumulated during the frame
+            long resident_kb;   // Resident set size of the process
+            unsigned long frame;
+        };
+
+        /**
+         * A timed GL/CL call, relative to the start of its frame
+         */
+        struct Call {
+            const char* name;
+            float start_ms;
+            float ms;
+        };
+
+        /**
+         * A frame over budget, with the slowest element and calls of that frame
+         */
+        struct Stutter {
+            unsigned long frame;
+            float frame_ms;
+            std::string element;
+            float element_ms;
+            std::vector<Call> calls;
+        };
+
+        /**
+         * Read the "monitor" section of the configuration;
+         * budget_ms, log_size, bin_ms and bins
+         */
+        void configure(const YAML::Node& c);
+
+        /**
+         * Called by the frame loop before drawing a window, once its
+         * scene-graph is drawn, and after the buffers are swapped
+         */
+        void begin_frame();
+        void end_draw();
+        void end_frame();
+
+        /**
+         * Statistics of the last completed frame
+         */
+        const FrameStats& last_frame();
+
+        /**
+         * Called by BaseElement::DRAW with the time of its own draw()
+         */
+        void element_drawn(core::BaseElement* element, float ms);
+
+        /**
+         * Times a (potentially blocking) GL/CL call for the current frame.
+         * The name must outlive the frame, i.e. be a string literal.
+         */
+        class Scope {
+            private:
+                const char* name;
+                clock::time_point start;
+            public:
+                Scope(const char* n);
+                ~Scope();
+        };
+
+        float budget_ms();
+        float bin_ms();
+        const std::vector<unsigned long>& histogram();
+        const boost::circular_buffer<Stutter>& stutters();
+        unsigned long stutter_count();
+        void print_stutters(std::ostream& out);
+
+        long resident_memory_kb();
+    }
+}
+
+#endif
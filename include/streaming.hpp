@@ -0,0 +1,64 @@
+/**
+ * Copyright 2012 Jonatan Olofsson
+ *
+ * This file is part of C++ GL Framework (CPGL).
+ *
+ * CPGL is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * CPGL is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with CPGL.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef CPGL_STREAMING_HPP_
+#define CPGL_STREAMING_HPP_
+
+#include <GL/gl.h>
+#include <string>
+#include "yaml-cpp/yaml.h"
+
+namespace CPGL {
+    namespace streaming {
+        /**
+         * Read the "textures" section of the configuration;
+         * workers, upload_kb (per frame), staging_buffers and staging_kb
+         */
+        void configure(const YAML::Node& c);
+
+        /**
+         * Queue a TGA file for decoding on the worker threads. The returned
+         * texture is usable at once, showing a grey placeholder until the
+         * image has been uploaded. Mip levels come from the mip builder,
+         * through the cache file unless it is "", and are uploaded
+         * coarsest first, so the texture sharpens over a few frames.
+         */
+        GLuint load_texture(const std::string path, const bool create_mipmaps = true, const std::string cache = "");
+
+        /**
+         * Queue a TGA file for one layer of a texture array that already has
+         * storage for its size and whole mip chain. Levels are written over
+         * the layer coarsest first, like the levels of load_texture.
+         */
+        void load_texture_layer(const GLuint array, const GLint layer, const std::string path, const std::string cache = "");
+
+        /**
+         * Called by the frame loop after drawing; uploads decoded images
+         * through the staging buffers within the per-frame byte budget
+         */
+        void update();
+
+        /**
+         * Textures requested but not yet completely uploaded
+         */
+        size_t pending();
+    }
+}
+
+#endif
@@ -25,6 +25,9 @@
 extern "C" {
     // This is the best library in the world
     #include "LoadTGA2.h"
+    #include "mipmap.h"
+    #include "ktx.h"
+    #include "heightmap.h"
     #ifdef bool
         #undef bool
     #endif
@@ -39,18 +42,105 @@ namespace CPGL {
     namespace tools {
         GLuint load_shaders(const std::string module,const std::string vs, const std::string fs);
         GLuint load_shaders(const std::string module,const std::string vs, const std::string gs, const std::string fs);
+        /**
+         * Link the shaders with a compiled shader object defining functions
+         * that they declare, such as streaming::virtual_texture_shader()
+         */
+        GLuint load_shaders(const std::string module,const std::string vs, const std::string fs, const GLuint library);
 
+        /**
+         * Vertex format with the given shader variables, NULL to leave one out.
+         * Normals and texture coordinates are compact unless mesh_compact: false.
+         */
+        VertexFormat vertex_format(const char* position, const char* normal = NULL, const char* texcoord = NULL);
+
+        /**
+         * Load a model into a single interleaved vertex buffer, holding the
+         * attributes of the format that the program uses. The residency of
+         * the CPU copy after upload is "keep" or "drop", by default
+         * mesh_residency: (drop). fetch_model brings dropped arrays back.
+         */
+        Model* load_model(
+            const std::string module,
+            const std::string name,
+            const GLuint program,
+            const VertexFormat& format,
+            const std::string residency = "");
         Model* load_model(
             const std::string module,
             const std::string name,
             const GLuint program,
             const std::string vertexVariableName,
             const std::string normalVariableName,
-            const std::string texCoordVariableName);
+            const std::string texCoordVariableName,
+            const std::string residency = "");
+        bool fetch_model(const std::string module, const std::string name, Model* m);
+        std::string model_path(const std::string module, const std::string name);
+        /**
+         * Where the processed model is cached; directories: cache: in the
+         * configuration, or next to the model. Disable with mesh_cache: false.
+         */
+        std::string model_cache_path(const std::string module, const std::string name, const std::string path);
+        /**
+         * Loader options: mesh_optimize: (default true) reorders for the
+         * vertex cache, mesh_overdraw: (default false) also for overdraw,
+         * mesh_lods: (default false) builds levels of detail and
+         * mesh_meshlets: (default false) meshlets for culling.
+         */
+        unsigned int model_options();
+        /**
+         * Level of detail to draw a model with, from its projected error in
+         * pixels (lod_pixels:, default 1). Matrices are column major, as
+         * get_base().data() and get_projection().
+         */
+        int select_lod(const Model* m, const float* modelview, const float* projection);
+        /**
+         * Draw a model at its selected level of detail, culling meshlets
+         * (mesh_meshlets:) when it is drawn in full
+         */
+        void draw_model(Model* m, const float* modelview, const float* projection);
 
         GLuint compile_shader(GLuint type, const std::string path);
+        /**
+         * Textures with mipmaps get their levels from the CPU mip builder,
+         * cached next to the texture (or in directories: cache:) unless
+         * texture_cache: false. texture_filter: kaiser (default) or box,
+         * and texture_srgb: (default false) to filter in linear light.
+         * A .ktx file from tga2ktx, given directly or next to a TGA file
+         * that is not newer (unless texture_ktx: false), is used instead;
+         * load_texture_struct only decodes .ktx files given directly.
+         */
         GLuint load_texture(const std::string module, const std::string texture, const GLuint which_tex = GL_TEXTURE0, const bool create_mipmaps = true);
         TextureData load_texture_struct(const std::string module, const std::string texture, const bool create_mipmaps = true);
+        bool load_mip_chain(const std::string module, const std::string texture, MipChain* chain);
+        std::string texture_cache_path(const std::string module, const std::string texture, const std::string path);
+        unsigned int texture_options();
+        /**
+         * Load a texture in the background; see streaming::load_texture
+         */
+        GLuint load_texture_async(const std::string module, const std::string texture, const bool create_mipmaps = true);
+
+        /**
+         * A layer of a GL_TEXTURE_2D_ARRAY, shared by the textures of one
+         * size; sample it at vec3(uv * transform.xy + transform.zw, layer)
+         */
+        struct TextureLayer {
+            GLuint texture;
+            GLint layer;
+            GLfloat transform[4];
+        };
+        /**
+         * Put a texture in an array of its size, with texture_layers: (16)
+         * layers each, and stream it in the background; the layer is grey
+         * until then. Loading a texture again gives the same layer.
+         */
+        TextureLayer load_texture_layer(const std::string module, const std::string texture);
+        /**
+         * Bind the array of a layer to a texture unit, unless it already is
+         */
+        void bind_texture_layer(const TextureLayer& layer, const GLuint unit = GL_TEXTURE0);
+        std::string texture_path(const std::string module, const std::string texture);
+        std::string compressed_path(const std::string path);
         void generate_mipmaps(GLuint tex);
         void print_error(const std::string);
         void read_file(const std::string& file, std::string& out);
@@ -24,6 +24,7 @@
 #include "yaml-cpp/yaml.h"
 extern "C" {
     #include "loadobj.h"
+    #include "meshopt.h"
 }
 
 namespace CPGL {
@@ -0,0 +1,161 @@
+/**
+ * Copyright 2012 Jonatan Olofsson
+ *
+ * This file is part of C++ GL Framework (CPGL).
+ *
+ * CPGL is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * CPGL is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with CPGL.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef CPGL_VIRTUAL_TEXTURE_HPP_
+#define CPGL_VIRTUAL_TEXTURE_HPP_
+
+#include <GL/gl.h>
+#include <string>
+#include <vector>
+#include <deque>
+#include <map>
+#include <set>
+#include <boost/thread.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/condition_variable.hpp>
+extern "C" {
+    #include "vtfile.h"
+    #ifdef bool
+        #undef bool
+    #endif
+    #ifdef true
+        #undef true
+    #endif
+    #ifdef false
+        #undef false
+    #endif
+}
+
+namespace CPGL {
+    namespace streaming {
+        /**
+         * A texture far larger than video memory, read by tiles from a file
+         * made by tga2vt. The tiles in use live in a cache texture, found
+         * through a page table that points every tile of every level at the
+         * finest resident tile covering it. Which tiles are in use is read
+         * back from a small feedback pass, and missing tiles are read from
+         * disk on a thread of their own.
+         *
+         * Fragment shaders declare vec4 vt_sample(vec2 uv) and
+         * vec4 vt_request(vec2 uv), and are linked with
+         * virtual_texture_shader(). In the feedback pass the uniform bool
+         * vt_feedback is set, and the shader writes vt_request(uv) instead
+         * of its colour.
+         *
+         * The "textures" section of the configuration sets virtual_cache_tiles
+         * (16, tiles along each side of the cache), virtual_feedback_divisor
+         * (8, of the viewport size) and virtual_tiles_per_frame (8 uploads).
+         */
+        class VirtualTexture {
+            public:
+                VirtualTexture(const std::string path);
+                ~VirtualTexture();
+
+                bool valid() const { return file.numLevels > 0; }
+
+                /**
+                 * Bind the page table and tile cache and set the uniforms of
+                 * the program in use, for drawing
+                 */
+                void bind(const GLuint program, const GLuint page_unit = GL_TEXTURE1, const GLuint cache_unit = GL_TEXTURE2);
+
+                /**
+                 * Draw with the program in use between these to request tiles.
+                 * Several elements may draw to the same pass in a frame.
+                 */
+                void begin_feedback(const GLuint program);
+                void end_feedback(const GLuint program);
+
+                /**
+                 * Called after drawing; reads back feedback, queues missing
+                 * tiles and uploads the tiles read since the last frame
+                 */
+                void update();
+
+                size_t resident() const { return pages.size(); }
+
+            private:
+                struct Slot {
+                    unsigned long long page;
+                    unsigned long last_used;
+                    bool used;
+                };
+                struct Tile {
+                    unsigned long long page;
+                    std::vector<GLubyte> texels;
+                };
+
+                VTFile file;
+                int cache_tiles, divisor, tiles_per_frame;
+
+                GLuint page_table, cache;
+                std::vector<GLubyte> table;     // RGBA entries; slot x, slot y, level
+                std::vector<int> rows;          // First table row of each level
+                int dirty_first, dirty_last;    // Rows to upload
+
+                std::vector<Slot> slots;
+                std::map<unsigned long long, int> pages;    // Resident, to slot
+                std::set<unsigned long long> requested;     // Queued or read
+
+                GLuint framebuffer, color, depth;
+                GLint width, height;            // Of the feedback pass
+                GLint viewport[4];
+                GLint previous_framebuffer;
+                GLuint readback[2];
+                GLsync fences[2];
+                unsigned long frame, drawn_frame;
+
+                // Shared with the reader thread
+                boost::mutex mutex;
+                boost::condition_variable wake;
+                std::deque<unsigned long long> queue;
+                std::deque<Tile> ready;
+                bool stopping;
+                boost::thread reader;
+
+                GLubyte* entry(int level, int x, int y);
+                int texels(int level, int axis) const;
+                void covered(unsigned long long page, int k, int axis, int& first, int& last) const;
+                bool holding(int k, int x, int y, int level, unsigned long long& page) const;
+                void map_page(unsigned long long page, int slot);
+                void unmap_page(unsigned long long page);
+                void upload_tile(const Tile& tile);
+                void request(const GLubyte* pixels, size_t count);
+                void read();
+        };
+
+        /**
+         * The virtual texture of a file, opened once however many elements
+         * use it; NULL if the file cannot be read
+         */
+        VirtualTexture* load_virtual_texture(const std::string path);
+
+        /**
+         * Fragment shader object with vt_sample and vt_request
+         */
+        GLuint virtual_texture_shader();
+
+        /**
+         * Update every virtual texture; called by streaming::update
+         */
+        void update_virtual_textures();
+    }
+}
+
+#endif
@@ -123,6 +123,13 @@ void dumpInfo(void)
    printError ("dumpInfo");
 }
 
+DrawStats drawStats;
+
+void resetDrawStats(void)
+{
+    memset(&drawStats, 0, sizeof(drawStats));
+}
+
 /* report GL errors, if any, to stderr */
 void printError(const char *functionName)
 {
@@ -1,146 +1,281 @@
 // TGA loader, by Ingemar 2009, based on "tga.c" and some other sources.
 
+#define _POSIX_C_SOURCE 200809L
 #include "LoadTGA2.h"
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+// Copy pixels from the file's BGR(A) order to RGB(A)
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define TGA_X86 1
+#include <emmintrin.h>
+#include <tmmintrin.h>
+
+__attribute__((target("ssse3")))
+static long SwizzleCopy24SSSE3(GLubyte *dst, const GLubyte *src, long pixels)
+{
+	const __m128i shuffle = _mm_setr_epi8(2, 1, 0, 5, 4, 3, 8, 7, 6, 11, 10, 9, 12, 13, 14, 15);
+	long i;
+
+	// 16 byte loads and stores for 4 pixels (12 bytes) at a time; the 4
+	// bytes past them are rewritten by the next step or the scalar tail
+	for (i = 0; i + 6 <= pixels; i += 4)
+		_mm_storeu_si128((__m128i *)&dst[i*3], _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)&src[i*3]), shuffle));
+	return i;
+}
+#endif
+
+static void SwizzleCopy(GLubyte *dst, const GLubyte *src, long pixels, int bytesPerPixel)
+{
+	long i = 0;
+
+	if (bytesPerPixel == 4)
+	{
+#ifdef TGA_X86
+		const __m128i rb = _mm_set1_epi32(0x00ff00ff);
+		for (; i + 4 <= pixels; i += 4)
+		{
+			__m128i p = _mm_loadu_si128((const __m128i *)&src[i*4]);
+			__m128i swapped = _mm_or_si128(_mm_srli_epi32(_mm_and_si128(p, _mm_slli_epi32(rb, 16)), 16),
+				_mm_slli_epi32(_mm_and_si128(p, _mm_srli_epi32(rb, 16)), 16));
+			_mm_storeu_si128((__m128i *)&dst[i*4], _mm_or_si128(_mm_andnot_si128(rb, p), swapped));
+		}
+#endif
+		for (; i < pixels; i++)
+		{
+			dst[i*4] = src[i*4 + 2];
+			dst[i*4 + 1] = src[i*4 + 1];
+			dst[i*4 + 2] = src[i*4];
+			dst[i*4 + 3] = src[i*4 + 3];
+		}
+	}
+	else
+	{
+#ifdef TGA_X86
+		if (__builtin_cpu_supports("ssse3"))
+			i = SwizzleCopy24SSSE3(dst, src, pixels);
+#endif
+		for (; i < pixels; i++)
+		{
+			dst[i*3] = src[i*3 + 2];
+			dst[i*3 + 1] = src[i*3 + 1];
+			dst[i*3 + 2] = src[i*3];
+		}
+	}
+}
+
+// Fill pixels with one already swizzled pixel, doubling the copied span
+static void FillPixels(GLubyte *dst, const GLubyte *pixel, long pixels, int bytesPerPixel)
+{
+	long done = bytesPerPixel, total = pixels * bytesPerPixel;
+
+	if (pixels <= 0)
+		return;
+	memcpy(dst, pixel, bytesPerPixel);
+	while (done < total)
+	{
+		long n = done < total - done ? done : total - done;
+		memcpy(dst + done, dst, n);
+		done += n;
+	}
+}
 
 bool LoadTGATextureData(char *filename, TextureData *texture)	// Loads A TGA File Into Memory
 {
-	GLuint i;
 	GLubyte
 		TGAuncompressedheader[12]={ 0, 0, 2, 0, 0, 0, 0, 0, 0, 0, 0, 0},	// Uncompressed TGA Header
-		TGAcompressedheader[12]={ 0, 0, 10, 0, 0, 0, 0, 0, 0, 0, 0, 0},	// Uncompressed TGA Header
-		actualHeader[12],	// Used To Compare TGA Header
-		header[6];		// First 6 Useful Bytes From The Header
+		TGAcompressedheader[12]={ 0, 0, 10, 0, 0, 0, 0, 0, 0, 0, 0, 0};	// Compressed TGA Header
+	const GLubyte *file, *header, *p, *end;
 	GLuint bytesPerPixel,		// Holds Number Of Bytes Per Pixel Used In The TGA File
-		imageSize,		// Used To Store The Image Size When Setting Aside Ram
-		temp;			// Temporary Variable
-	long w, h;
-	long rowSize, stepSize, bytesRead;
-	GLubyte *rowP;
-	int err;
-	GLubyte rle;
-	int b;
-	long row, rowLimit;
-	GLubyte pixelData[4];
+		imageSize;		// Used To Store The Image Size When Setting Aside Ram
+	long width, height;
+	long rowSize, stepSize;
+	long row, x;
+	bool topOrigin;
+	struct stat st;
+	int fd, err;
 	
-	FILE *file = fopen(filename, "rb");			// Open The TGA File
+	// The whole file is mapped, and decoded straight into the image
 	err = 0;
-	if (file == NULL) err = 1;				// Does File Even Exist?
-	else if (fread(actualHeader, 1, sizeof(actualHeader), file) != sizeof(actualHeader)) err = 2; // Are There 12 Bytes To Read?
+	file = MAP_FAILED;
+	fd = open(filename, O_RDONLY);
+	if (fd < 0) err = 1;				// Does File Even Exist?
+	else if (fstat(fd, &st) != 0 || st.st_size < 18) err = 2; // Is There A Header To Read?
+	else if ((file = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0)) == MAP_FAILED) err = 4;
 	else if (
-				(memcmp(TGAuncompressedheader, actualHeader, sizeof(TGAuncompressedheader)) != 0) &&
-				(memcmp(TGAcompressedheader, actualHeader, sizeof(TGAcompressedheader)) != 0)
+				(memcmp(TGAuncompressedheader, file, sizeof(TGAuncompressedheader)) != 0) &&
+				(memcmp(TGAcompressedheader, file, sizeof(TGAcompressedheader)) != 0)
 			)
 				err = 3; // Does The Header Match What We Want?
-	else if (fread(header, 1, sizeof(header), file) != sizeof(header)) err = 4; // If So Read Next 6 Header Bytes
+	if (fd >= 0)
+		close(fd);
 	
 	if (err != 0)
 	{
 		switch (err)
 		{
-			case 1: printf("could not open file %s\n", filename); return false;break;
-			case 2: printf("could not read header of %s\n", filename); return false;break;
-			case 3: printf("unsupported format in %s\n", filename); return false;break;
-			case 4: printf("could not read file %s\n", filename); return false;break;
-		}
-		
-		if(file == NULL)		// Did The File Even Exist? *Added Jim Strong*
-			return false;
-		else
-		{
-			fclose(file);		// If Anything Failed, Close The File
-			return false;
+			case 1: printf("could not open file %s\n", filename); break;
+			case 2: printf("could not read header of %s\n", filename); break;
+			case 3: printf("unsupported format in %s\n", filename); break;
+			case 4: printf("could not read file %s\n", filename); break;
 		}
+		if (file != MAP_FAILED)
+			munmap((void *)file, st.st_size);
+		return false;
 	}
+	header = file + 12;		// The 6 Useful Bytes Of The Header
+	end = file + st.st_size;
+	p = file + 18;
+	
 	texture->width  = header[1] * 256 + header[0];	// Determine The TGA Width (highbyte*256+lowbyte)
 	texture->height = header[3] * 256 + header[2];	// Determine The TGA Height (highbyte*256+lowbyte)
 	if (texture->width <= 0 ||	// Is The Width Less Than Or Equal To Zero
 	texture->height <= 0 ||		// Is The Height Less Than Or Equal To Zero
 	(header[4] != 24 && header[4] != 32))			// Is The TGA 24 or 32 Bit?
 	{
-		fclose(file);		// If Anything Failed, Close The File
+		munmap((void *)file, st.st_size);
 		return false;
 	}
+	width = texture->width;
+	height = texture->height;
+	topOrigin = (header[5] & 0x20) != 0;	// Rows stored top down
 	
-	w = 1;
-	while (w < texture->width) w = w << 1;
-	h = 1;
-	while (h < texture->height) h = h << 1;
-	texture->texWidth = (GLfloat)texture->width / w;
-	texture->texHeight = (GLfloat)texture->height / h;
+	// The image is stored at its real size, no padding to a power of two
+	texture->texWidth = 1.0;
+	texture->texHeight = 1.0;
 	
 	texture->bpp = header[4];		// Grab The TGA's Bits Per Pixel (24 or 32)
 	bytesPerPixel = texture->bpp/8;		// Divide By 8 To Get The Bytes Per Pixel
-	imageSize = w * h * bytesPerPixel;	// Calculate The Memory Required For The TGA Data
-	rowSize	= texture->width * bytesPerPixel;	// Image memory per row
-	stepSize = w * bytesPerPixel;		// Memory per row
+	imageSize = width * height * bytesPerPixel;	// Calculate The Memory Required For The TGA Data
+	rowSize	= width * bytesPerPixel;	// Image memory per row
+	stepSize = rowSize;		// Memory per row
 	texture->imageData = (GLubyte *)calloc(1, imageSize);
 	if (texture->imageData == NULL)				// Does The Storage Memory Exist?
 	{
-		fclose(file);
+		munmap((void *)file, st.st_size);
 		return false;
 	}
 
-	if (actualHeader[2] == 2) // uncompressed
+	if (file[2] == 2) // uncompressed
 	{
-		rowP = &texture->imageData[0];
-		for (i = 0; i < texture->height; i++)
+		if (end - p < rowSize * (long)height)
 		{
-			bytesRead = fread(rowP, 1, rowSize, file);
-			rowP += stepSize;
-			if (bytesRead != rowSize)
-			{
-				free(texture->imageData);	// If So, Release The Image Data
-				fclose(file);			// Close The File
-				return false;			// Return False
-			}
+			free(texture->imageData);	// If So, Release The Image Data
+			munmap((void *)file, st.st_size);
+			return false;
 		}
+		for (row = 0; row < height; row++, p += rowSize)
+			SwizzleCopy(&texture->imageData[(topOrigin ? height - 1 - row : row) * stepSize],
+				p, width, bytesPerPixel);
 	}
 	else
-	{ // compressed
-		row = 0 + (texture->height -1) * stepSize;
-		i = row;
-		rowLimit = row + rowSize;
-		do
+	{ // compressed; packets may run over into the next row
+		GLubyte pixel[4];
+		long count = 0;
+		bool raw = false;
+
+		for (row = 0; row < height; row++)
 		{
-			bytesRead = fread(&rle, 1, 1, file);
-			if (rle < 128)
-			{ // rle+1 raw pixels
-				bytesRead = fread(&texture->imageData[i], 1, (rle+1)*bytesPerPixel, file);
-				i += bytesRead;
-				if (bytesRead == 0)
-					i = imageSize;
-			}
-			else
-			{ // range of rle-127 pixels with a color that follows
-				bytesRead = fread(&pixelData, 1, bytesPerPixel, file);
-				do
-				{
-					for (b = 0; b < bytesPerPixel; b++)
-						texture->imageData[i+b] = pixelData[b];
-					i += bytesPerPixel;
-					rle = rle - 1;
-				} while (rle > 127);
-			}
-			if (i >= rowLimit)
+			GLubyte *dst = &texture->imageData[(topOrigin ? height - 1 - row : row) * stepSize];
+			for (x = 0; x < width; )
 			{
-				row = row - stepSize;
-				rowLimit = row + rowSize;
-				i = row;
+				long n;
+				if (count == 0)
+				{
+					if (p >= end)
+						break;
+					raw = *p < 128;	// rle+1 raw pixels, or rle-127 copies of one
+					count = (*p++ & 0x7f) + 1;
+					if (!raw)
+					{
+						if (end - p < bytesPerPixel)
+						{
+							p = end;
+							break;
+						}
+						SwizzleCopy(pixel, p, 1, bytesPerPixel);
+						p += bytesPerPixel;
+					}
+				}
+				n = count < width - x ? count : width - x;
+				if (raw)
+				{
+					if ((end - p) / bytesPerPixel < n)
+						n = (end - p) / bytesPerPixel;
+					SwizzleCopy(&dst[x * bytesPerPixel], p, n, bytesPerPixel);
+					p += n * bytesPerPixel;
+					if (n == 0)
+					{
+						p = end;
+						break;
+					}
+				}
+				else
+					FillPixels(&dst[x * bytesPerPixel], pixel, n, bytesPerPixel);
+				x += n;
+				count -= n;
 			}
-		} while (i < imageSize);
+			if (p >= end && x < width)
+				break;	// Truncated; keep what was decoded
+		}
 	}
 
-	for (i = 0; i < (int)(imageSize); i += bytesPerPixel)	// Loop Through The Image Data
-	{		// Swaps The 1st And 3rd Bytes ('R'ed and 'B'lue)
-		temp = texture->imageData[i];		// Temporarily Store The Value At Image Data 'i'
-		texture->imageData[i] = texture->imageData[i + 2];	// Set The 1st Byte To The Value Of The 3rd Byte
-		texture->imageData[i + 2] = temp;	// Set The 3rd Byte To The Value In 'temp' (1st Byte Value)
-	}
-	fclose (file);
+	munmap((void *)file, st.st_size);
 	return true;				// Texture Building Went Ok, Return True
 }
 
 
+bool LoadTGAHeader(char *filename, TextureData *texture)	// Reads only the size and depth of a TGA File
+{
+	GLubyte header[18];
+	FILE *file;
+	bool ok;
+	
+	file = fopen(filename, "rb");
+	if (file == NULL)
+		return false;
+	ok = fread(header, 1, sizeof(header), file) == sizeof(header) &&
+		(header[2] == 2 || header[2] == 10) &&		// Uncompressed or RLE true colour
+		(header[16] == 24 || header[16] == 32);
+	fclose(file);
+	if (!ok)
+		return false;
+	
+	texture->imageData = NULL;
+	texture->width  = header[13] * 256 + header[12];
+	texture->height = header[15] * 256 + header[14];
+	texture->bpp = header[16];
+	texture->texWidth = texture->texHeight = 1.0;
+	return texture->width > 0 && texture->height > 0;
+}
+
+// Immutable storage needs GL 4.2 or ARB_texture_storage
+bool HasTextureStorage(void)
+{
+	static int hasStorage = -1;
+	GLint major = 0, minor = 0, count = 0, i;
+	
+	if (hasStorage >= 0)
+		return hasStorage;
+	hasStorage = 0;
+	glGetIntegerv(GL_MAJOR_VERSION, &major);
+	glGetIntegerv(GL_MINOR_VERSION, &minor);
+	if (major > 4 || (major == 4 && minor >= 2))
+		hasStorage = 1;
+	else
+	{
+		glGetIntegerv(GL_NUM_EXTENSIONS, &count);
+		for (i = 0; i < count && !hasStorage; i++)
+			if (strcmp((const char *)glGetStringi(GL_EXTENSIONS, i), "GL_ARB_texture_storage") == 0)
+				hasStorage = 1;
+	}
+	glGetError();	// Pre-3.0 contexts reject the version queries
+	return hasStorage;
+}
+
 bool LoadTGATexture(char *filename, TextureData *texture)	// Loads A TGA File Into Memory and uploads to VRAM
 {
 	bool result = LoadTGATextureData(filename, texture); // Loads A TGA File Into Memory
@@ -148,12 +283,14 @@ bool LoadTGATexture(char *filename, TextureData *texture)	// Loads A TGA File In
 		return result;
 	
 	GLuint type = GL_RGBA;		// Set The Default GL Mode To RBGA (32 BPP)
-	int h, w;
+	GLuint format = GL_RGBA8;
+	GLint alignment;
+	int levels, size;
 
-	w = 1;
-	while (w < texture->width) w = w << 1;
-	h = 1;
-	while (h < texture->height) h = h << 1;
+	// Room for a full mip chain, filled in by glGenerateMipmap when wanted
+	levels = 1;
+	for (size = texture->width > texture->height ? texture->width : texture->height; size > 1; size = size >> 1)
+		levels++;
 	
 	// Build A Texture From The Data
 	glGenTextures(1, &texture[0].texID);			// Generate OpenGL texture IDs
@@ -163,9 +300,19 @@ bool LoadTGATexture(char *filename, TextureData *texture)	// Loads A TGA File In
 	if (texture[0].bpp == 24)						// Was The TGA 24 Bits?
 	{
 		type=GL_RGB;			// If So Set The 'type' To GL_RGB
+		format = GL_RGB8;
+	}
+	// 24 bit rows of odd width are not 4 byte aligned
+	glGetIntegerv(GL_UNPACK_ALIGNMENT, &alignment);
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+	if (HasTextureStorage())
+	{
+		glTexStorage2D(GL_TEXTURE_2D, levels, format, texture->width, texture->height);
+		glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, texture->width, texture->height, type, GL_UNSIGNED_BYTE, texture[0].imageData);
 	}
-//	gluBuild2DMipmaps(GL_TEXTURE_2D, type, w, h, type, GL_UNSIGNED_BYTE, texture[0].imageData);
-	glTexImage2D(GL_TEXTURE_2D, 0, type, w, h, 0, type, GL_UNSIGNED_BYTE, texture[0].imageData);
+	else
+		glTexImage2D(GL_TEXTURE_2D, 0, format, texture->width, texture->height, 0, type, GL_UNSIGNED_BYTE, texture[0].imageData);
+	glPixelStorei(GL_UNPACK_ALIGNMENT, alignment);
 	
 	return result;
 }
@@ -193,8 +340,7 @@ int tgaSave(char			*filename,
 			 unsigned char	*imageData)
 {
 	unsigned char cGarbage = 0, type,mode,aux;
-	short int iGarbage = 0;
-	int i, w, bytesPerPixel, row, ix;
+	int i, bytesPerPixel, row, ix;
 	FILE *file;
 	char /*GLubyte*/ TGAuncompressedheader[12]={ 0, 0, 2, 0, 0, 0, 0, 0, 0, 0, 0, 0};	// Uncompressed TGA Header
 
@@ -211,6 +357,7 @@ int tgaSave(char			*filename,
 		type = 3;
 
 // write the header
+	TGAuncompressedheader[2] = type;
 	fwrite(&TGAuncompressedheader, 12, 1, file);
 	fwrite(&width, sizeof(short int), 1, file);
 	fwrite(&height, sizeof(short int), 1, file);
@@ -228,16 +375,14 @@ int tgaSave(char			*filename,
 	}
 
 // save the image data
-	w = 1;
-	while (w < width) w = w << 1;
 	bytesPerPixel = pixelDepth/8;	
 	row = width * bytesPerPixel;
 	
 // Write one row at a time
 	for (i = 0; i < height; i++)
 	{
-		ix = i * w * mode;
-		fwrite(&imageData[ix], sizeof(unsigned char), width * mode, file);
+		ix = i * row;
+		fwrite(&imageData[ix], sizeof(unsigned char), row, file);
 	}
 
 	fclose(file);
@@ -0,0 +1,383 @@
+// Heightmaps of 8, 16 or 32 bits per sample
+//
+// Raw .r16 and .r32 files, and uncompressed TGA images, are mapped and read
+// in place; nothing but the samples the caller asks for is ever touched. Run
+// length encoded TGA images are decoded first.
+//
+// Grid normals are computed in bands of rows, one per thread, each keeping
+// three rows of heights in contiguous buffers for SSE to read four
+// vertices at a time.
+
+#define _POSIX_C_SOURCE 200809L
+#include "heightmap.h"
+#include <math.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#ifdef __SSE__
+#include <xmmintrin.h>
+#endif
+
+#define HEIGHT_MAX_THREADS 64
+#define kHeightMinRowsPerThread 64
+
+typedef struct
+{
+  const GLfloat *heights;
+  size_t stride;
+  int width, height;
+  GLfloat *normals;
+  int first, last; // Rows of this band
+} NormalJob;
+
+// Neighbours around a vertex, the last repeating the first, and the weight
+// of the triangle between each neighbour and the next
+static const int kAroundX[7] = {1, 1, 0, -1, -1, 0, 1};
+static const int kAroundZ[7] = {0, -1, -1, 0, 1, 1, 0};
+static const float kTriangleWeight[6] = {1/8.f, 1/8.f, 2/8.f, 1/8.f, 1/8.f, 2/8.f};
+
+static int HasSuffix(const char *name, const char *suffix)
+{
+  size_t n = strlen(name), s = strlen(suffix);
+  return n >= s && strcmp(name + n - s, suffix) == 0;
+}
+
+static void *MapFile(char *name, size_t *size)
+{
+  struct stat st;
+  void *data;
+  int fd;
+
+  fd = open(name, O_RDONLY);
+  if (fd < 0)
+    {
+      printf("could not open file %s\n", name);
+      return NULL;
+    }
+  if (fstat(fd, &st) != 0 || st.st_size == 0)
+    {
+      close(fd);
+      printf("could not read file %s\n", name);
+      return NULL;
+    }
+  data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED)
+    return NULL;
+  *size = st.st_size;
+  return data;
+}
+
+static int LoadRaw(char *name, GLint width, GLint height, GLint format, Heightmap *map)
+{
+  const size_t bytes = format == kHeight16 ? 2 : 4;
+  size_t size, samples;
+
+  map->mapping = MapFile(name, &size);
+  if (map->mapping == NULL)
+    return 0;
+  map->mappingSize = size;
+  samples = size / bytes;
+  if (width <= 0 || height <= 0)
+    {
+      width = height = (GLint)(sqrt((double)samples) + 0.5);
+      if ((size_t)width * height != samples)
+        {
+          printf("%s is not square; give its width and height\n", name);
+          FreeHeightmap(map);
+          return 0;
+        }
+    }
+  if ((size_t)width * height > samples)
+    {
+      printf("truncated heights in %s\n", name);
+      FreeHeightmap(map);
+      return 0;
+    }
+  map->width = width;
+  map->height = height;
+  map->format = format;
+  map->samples = map->mapping;
+  map->stride = bytes;
+  map->flipped = 1;
+  return 1;
+}
+
+static int LoadTGAHeights(char *name, Heightmap *map)
+{
+  static const GLubyte uncompressed[12] = {0, 0, 2, 0, 0, 0, 0, 0, 0, 0, 0, 0};
+  const GLubyte *file, *header;
+  TextureData tex;
+  size_t size, bytes;
+
+  // Uncompressed images are read where they lie in the file
+  file = MapFile(name, &size);
+  if (file == NULL)
+    return 0;
+  header = file + 12;
+  if (size >= 18 && memcmp(file, uncompressed, sizeof(uncompressed)) == 0
+      && (header[4] == 24 || header[4] == 32))
+    {
+      bytes = header[4] / 8;
+      map->width = header[1] * 256 + header[0];
+      map->height = header[3] * 256 + header[2];
+      if (map->width > 0 && map->height > 0
+          && size >= 18 + (size_t)map->width * map->height * bytes)
+        {
+          // Pixels are stored BGR(A); heights are the red channel, as
+          // in decoded images
+          map->format = kHeight8;
+          map->samples = file + 18 + 2;
+          map->stride = bytes;
+          map->flipped = (header[5] & 0x20) != 0;
+          map->mapping = (void *)file;
+          map->mappingSize = size;
+          return 1;
+        }
+    }
+  munmap((void *)file, size);
+
+  if (!LoadTGATextureData(name, &tex))
+    return 0;
+  map->width = tex.width;
+  map->height = tex.height;
+  map->format = kHeight8;
+  map->image = tex.imageData;
+  map->samples = tex.imageData;
+  map->stride = tex.bpp / 8;
+  map->flipped = 0;
+  return 1;
+}
+
+static void StoreNormal(GLfloat *n, float x, float y, float z)
+{
+  float length = sqrtf(x*x + y*y + z*z);
+
+  if (length > 0)
+    {
+      n[0] = x / length;
+      n[1] = y / length;
+      n[2] = z / length;
+    }
+  else
+    {
+      n[0] = n[2] = 0;
+      n[1] = 1;
+    }
+}
+
+// Border vertices, from the triangles around them that exist
+static void BorderNormal(const NormalJob *job, int x, int z)
+{
+  const GLfloat *h = job->heights;
+  const size_t stride = job->stride;
+  const float y = h[((size_t)z * job->width + x) * stride];
+  float sum[3] = {0, 0, 0};
+  int n;
+
+  for (n = 0; n < 6; n++)
+    {
+      int x1 = x + kAroundX[n], z1 = z + kAroundZ[n];
+      int x2 = x + kAroundX[n+1], z2 = z + kAroundZ[n+1];
+      float a[3], b[3], c[3], length;
+
+      if (x1 < 0 || x1 >= job->width || z1 < 0 || z1 >= job->height
+          || x2 < 0 || x2 >= job->width || z2 < 0 || z2 >= job->height)
+        continue;
+      a[0] = kAroundX[n];
+      a[1] = h[((size_t)z1 * job->width + x1) * stride] - y;
+      a[2] = kAroundZ[n];
+      b[0] = kAroundX[n+1];
+      b[1] = h[((size_t)z2 * job->width + x2) * stride] - y;
+      b[2] = kAroundZ[n+1];
+      c[0] = a[1]*b[2] - a[2]*b[1];
+      c[1] = a[2]*b[0] - a[0]*b[2];
+      c[2] = a[0]*b[1] - a[1]*b[0];
+      length = sqrtf(c[0]*c[0] + c[1]*c[1] + c[2]*c[2]);
+      sum[0] += kTriangleWeight[n] * c[0] / length;
+      sum[1] += kTriangleWeight[n] * c[1] / length;
+      sum[2] += kTriangleWeight[n] * c[2] / length;
+    }
+  StoreNormal(&job->normals[((size_t)z * job->width + x) * 3], sum[0], sum[1], sum[2]);
+}
+
+// With unit spacing, the cross product of the edges to two neighbours is
+// (cx, 1, cz), where cx and cz follow from the height differences d0..d5
+// to the neighbours
+#define TRIANGLE(w, cx, cz) \
+  do { \
+    float t = (w) / sqrtf((cx)*(cx) + (cz)*(cz) + 1); \
+    sx += (cx) * t; sy += t; sz += (cz) * t; \
+  } while (0)
+
+static void InteriorNormal(GLfloat *n, const float *above, const float *row, const float *below, int x)
+{
+  const float y = row[x];
+  const float d0 = row[x+1] - y, d1 = above[x+1] - y, d2 = above[x] - y;
+  const float d3 = row[x-1] - y, d4 = below[x-1] - y, d5 = below[x] - y;
+  float sx = 0, sy = 0, sz = 0;
+
+  TRIANGLE(kTriangleWeight[0], -d0, d1 - d0);
+  TRIANGLE(kTriangleWeight[1], d2 - d1, d2);
+  TRIANGLE(kTriangleWeight[2], d3, d2);
+  TRIANGLE(kTriangleWeight[3], d3, d3 - d4);
+  TRIANGLE(kTriangleWeight[4], d4 - d5, -d5);
+  TRIANGLE(kTriangleWeight[5], -d0, -d5);
+  StoreNormal(n, sx, sy, sz);
+}
+
+#ifdef __SSE__
+#define TRIANGLE4(w, cx, cz) \
+  do { \
+    __m128 x_ = (cx), z_ = (cz); \
+    __m128 t = _mm_div_ps(_mm_set1_ps(w), _mm_sqrt_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(x_, x_), _mm_mul_ps(z_, z_)), one))); \
+    sx = _mm_add_ps(sx, _mm_mul_ps(x_, t)); sy = _mm_add_ps(sy, t); sz = _mm_add_ps(sz, _mm_mul_ps(z_, t)); \
+  } while (0)
+
+// Four vertices from x on
+static void InteriorNormals4(GLfloat *n, const float *above, const float *row, const float *below, int x)
+{
+  const __m128 one = _mm_set1_ps(1), zero = _mm_setzero_ps();
+  const __m128 y = _mm_loadu_ps(&row[x]);
+  const __m128 d0 = _mm_sub_ps(_mm_loadu_ps(&row[x+1]), y), d1 = _mm_sub_ps(_mm_loadu_ps(&above[x+1]), y);
+  const __m128 d2 = _mm_sub_ps(_mm_loadu_ps(&above[x]), y), d3 = _mm_sub_ps(_mm_loadu_ps(&row[x-1]), y);
+  const __m128 d4 = _mm_sub_ps(_mm_loadu_ps(&below[x-1]), y), d5 = _mm_sub_ps(_mm_loadu_ps(&below[x]), y);
+  __m128 sx = zero, sy = zero, sz = zero, length;
+  float out[3][4];
+  int k;
+
+  TRIANGLE4(kTriangleWeight[0], _mm_sub_ps(zero, d0), _mm_sub_ps(d1, d0));
+  TRIANGLE4(kTriangleWeight[1], _mm_sub_ps(d2, d1), d2);
+  TRIANGLE4(kTriangleWeight[2], d3, d2);
+  TRIANGLE4(kTriangleWeight[3], d3, _mm_sub_ps(d3, d4));
+  TRIANGLE4(kTriangleWeight[4], _mm_sub_ps(d4, d5), _mm_sub_ps(zero, d5));
+  TRIANGLE4(kTriangleWeight[5], _mm_sub_ps(zero, d0), _mm_sub_ps(zero, d5));
+
+  // sy is at least the sum of the weights, so the length is never zero
+  length = _mm_sqrt_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(sx, sx), _mm_mul_ps(sy, sy)), _mm_mul_ps(sz, sz)));
+  _mm_storeu_ps(out[0], _mm_div_ps(sx, length));
+  _mm_storeu_ps(out[1], _mm_div_ps(sy, length));
+  _mm_storeu_ps(out[2], _mm_div_ps(sz, length));
+  for (k = 0; k < 4; k++)
+    {
+      n[3*k] = out[0][k];
+      n[3*k + 1] = out[1][k];
+      n[3*k + 2] = out[2][k];
+    }
+}
+#endif
+
+static void CopyHeights(const NormalJob *job, int z, float *row)
+{
+  const GLfloat *h = job->heights + (size_t)z * job->width * job->stride;
+  int x;
+
+  for (x = 0; x < job->width; x++)
+    row[x] = h[x * job->stride];
+}
+
+static void *NormalBand(void *data)
+{
+  const NormalJob *job = data;
+  const int width = job->width;
+  float *rows[3], *above, *row, *below, *spare;
+  int x, z;
+
+  rows[0] = malloc(sizeof(float) * width * 3);
+  rows[1] = rows[0] + width;
+  rows[2] = rows[1] + width;
+  above = rows[0];
+  row = rows[1];
+  below = rows[2];
+  if (job->first > 0)
+    CopyHeights(job, job->first - 1, above);
+  CopyHeights(job, job->first, row);
+  for (z = job->first; z < job->last; z++)
+    {
+      GLfloat *n = &job->normals[(size_t)z * width * 3];
+
+      if (z + 1 < job->height)
+        CopyHeights(job, z + 1, below);
+      if (z == 0 || z == job->height - 1 || width < 3)
+        {
+          for (x = 0; x < width; x++)
+            BorderNormal(job, x, z);
+        }
+      else
+        {
+          BorderNormal(job, 0, z);
+          x = 1;
+#ifdef __SSE__
+          for (; x + 4 <= width - 1; x += 4)
+            InteriorNormals4(&n[x * 3], above, row, below, x);
+#endif
+          for (; x < width - 1; x++)
+            InteriorNormal(&n[x * 3], above, row, below, x);
+          BorderNormal(job, width - 1, z);
+        }
+
+      // Move the window down a row
+      spare = above;
+      above = row;
+      row = below;
+      below = spare;
+    }
+  free(rows[0]);
+  return NULL;
+}
+
+void GridNormals(const GLfloat *heights, size_t stride, int width, int height, GLfloat *normals)
+{
+  NormalJob jobs[HEIGHT_MAX_THREADS];
+  pthread_t threads[HEIGHT_MAX_THREADS];
+  int started[HEIGHT_MAX_THREADS];
+  long cores = sysconf(_SC_NPROCESSORS_ONLN);
+  int n = height / kHeightMinRowsPerThread;
+  int i;
+
+  if (width < 1 || height < 1)
+    return;
+  if (n > cores) n = cores;
+  if (n > HEIGHT_MAX_THREADS) n = HEIGHT_MAX_THREADS;
+  if (n < 1) n = 1;
+  for (i = 0; i < n; i++)
+    {
+      jobs[i].heights = heights;
+      jobs[i].stride = stride;
+      jobs[i].width = width;
+      jobs[i].height = height;
+      jobs[i].normals = normals;
+      jobs[i].first = height * i / n;
+      jobs[i].last = height * (i + 1) / n;
+    }
+  for (i = 1; i < n; i++)
+    started[i] = (pthread_create(&threads[i], NULL, NormalBand, &jobs[i]) == 0);
+  NormalBand(&jobs[0]);
+  for (i = 1; i < n; i++)
+    {
+      if (started[i])
+        pthread_join(threads[i], NULL);
+      else
+        NormalBand(&jobs[i]);
+    }
+}
+
+int LoadHeightmap(char *name, GLint width, GLint height, Heightmap *map)
+{
+  memset(map, 0, sizeof(Heightmap));
+  if (HasSuffix(name, ".r16"))
+    return LoadRaw(name, width, height, kHeight16, map);
+  if (HasSuffix(name, ".r32"))
+    return LoadRaw(name, width, height, kHeightFloat, map);
+  return LoadTGAHeights(name, map);
+}
+
+void FreeHeightmap(Heightmap *map)
+{
+  if (map->mapping != NULL)
+    munmap(map->mapping, map->mappingSize);
+  free(map->image);
+  memset(map, 0, sizeof(Heightmap));
+}
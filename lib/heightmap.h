@@ -0,0 +1,62 @@
+#ifndef heightmap_h
+#define heightmap_h
+
+#include "LoadTGA2.h"
+#include <string.h>
+
+// Sample formats of a heightmap
+#define kHeight8 0 // Red channel of a TGA image
+#define kHeight16 1 // Raw .r16, little endian unsigned
+#define kHeightFloat 2 // Raw .r32, little endian float
+
+// Heights read where they lie: in the mapped file for raw heightmaps, or in
+// the decoded image for TGA files
+typedef struct
+{
+  GLint width, height;
+  GLint format;
+  const GLubyte *samples;
+  size_t stride; // Bytes from one sample to the next in a row
+  int flipped; // Raw files store the top row first, images the bottom row
+  void *mapping;
+  size_t mappingSize;
+  GLubyte *image; // Decoded TGA image, or NULL
+} Heightmap;
+
+// Open a .r16, .r32 or TGA file. Raw files are taken as square unless the
+// width and height are given. Returns 0 on failure.
+int LoadHeightmap(char *name, GLint width, GLint height, Heightmap *map);
+void FreeHeightmap(Heightmap *map);
+
+// Normals of a grid of heights with unit spacing, width by height: the sum
+// of the unit normals of the six triangles around each vertex, weighted 2/8
+// for the two with their right angle at the vertex and 1/8 for the others,
+// normalized. Border vertices sum the triangles they have. Heights are
+// stride floats apart; normals are written as x, y, z, row by row. Rows are
+// split between threads.
+void GridNormals(const GLfloat *heights, size_t stride, int width, int height, GLfloat *normals);
+
+// Height of sample x, z, counting z from the bottom of the image, in length
+// units: the full range of 8 and 16 bit samples spans 2.55, as the 8 bit
+// heightmaps always have, and float samples are heights as they are.
+static inline float HeightAt(const Heightmap *map, int x, int z)
+{
+  const int row = map->flipped ? map->height - 1 - z : z;
+  const GLubyte *p = map->samples + ((size_t)row * map->width + x) * map->stride;
+
+  switch (map->format)
+    {
+    case kHeight16:
+      return (p[0] | p[1] << 8) / 25700.0f;
+    case kHeightFloat:
+      {
+        float h;
+        memcpy(&h, p, sizeof(h));
+        return h;
+      }
+    default:
+      return p[0] / 100.0f;
+    }
+}
+
+#endif
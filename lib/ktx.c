@@ -0,0 +1,550 @@
+// KTX 1.1 textures with BC1 and BC3 (S3TC DXT1 and DXT5) levels
+//
+// The block encoder fits the endpoints of each block to the principal axis
+// of its colors and refines them once by least squares on the chosen
+// indices. Rows are stored as OpenGL reads them, from the bottom up, which
+// the files declare with KTXorientation "S=r,T=u".
+
+#define _POSIX_C_SOURCE 200809L
+#include "ktx.h"
+#include <math.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+static const GLubyte kIdentifier[12] = {0xAB, 'K', 'T', 'X', ' ', '1', '1', 0xBB, '\r', '\n', 0x1A, '\n'};
+static const char kOrientation[] = "KTXorientation\0S=r,T=u";
+
+typedef struct
+{
+  GLubyte identifier[12];
+  uint32_t endianness;
+  uint32_t glType;
+  uint32_t glTypeSize;
+  uint32_t glFormat;
+  uint32_t glInternalFormat;
+  uint32_t glBaseInternalFormat;
+  uint32_t pixelWidth;
+  uint32_t pixelHeight;
+  uint32_t pixelDepth;
+  uint32_t numberOfArrayElements;
+  uint32_t numberOfFaces;
+  uint32_t numberOfMipmapLevels;
+  uint32_t bytesOfKeyValueData;
+} KTXHeader;
+
+static int BlockBytes(GLenum format)
+{
+  return format == kKTXBC1 ? 8 : 16;
+}
+
+static GLsizei LevelSize(GLenum format, int width, int height)
+{
+  return ((width + 3) / 4) * ((height + 3) / 4) * BlockBytes(format);
+}
+
+
+// Decoding
+
+static void Expand565(unsigned int c, GLubyte *out)
+{
+  unsigned int r = (c >> 11) & 31, g = (c >> 5) & 63, b = c & 31;
+
+  out[0] = (r << 3) | (r >> 2);
+  out[1] = (g << 2) | (g >> 4);
+  out[2] = (b << 3) | (b >> 2);
+  out[3] = 255;
+}
+
+// BC1 blocks with c0 <= c1 have three colors and transparent black; the
+// color half of BC3 always has four
+static void DecodeColors(const GLubyte *block, GLubyte texels[64], int threeColor)
+{
+  unsigned int c0 = block[0] | (block[1] << 8), c1 = block[2] | (block[3] << 8);
+  GLubyte palette[4][4];
+  int i, c;
+
+  Expand565(c0, palette[0]);
+  Expand565(c1, palette[1]);
+  for (c = 0; c < 4; c++)
+    {
+      if (threeColor && c0 <= c1)
+        {
+          palette[2][c] = (palette[0][c] + palette[1][c]) / 2;
+          palette[3][c] = 0;
+        }
+      else
+        {
+          palette[2][c] = (2 * palette[0][c] + palette[1][c]) / 3;
+          palette[3][c] = (palette[0][c] + 2 * palette[1][c]) / 3;
+        }
+    }
+  if (!threeColor || c0 > c1)
+    palette[3][3] = 255;
+  for (i = 0; i < 16; i++)
+    memcpy(&texels[i * 4], palette[(block[4 + i / 4] >> (2 * (i % 4))) & 3], 4);
+}
+
+static void AlphaPalette(int a0, int a1, GLubyte palette[8])
+{
+  int i;
+
+  palette[0] = a0;
+  palette[1] = a1;
+  if (a0 > a1)
+    for (i = 1; i < 7; i++)
+      palette[i + 1] = ((7 - i) * a0 + i * a1) / 7;
+  else
+    {
+      for (i = 1; i < 5; i++)
+        palette[i + 1] = ((5 - i) * a0 + i * a1) / 5;
+      palette[6] = 0;
+      palette[7] = 255;
+    }
+}
+
+static void DecodeAlpha(const GLubyte *block, GLubyte texels[64])
+{
+  GLubyte palette[8];
+  uint64_t bits = 0;
+  int i;
+
+  AlphaPalette(block[0], block[1], palette);
+  for (i = 0; i < 6; i++)
+    bits |= (uint64_t)block[2 + i] << (8 * i);
+  for (i = 0; i < 16; i++)
+    texels[i * 4 + 3] = palette[(bits >> (3 * i)) & 7];
+}
+
+void DecodeKTX(const KTXTexture *ktx, MipChain *chain)
+{
+  GLubyte texels[64];
+  int i, bx, by, y;
+
+  memset(chain, 0, sizeof(MipChain));
+  chain->bytesPerPixel = 4;
+  chain->numLevels = ktx->numLevels;
+  for (i = 0; i < ktx->numLevels; i++)
+    {
+      const KTXLevel *l = &ktx->levels[i];
+      const GLubyte *block = l->data;
+      MipLevel *out = &chain->levels[i];
+
+      out->width = l->width;
+      out->height = l->height;
+      out->pixels = malloc((size_t)l->width * l->height * 4);
+      for (by = 0; by < l->height; by += 4)
+        for (bx = 0; bx < l->width; bx += 4)
+          {
+            if (ktx->format == kKTXBC1)
+              DecodeColors(block, texels, 1);
+            else
+              {
+                DecodeColors(block + 8, texels, 0);
+                DecodeAlpha(block, texels);
+              }
+            block += BlockBytes(ktx->format);
+            // Edge blocks are clipped to the level
+            for (y = 0; y < 4 && by + y < l->height; y++)
+              memcpy(&out->pixels[((size_t)(by + y) * l->width + bx) * 4], &texels[y * 16],
+                     4 * (l->width - bx < 4 ? l->width - bx : 4));
+          }
+    }
+}
+
+
+// Encoding
+
+static unsigned int Quantize565(const float *c)
+{
+  int r = (int)(c[0] * 31.0f / 255.0f + 0.5f);
+  int g = (int)(c[1] * 63.0f / 255.0f + 0.5f);
+  int b = (int)(c[2] * 31.0f / 255.0f + 0.5f);
+
+  r = r < 0 ? 0 : (r > 31 ? 31 : r);
+  g = g < 0 ? 0 : (g > 63 ? 63 : g);
+  b = b < 0 ? 0 : (b > 31 ? 31 : b);
+  return (r << 11) | (g << 5) | b;
+}
+
+// Indices of the nearest of four colors between c0 and c1; returns the error
+static int ColorIndices(const GLubyte texels[64], unsigned int c0, unsigned int c1, unsigned int *indices)
+{
+  GLubyte palette[4][4];
+  int i, k, c, error = 0;
+
+  Expand565(c0, palette[0]);
+  Expand565(c1, palette[1]);
+  for (c = 0; c < 3; c++)
+    {
+      palette[2][c] = (2 * palette[0][c] + palette[1][c]) / 3;
+      palette[3][c] = (palette[0][c] + 2 * palette[1][c]) / 3;
+    }
+  *indices = 0;
+  for (i = 0; i < 16; i++)
+    {
+      int best = 0, bestError = 1 << 30;
+
+      for (k = 0; k < 4; k++)
+        {
+          int e = 0;
+          for (c = 0; c < 3; c++)
+            {
+              int d = texels[i * 4 + c] - palette[k][c];
+              e += d * d;
+            }
+          if (e < bestError)
+            {
+              bestError = e;
+              best = k;
+            }
+        }
+      *indices |= best << (2 * i);
+      error += bestError;
+    }
+  return error;
+}
+
+// Least squares endpoints for the given indices
+static int FitEndpoints(const GLubyte texels[64], unsigned int indices, float e0[3], float e1[3])
+{
+  static const float weight[4] = {1.0f, 0.0f, 2.0f / 3.0f, 1.0f / 3.0f};
+  float aa = 0, ab = 0, bb = 0, ax[3] = {0, 0, 0}, bx[3] = {0, 0, 0}, det;
+  int i, c;
+
+  for (i = 0; i < 16; i++)
+    {
+      float a = weight[(indices >> (2 * i)) & 3], b = 1.0f - a;
+
+      aa += a * a;
+      ab += a * b;
+      bb += b * b;
+      for (c = 0; c < 3; c++)
+        {
+          ax[c] += a * texels[i * 4 + c];
+          bx[c] += b * texels[i * 4 + c];
+        }
+    }
+  det = aa * bb - ab * ab;
+  if (fabsf(det) < 1e-6f)
+    return 0;
+  for (c = 0; c < 3; c++)
+    {
+      e0[c] = (bb * ax[c] - ab * bx[c]) / det;
+      e1[c] = (aa * bx[c] - ab * ax[c]) / det;
+    }
+  return 1;
+}
+
+static void WriteColorBlock(unsigned int c0, unsigned int c1, unsigned int indices, GLubyte *block)
+{
+  int i;
+
+  // Four color mode needs c0 > c1; swapping the ends maps 0<->1 and 2<->3
+  if (c0 < c1)
+    {
+      unsigned int t = c0;
+      c0 = c1;
+      c1 = t;
+      indices ^= 0x55555555;
+    }
+  else if (c0 == c1)
+    indices = 0;
+  block[0] = c0 & 255;
+  block[1] = c0 >> 8;
+  block[2] = c1 & 255;
+  block[3] = c1 >> 8;
+  for (i = 0; i < 4; i++)
+    block[4 + i] = (indices >> (8 * i)) & 255;
+}
+
+void CompressBC1(const GLubyte texels[64], GLubyte block[8])
+{
+  float mean[3] = {0, 0, 0}, cov[6] = {0, 0, 0, 0, 0, 0}, axis[3] = {1, 1, 1};
+  float lo = 1e30f, hi = -1e30f, inset, e0[3], e1[3];
+  unsigned int c0, c1, indices, refined;
+  int i, c, error;
+
+  for (i = 0; i < 16; i++)
+    for (c = 0; c < 3; c++)
+      mean[c] += texels[i * 4 + c] / 16.0f;
+  for (i = 0; i < 16; i++)
+    {
+      float r = texels[i * 4] - mean[0], g = texels[i * 4 + 1] - mean[1], b = texels[i * 4 + 2] - mean[2];
+
+      cov[0] += r * r;
+      cov[1] += r * g;
+      cov[2] += r * b;
+      cov[3] += g * g;
+      cov[4] += g * b;
+      cov[5] += b * b;
+    }
+  // Principal axis by power iteration
+  for (i = 0; i < 8; i++)
+    {
+      float x = cov[0] * axis[0] + cov[1] * axis[1] + cov[2] * axis[2];
+      float y = cov[1] * axis[0] + cov[3] * axis[1] + cov[4] * axis[2];
+      float z = cov[2] * axis[0] + cov[4] * axis[1] + cov[5] * axis[2];
+      float n = fmaxf(fabsf(x), fmaxf(fabsf(y), fabsf(z)));
+
+      if (n < 1e-6f)
+        break;
+      axis[0] = x / n;
+      axis[1] = y / n;
+      axis[2] = z / n;
+    }
+  {
+    float n = sqrtf(axis[0] * axis[0] + axis[1] * axis[1] + axis[2] * axis[2]);
+    for (c = 0; c < 3; c++)
+      axis[c] /= n;
+  }
+  for (i = 0; i < 16; i++)
+    {
+      float t = 0;
+      for (c = 0; c < 3; c++)
+        t += (texels[i * 4 + c] - mean[c]) * axis[c];
+      lo = fminf(lo, t);
+      hi = fmaxf(hi, t);
+    }
+  // Pull the ends in a little, as the extremes are rarely hit exactly
+  inset = (hi - lo) / 16.0f;
+  for (c = 0; c < 3; c++)
+    {
+      e0[c] = mean[c] + (hi - inset) * axis[c];
+      e1[c] = mean[c] + (lo + inset) * axis[c];
+    }
+  c0 = Quantize565(e0);
+  c1 = Quantize565(e1);
+  error = ColorIndices(texels, c0, c1, &indices);
+
+  if (FitEndpoints(texels, indices, e0, e1))
+    {
+      unsigned int r0 = Quantize565(e0), r1 = Quantize565(e1);
+
+      if (ColorIndices(texels, r0, r1, &refined) < error)
+        {
+          c0 = r0;
+          c1 = r1;
+          indices = refined;
+        }
+    }
+  WriteColorBlock(c0, c1, indices, block);
+}
+
+void CompressBC3(const GLubyte texels[64], GLubyte block[16])
+{
+  GLubyte palette[8];
+  uint64_t bits = 0;
+  int a0 = 0, a1 = 255, i, k;
+
+  for (i = 0; i < 16; i++)
+    {
+      a0 = texels[i * 4 + 3] > a0 ? texels[i * 4 + 3] : a0;
+      a1 = texels[i * 4 + 3] < a1 ? texels[i * 4 + 3] : a1;
+    }
+  AlphaPalette(a0, a1, palette);
+  for (i = 0; i < 16 && a0 > a1; i++)
+    {
+      int best = 0, bestError = 256;
+
+      for (k = 0; k < 8; k++)
+        {
+          int e = abs(texels[i * 4 + 3] - palette[k]);
+          if (e < bestError)
+            {
+              bestError = e;
+              best = k;
+            }
+        }
+      bits |= (uint64_t)best << (3 * i);
+    }
+  block[0] = a0;
+  block[1] = a1;
+  for (i = 0; i < 6; i++)
+    block[2 + i] = (bits >> (8 * i)) & 255;
+  CompressBC1(texels, block + 8);
+}
+
+int WriteKTX(char *name, const MipChain *chain)
+{
+  static const GLubyte zeros[4];
+  GLenum format = chain->bytesPerPixel == 4 ? kKTXBC3 : kKTXBC1;
+  uint32_t keyValueSize = sizeof(kOrientation);
+  GLubyte texels[64], block[16];
+  KTXHeader h;
+  FILE *f;
+  int i, ok, bx, by, x, y;
+
+  memset(&h, 0, sizeof(h));
+  memcpy(h.identifier, kIdentifier, 12);
+  h.endianness = 0x04030201;
+  h.glTypeSize = 1;
+  h.glInternalFormat = format;
+  h.glBaseInternalFormat = chain->bytesPerPixel == 4 ? GL_RGBA : GL_RGB;
+  h.pixelWidth = chain->levels[0].width;
+  h.pixelHeight = chain->levels[0].height;
+  h.numberOfFaces = 1;
+  h.numberOfMipmapLevels = chain->numLevels;
+  h.bytesOfKeyValueData = 4 + ((keyValueSize + 3) & ~3);
+
+  f = fopen(name, "wb");
+  if (f == NULL)
+    return 0;
+  ok = fwrite(&h, sizeof(h), 1, f) == 1
+    && fwrite(&keyValueSize, 4, 1, f) == 1
+    && fwrite(kOrientation, keyValueSize, 1, f) == 1
+    && fwrite(zeros, ((keyValueSize + 3) & ~3) - keyValueSize, 1, f) <= 1;
+  for (i = 0; i < chain->numLevels && ok; i++)
+    {
+      const MipLevel *l = &chain->levels[i];
+      uint32_t size = LevelSize(format, l->width, l->height);
+
+      ok = fwrite(&size, 4, 1, f) == 1;
+      for (by = 0; by < l->height && ok; by += 4)
+        for (bx = 0; bx < l->width && ok; bx += 4)
+          {
+            // Edge blocks repeat the last row and column
+            for (y = 0; y < 4; y++)
+              for (x = 0; x < 4; x++)
+                {
+                  int sx = bx + x < l->width ? bx + x : l->width - 1;
+                  int sy = by + y < l->height ? by + y : l->height - 1;
+                  const GLubyte *p = &l->pixels[((size_t)sy * l->width + sx) * chain->bytesPerPixel];
+
+                  memcpy(&texels[(y * 4 + x) * 4], p, 3);
+                  texels[(y * 4 + x) * 4 + 3] = chain->bytesPerPixel == 4 ? p[3] : 255;
+                }
+            if (format == kKTXBC1)
+              CompressBC1(texels, block);
+            else
+              CompressBC3(texels, block);
+            ok = fwrite(block, BlockBytes(format), 1, f) == 1;
+          }
+    }
+  ok = (fclose(f) == 0) && ok;
+  if (!ok)
+    fprintf(stderr, "Unable to write %s\n", name);
+  return ok;
+}
+
+
+// Loading
+
+int LoadKTX(char *name, KTXTexture *ktx)
+{
+  const KTXHeader *h;
+  struct stat st;
+  const GLubyte *data, *p, *end;
+  int fd, i, width, height;
+
+  memset(ktx, 0, sizeof(KTXTexture));
+  fd = open(name, O_RDONLY);
+  if (fd < 0)
+    {
+      printf("could not open file %s\n", name);
+      return 0;
+    }
+  if (fstat(fd, &st) != 0 || st.st_size < (off_t)sizeof(KTXHeader))
+    {
+      close(fd);
+      printf("could not read header of %s\n", name);
+      return 0;
+    }
+  data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED)
+    return 0;
+  h = (const KTXHeader *)data;
+  end = data + st.st_size;
+
+  if (memcmp(h->identifier, kIdentifier, 12) != 0 || h->endianness != 0x04030201
+      || h->glType != 0
+      || (h->glInternalFormat != kKTXBC1 && h->glInternalFormat != kKTXBC3)
+      || h->pixelWidth < 1 || h->pixelHeight < 1 || h->pixelDepth != 0
+      || h->numberOfArrayElements != 0 || h->numberOfFaces != 1
+      || h->numberOfMipmapLevels < 1 || h->numberOfMipmapLevels > kMaxMipLevels
+      || h->bytesOfKeyValueData > (size_t)(end - data) - sizeof(KTXHeader))
+    {
+      printf("unsupported format in %s\n", name);
+      munmap((void *)data, st.st_size);
+      return 0;
+    }
+
+  ktx->format = h->glInternalFormat;
+  ktx->numLevels = h->numberOfMipmapLevels;
+  ktx->mapping = (void *)data;
+  ktx->mappingSize = st.st_size;
+  p = data + sizeof(KTXHeader) + h->bytesOfKeyValueData;
+  width = h->pixelWidth;
+  height = h->pixelHeight;
+  for (i = 0; i < ktx->numLevels; i++)
+    {
+      KTXLevel *l = &ktx->levels[i];
+
+      l->width = width;
+      l->height = height;
+      l->size = LevelSize(ktx->format, width, height);
+      if (end - p < 4 || *(const uint32_t *)p != (uint32_t)l->size || end - p - 4 < l->size)
+        {
+          printf("truncated level %d in %s\n", i, name);
+          FreeKTX(ktx);
+          return 0;
+        }
+      l->data = p + 4;
+      p += 4 + ((l->size + 3) & ~3);
+      width = width > 1 ? width / 2 : 1;
+      height = height > 1 ? height / 2 : 1;
+    }
+  return 1;
+}
+
+void FreeKTX(KTXTexture *ktx)
+{
+  if (ktx->mapping != NULL)
+    munmap(ktx->mapping, ktx->mappingSize);
+  memset(ktx, 0, sizeof(KTXTexture));
+}
+
+static int HasCompressedFormat(GLenum format)
+{
+  GLint count = 0, i, *formats;
+  int found = 0;
+
+  glGetIntegerv(GL_NUM_COMPRESSED_TEXTURE_FORMATS, &count);
+  if (count <= 0)
+    return 0;
+  formats = malloc(sizeof(GLint) * count);
+  glGetIntegerv(GL_COMPRESSED_TEXTURE_FORMATS, formats);
+  for (i = 0; i < count && !found; i++)
+    found = (GLenum)formats[i] == format;
+  free(formats);
+  return found;
+}
+
+GLuint UploadKTX(KTXTexture *ktx)
+{
+  MipChain chain;
+  GLuint tex;
+  int i;
+
+  if (!HasCompressedFormat(ktx->format))
+    {
+      DecodeKTX(ktx, &chain);
+      tex = UploadMipChain(&chain);
+      FreeMipChain(&chain);
+      return tex;
+    }
+
+  glGenTextures(1, &tex);
+  glBindTexture(GL_TEXTURE_2D, tex);
+  for (i = 0; i < ktx->numLevels; i++)
+    {
+      const KTXLevel *l = &ktx->levels[i];
+      glCompressedTexImage2D(GL_TEXTURE_2D, i, ktx->format, l->width, l->height, 0, l->size, l->data);
+    }
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, ktx->numLevels - 1);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, ktx->numLevels > 1 ? GL_LINEAR_MIPMAP_LINEAR : GL_LINEAR);
+  return tex;
+}
@@ -0,0 +1,52 @@
+#ifndef ktx_h
+#define ktx_h
+
+#include "mipmap.h"
+
+#ifndef GL_COMPRESSED_RGB_S3TC_DXT1_EXT
+#define GL_COMPRESSED_RGB_S3TC_DXT1_EXT 0x83F0
+#endif
+#ifndef GL_COMPRESSED_RGBA_S3TC_DXT5_EXT
+#define GL_COMPRESSED_RGBA_S3TC_DXT5_EXT 0x83F3
+#endif
+
+// Block compressed formats of KTX files; BC1 for RGB and BC3 for RGBA
+#define kKTXBC1 GL_COMPRESSED_RGB_S3TC_DXT1_EXT
+#define kKTXBC3 GL_COMPRESSED_RGBA_S3TC_DXT5_EXT
+
+typedef struct
+{
+  GLint width, height;
+  GLsizei size;
+  const GLubyte *data; // Blocks of 4x4 texels, rows from the bottom
+} KTXLevel;
+
+typedef struct
+{
+  GLenum format; // kKTXBC1 or kKTXBC3
+  GLint numLevels;
+  KTXLevel levels[kMaxMipLevels];
+  void *mapping;
+  size_t mappingSize;
+} KTXTexture;
+
+// Map a KTX 1.1 file with BC1 or BC3 levels. Returns 0 on failure.
+int LoadKTX(char *name, KTXTexture *ktx);
+void FreeKTX(KTXTexture *ktx);
+
+// Decode every level to RGBA, for drivers without the format
+void DecodeKTX(const KTXTexture *ktx, MipChain *chain);
+
+// Create a texture from the compressed levels when the driver lists the
+// format, or else from the decoded levels
+GLuint UploadKTX(KTXTexture *ktx);
+
+// Compress every level of a chain, BC1 for 3 and BC3 for 4 bytes per
+// pixel, into a KTX file. Returns 0 on failure.
+int WriteKTX(char *name, const MipChain *chain);
+
+// 4x4 RGBA texels, row by row, to one block
+void CompressBC1(const GLubyte texels[64], GLubyte block[8]);
+void CompressBC3(const GLubyte texels[64], GLubyte block[16]);
+
+#endif
@@ -6,11 +6,21 @@
 
 // Extended version with LoadModelPlus
 
+#define _POSIX_C_SOURCE 200809L
+
 #include "loadobj.h"
+#include "meshopt.h"
+#include "GL_utilities.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdint.h>
 #include <math.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #define PI 3.141592
 
@@ -38,24 +48,6 @@ typedef struct Mesh
 
 
 
-#define vToken        1
-#define vnToken       2
-#define vtToken       3
-#define kReal         4
-#define kInt          5
-#define tripletToken  6
-#define fToken        7
-#define crlfToken     8
-#define kEOF          9
-#define kUnknown     10
-
-
-static FILE *fp;
-
-static int intValue[3];
-static float floatValue[3];
-static int vertCount, texCount, normalsCount, coordCount;
-
 #ifndef false
 #define false 0
 #endif
@@ -66,433 +58,552 @@ static int vertCount, texCount, normalsCount, coordCount;
 #define bool char
 #endif
 
-static bool hasPositionIndices;
-static bool hasNormalIndices;
-static bool hasTexCoordIndices;
 
-static bool atLineEnd; // Helps SkipToCRLF
+// Growable arrays, filled by the single pass parser
 
+typedef struct
+{
+  GLfloat *data;
+  int count;
+  int capacity;
+} FloatArray;
 
-static void OBJGetToken(int * tokenType)
+typedef struct
 {
-  char c;
-  char s[255];
-  int i;
+  int *data;
+  int count;
+  int capacity;
+} IntArray;
 
-  // 1. skip space. Check for #, skip line when found
-  c = getc(fp);
-  while (c == 32 || c == 9 || c == '#')
+static void PushFloat(FloatArray *a, GLfloat value)
+{
+  if (a->count == a->capacity)
     {
-      while (c == '#')
-    while (c != 13 && c != 10 && c != EOF)
-      c = getc(fp); // Skip comment
-      c = getc(fp);
+      a->capacity = a->capacity ? a->capacity * 2 : 1024;
+      a->data = realloc(a->data, sizeof(GLfloat) * a->capacity);
     }
+  a->data[a->count++] = value;
+}
+
+static void PushInt(IntArray *a, int value)
+{
+  if (a->count == a->capacity)
+    {
+      a->capacity = a->capacity ? a->capacity * 2 : 1024;
+      a->data = realloc(a->data, sizeof(int) * a->capacity);
+    }
+  a->data[a->count++] = value;
+}
+
+// Hand over the array, or NULL if it is empty
+static void *TakeArray(void *data, int count)
+{
+  if (count > 0)
+    return data;
+  free(data);
+  return NULL;
+}
+
+
+// All parser state lives in the context, so several files can be
+// loaded at the same time from different threads.
+
+typedef struct
+{
+  const char *p; // Current position in the mapped file
+  const char *end;
+
+  FloatArray vertices;
+  FloatArray normals;
+  FloatArray texCoords;
+
+  // One entry per polygon corner, -1 terminates each polygon
+  IntArray coordIndex;
+  IntArray normalsIndex;
+  IntArray textureIndex;
 
-  // Inspect first character. Bracket, number, other?
+  // Positions in the index arrays holding negative (relative) OBJ
+  // indices, which are relative to the start of the parsed chunk
+  IntArray relativeCoords;
+  IntArray relativeNormals;
+  IntArray relativeTexCoords;
 
-  if (c == 13 || c == 10)
+  bool hasNormalIndices;
+  bool hasTexCoordIndices;
+} OBJParser;
+
+#define IsSpace(c) ((c) == ' ' || (c) == '\t')
+#define IsLineEnd(c) ((c) == '\n' || (c) == '\r')
+#define IsDigit(c) ((c) >= '0' && (c) <= '9')
+
+static void SkipSpace(OBJParser *ps)
+{
+  while (ps->p < ps->end && IsSpace(*ps->p))
+    ps->p++;
+}
+
+static void SkipToken(OBJParser *ps)
+{
+  while (ps->p < ps->end && !IsSpace(*ps->p) && !IsLineEnd(*ps->p))
+    ps->p++;
+}
+
+static void SkipLine(OBJParser *ps)
+{
+  while (ps->p < ps->end && !IsLineEnd(*ps->p))
+    ps->p++;
+  while (ps->p < ps->end && IsLineEnd(*ps->p))
+    ps->p++;
+}
+
+static bool AtLineEnd(OBJParser *ps)
+{
+  return ps->p >= ps->end || IsLineEnd(*ps->p);
+}
+
+// True if rounding d to float might differ from rounding the exact
+// decimal value, i.e. d lies on (or next to) a float rounding midpoint
+static bool NearFloatTie(double d)
+{
+  uint64_t bits;
+  uint64_t low;
+
+  memcpy(&bits, &d, sizeof(bits));
+  low = bits & 0x1FFFFFFF; // The 29 mantissa bits dropped by (float)
+  return low >= 0x0FFFFFFF && low <= 0x10000001;
+}
+
+// Exact powers of ten in double precision
+static const double kPow10[] = {
+  1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+  1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+};
+
+// Same result as sscanf("%f"). The common case of a short decimal is
+// computed exactly in double precision, anything else goes to strtof.
+static bool ParseFloat(OBJParser *ps, GLfloat *value)
+{
+  const char *start = ps->p;
+  const char *p = ps->p;
+  const char *end = ps->end;
+  uint64_t mantissa = 0;
+  int exponent = 0;
+  int digits = 0;
+  bool negative = false;
+  bool exact = true;
+  double d;
+
+  if (p < end && (*p == '-' || *p == '+'))
+    negative = (*p++ == '-');
+  for (; p < end && IsDigit(*p); p++, digits++)
     {
-      *tokenType = crlfToken;
-      //        while (c == 13 && c == 10)
-      //                c = getc(fp);
+      if (mantissa < 100000000000000000ULL)
+        mantissa = mantissa * 10 + (*p - '0');
+      else
+        {
+          exponent++;
+          exact = false;
+        }
     }
-  else
-    if ((c >= '0' && c <= '9') || c == '-' || c == '.') // Numerical value
-      {
-    *tokenType = kInt;
-    i = 0;
-    while (c != 13 && c != 10 && c != 32 && c != 9 && c != '/' && c != EOF)
+  if (p < end && *p == '.')
+    for (p++; p < end && IsDigit(*p); p++, digits++)
       {
-        if (c == '.' || c == 'E')
-          *tokenType = kReal;
-        s[i++] = c;
-        c = getc(fp);
-      }
-    s[i] = 0;
-    sscanf(s, "%f", &floatValue[0]);
-    sscanf(s, "%d", &intValue[0]);
-    // Check for /
-    if (c == '/') // parse another number
-      {
-        c = getc(fp);
-        i = 0;
-        while (c != 13 && c != 10 && c != 32 && c != 9 && c != '/' && c != EOF)
+        if (mantissa < 100000000000000000ULL)
           {
-        s[i++] = c;
-        c = getc(fp);
-          }
-        s[i] = 0;
-
-        if (i == 0)
-          {
-        floatValue[1] = -1;
-        intValue[1] = -1;
+            mantissa = mantissa * 10 + (*p - '0');
+            exponent--;
           }
         else
-          {
-        sscanf(s, "%f", &floatValue[1]);
-        sscanf(s, "%d", &intValue[1]);
-          }
-        *tokenType = tripletToken;
+          exact = false;
       }
-    if (c == '/') // parse one more number
-      {
-        c = getc(fp);
-        i = 0;
-        while (c != 13 && c != 10 && c != 32 && c != 9 && c != '/' && c != EOF)
-          {
-        s[i++] = c;
-        c = getc(fp);
-          }
-        s[i] = 0;
+  if (digits == 0)
+    return false;
+  if (p < end && (*p == 'e' || *p == 'E'))
+    {
+      const char *q = p + 1;
+      int e = 0;
+      bool negativeExponent = false;
 
-        if (i == 0)
-          {
-        floatValue[2] = -1;
-        intValue[2] = -1;
-          }
-        else
-          {
-        sscanf(s, "%f", &floatValue[2]);
-        sscanf(s, "%i", &intValue[2]);
-          }
-        *tokenType = tripletToken;
-      }
-      }
-    else
-      if (c == EOF)
+      if (q < end && (*q == '-' || *q == '+'))
+        negativeExponent = (*q++ == '-');
+      if (q < end && IsDigit(*q))
+        {
+          for (; q < end && IsDigit(*q); q++)
+            if (e < 10000)
+              e = e * 10 + (*q - '0');
+          exponent += negativeExponent ? -e : e;
+          p = q;
+        }
+    }
+  ps->p = p;
+
+  if (mantissa == 0)
     {
-      *tokenType = kEOF;
+      *value = negative ? -0.0f : 0.0f;
+      return true;
     }
-      else // Other
+  if (exact && mantissa < (1ULL << 53) && exponent >= -22 && exponent <= 22)
     {
-      i = 0;
-      while (c != 13 && c != 10 && c != 32 && c != 9 && c != EOF)
+      d = exponent < 0 ? mantissa / kPow10[-exponent] : mantissa * kPow10[exponent];
+      if (d > 1e-37 && d < 1e37 && !NearFloatTie(d))
         {
-          s[i++] = c;
-          c = getc(fp);
+          *value = (GLfloat)(negative ? -d : d);
+          return true;
         }
-      s[i] = 0;
+    }
 
-      *tokenType = kUnknown;
-      // Compare string to symbols
+  // Slow path, on a terminated copy since the mapping is not
+    {
+      char s[64];
+      int n = p - start;
 
-      if (strcmp(s, "v") == 0)
-        *tokenType = vToken;
-      if (strcmp(s, "vn") == 0)
-        *tokenType = vnToken;
-      if (strcmp(s, "vt") == 0)
-        *tokenType = vtToken;
-      if (strcmp(s, "f") == 0)
-        *tokenType = fToken;
+      if (n > 63) n = 63;
+      memcpy(s, start, n);
+      s[n] = 0;
+      *value = strtof(s, NULL);
     }
-  atLineEnd = (c == 13 || c == 10);
-} // ObjGetToken
+  return true;
+}
 
-static void SkipToCRLF()
+static bool ParseInt(OBJParser *ps, int *value)
 {
-  char c = 0;
-
-  if (!atLineEnd)
-    while (c != 10 && c != 13 && c != EOF)
-      c = getc(fp);
-  //    while (tokenType != crlfToken && tokenType != kEOF)
-  //        OBJGetToken(&tokenType);
+  const char *p = ps->p;
+  bool negative = false;
+  int v = 0;
+
+  if (p < ps->end && (*p == '-' || *p == '+'))
+    negative = (*p++ == '-');
+  if (p >= ps->end || !IsDigit(*p))
+    return false;
+  for (; p < ps->end && IsDigit(*p); p++)
+    v = v * 10 + (*p - '0');
+  ps->p = p;
+  *value = negative ? -v : v;
+  return true;
 }
 
-//static void SkipToCRLF(int tokenType)
-//{
-//  while (tokenType != crlfToken && tokenType != kEOF)
-//      OBJGetToken(&tokenType);
-//}
-
-static void ReadOneVertex(MeshPtr theMesh)
+// Read up to n floats from the rest of the line, missing ones are zero
+static void ReadFloats(OBJParser *ps, FloatArray *a, int n)
 {
-  GLfloat x, y, z;
-  int tokenType;
-
-  // Three floats expected
-  OBJGetToken(&tokenType);
-  if (tokenType == kInt || tokenType == kReal)
-    x = floatValue[0];
-  OBJGetToken(&tokenType);
-  if (tokenType == kInt || tokenType == kReal)
-    y = floatValue[0];
-  OBJGetToken(&tokenType);
-  if (tokenType == kInt || tokenType == kReal)
-    z = floatValue[0];
-  SkipToCRLF();
+  int i;
+  GLfloat value;
 
-  // Write to array if it exists
-  if (theMesh->vertices != NULL)
+  for (i = 0; i < n; i++)
     {
-      theMesh->vertices[vertCount++] = x;
-      theMesh->vertices[vertCount++] = y;
-      theMesh->vertices[vertCount++] = z;
+      SkipSpace(ps);
+      if (AtLineEnd(ps) || !ParseFloat(ps, &value))
+        value = 0;
+      SkipToken(ps);
+      PushFloat(a, value);
     }
-  else
-    vertCount = vertCount + 3;
+  SkipLine(ps);
 }
 
-static void ReadOneTexture(MeshPtr theMesh)
+// Make an OBJ index (1-based, or negative relative to the end) 0-based
+static int ResolveIndex(int index, int count)
 {
-  int tokenType;
-  GLfloat s, t;
+  return index < 0 ? count + index : index - 1;
+}
 
-  // Two floats expected
-  OBJGetToken(&tokenType);
-  if (tokenType == kInt || tokenType == kReal)
-    s = floatValue[0];
-  OBJGetToken(&tokenType);
-  if (tokenType == kInt || tokenType == kReal)
-    t = floatValue[0];
-  SkipToCRLF();
+static void ReadFace(OBJParser *ps)
+{
+  int v, vt, vn;
 
-  // Write to array if it exists
-  if (theMesh->textureCoords != NULL)
+  while (1)
     {
-      theMesh->textureCoords[texCount++] = s;
-      theMesh->textureCoords[texCount++] = t;
+      SkipSpace(ps);
+      if (AtLineEnd(ps))
+        break;
+      if (!ParseInt(ps, &v))
+        {
+          SkipToken(ps);
+          continue;
+        }
+      vt = vn = 0;
+      if (ps->p < ps->end && *ps->p == '/')
+        {
+          ps->p++;
+          ParseInt(ps, &vt);
+          if (ps->p < ps->end && *ps->p == '/')
+            {
+              ps->p++;
+              ParseInt(ps, &vn);
+            }
+        }
+      SkipToken(ps);
+
+      PushInt(&ps->coordIndex, ResolveIndex(v, ps->vertices.count / 3));
+      PushInt(&ps->textureIndex, vt ? ResolveIndex(vt, ps->texCoords.count / 2) : -1);
+      PushInt(&ps->normalsIndex, vn ? ResolveIndex(vn, ps->normals.count / 3) : -1);
+      if (v < 0)
+        PushInt(&ps->relativeCoords, ps->coordIndex.count - 1);
+      if (vt < 0)
+        PushInt(&ps->relativeTexCoords, ps->textureIndex.count - 1);
+      if (vn < 0)
+        PushInt(&ps->relativeNormals, ps->normalsIndex.count - 1);
+      if (vt)
+        ps->hasTexCoordIndices = true;
+      if (vn)
+        ps->hasNormalIndices = true;
     }
-  else
-    texCount = texCount + 2;
+
+  // Terminate polygon with -1 (like VRML)
+  PushInt(&ps->coordIndex, -1);
+  PushInt(&ps->textureIndex, -1);
+  PushInt(&ps->normalsIndex, -1);
+  SkipLine(ps);
 }
 
-static void ReadOneNormal(MeshPtr theMesh)
+static void ParseOBJ(OBJParser *ps)
 {
-  int tokenType;
-  GLfloat x, y, z;
-
-  // Three floats expected
-  OBJGetToken(&tokenType);
-  if (tokenType == kInt || tokenType == kReal)
-    x = floatValue[0];
-  OBJGetToken(&tokenType);
-  if (tokenType == kInt || tokenType == kReal)
-    y = floatValue[0];
-  OBJGetToken(&tokenType);
-  if (tokenType == kInt || tokenType == kReal)
-    z = floatValue[0];
-  SkipToCRLF();
-
-  // Write to array if it exists
-  if (theMesh->vertexNormals != NULL)
+  while (ps->p < ps->end)
     {
-      theMesh->vertexNormals[normalsCount++] = x;
-      theMesh->vertexNormals[normalsCount++] = y;
-      theMesh->vertexNormals[normalsCount++] = z;
+      const char *keyword;
+      int length;
+
+      SkipSpace(ps);
+      keyword = ps->p;
+      SkipToken(ps);
+      length = ps->p - keyword;
+
+      if (length == 1 && keyword[0] == 'v')
+        ReadFloats(ps, &ps->vertices, 3);
+      else if (length == 2 && keyword[0] == 'v' && keyword[1] == 'n')
+        ReadFloats(ps, &ps->normals, 3);
+      else if (length == 2 && keyword[0] == 'v' && keyword[1] == 't')
+        ReadFloats(ps, &ps->texCoords, 2);
+      else if (length == 1 && keyword[0] == 'f')
+        ReadFace(ps);
+      else
+        SkipLine(ps); // Comments, groups, materials, blank lines...
     }
-  else
-    normalsCount = normalsCount + 3;
 }
 
-static void ReadOneFace(MeshPtr theMesh)
-{
-  int tokenType;
-  bool triplets = false;
 
-  // OBS! Unknown number! Can be one single vertex index or a triplet
-  do
-    {
-      OBJGetToken(&tokenType);
+// Large files are split into line-aligned chunks that are parsed in
+// parallel, one OBJParser each, and then merged.
 
-      switch (tokenType)
-    {
-    case kReal: // Real should not happen
-    case kInt:
-      if (intValue[0] != 0)
-        {
-          hasPositionIndices = true;
+#ifndef OBJ_MIN_CHUNK_SIZE
+#define OBJ_MIN_CHUNK_SIZE (1 << 20)
+#endif
+#define OBJ_MAX_CHUNKS 64
 
-          // Single index
-          if (theMesh->coordIndex != NULL)
-        {
-          if (intValue[0] >= 0)
-            theMesh->coordIndex[coordCount] = intValue[0]-1;
-          else
-            theMesh->coordIndex[coordCount] =
-              vertCount / 3 + intValue[0];
-        }
-        }
-      break;
-    case tripletToken:
-      // Triplet (out of which some may be missing)
+static void *ParseOBJThread(void *parser)
+{
+  ParseOBJ((OBJParser *)parser);
+  return NULL;
+}
 
-      if (intValue[0] != 0)
-        {
-          hasPositionIndices = true;
+static void AppendFloats(FloatArray *to, FloatArray *from)
+{
+  if (from->count > 0)
+    memcpy(&to->data[to->count], from->data, sizeof(GLfloat) * from->count);
+  to->count += from->count;
+  free(from->data);
+}
 
-          if (theMesh->coordIndex != NULL)
-        {
-          if (intValue[0] > 0)
-            theMesh->coordIndex[coordCount] = intValue[0]-1;
-          else
-            theMesh->coordIndex[coordCount] =
-              vertCount+intValue[0];
-        }
-        }
-      if (intValue[1] != 0)
-        {
-          hasTexCoordIndices = true;
+// Append the indices of a chunk, making its relative indices absolute
+static void AppendIndices(IntArray *to, IntArray *from, IntArray *relative, int base)
+{
+  int i;
+  int *indices = &to->data[to->count];
+
+  if (from->count > 0)
+    memcpy(indices, from->data, sizeof(int) * from->count);
+  for (i = 0; i < relative->count; i++)
+    indices[relative->data[i]] += base;
+  to->count += from->count;
+  free(from->data);
+  free(relative->data);
+}
 
-          if (theMesh->textureIndex != NULL)
-        {
-          if (intValue[1] > 0)
-            theMesh->textureIndex[coordCount] = intValue[1]-1;
-          else
-            theMesh->textureIndex[coordCount] =
-              texCount / 2 + intValue[1];
-        }
-        }
-      if (intValue[2] != 0)
-        {
-          hasNormalIndices = true;
+static void AllocFloats(FloatArray *a, int count)
+{
+  a->data = malloc(sizeof(GLfloat) * (count > 0 ? count : 1));
+  a->capacity = count;
+}
 
-          if (theMesh->normalsIndex != NULL)
-        {
-          if (intValue[2] >= 0)
-            theMesh->normalsIndex[coordCount] = intValue[2]-1;
-          else
-            theMesh->normalsIndex[coordCount] =
-              normalsCount / 3 + intValue[2];
-        }
-        }
-      triplets = true;
-      break;
-    }
+static void AllocInts(IntArray *a, int count)
+{
+  a->data = malloc(sizeof(int) * (count > 0 ? count : 1));
+  a->capacity = count;
+}
 
-      coordCount++;
-    }
-  while (tokenType != kEOF && tokenType != crlfToken != atLineEnd);
+// Concatenate the chunks in file order into one parser, with prefix
+// summed vertex, normal and texture coordinate offsets
+static void MergeOBJParsers(OBJParser *chunks, int n, OBJParser *out)
+{
+  int i;
+  int vertices = 0, normals = 0, texCoords = 0, indices = 0;
+  int vertexBase = 0, normalBase = 0, texCoordBase = 0;
 
-  // Terminate polygon with -1 (like VRML)
-  if (theMesh->coordIndex != NULL)
+  for (i = 0; i < n; i++)
     {
-      theMesh->coordIndex[coordCount] = -1;
+      vertices += chunks[i].vertices.count;
+      normals += chunks[i].normals.count;
+      texCoords += chunks[i].texCoords.count;
+      indices += chunks[i].coordIndex.count;
     }
-  if (triplets)
-    {
-      if (theMesh->textureIndex != NULL)
-    {
-      theMesh->textureIndex[coordCount] = -1;
-    }
-      if (theMesh->normalsIndex != NULL)
+
+  memset(out, 0, sizeof(OBJParser));
+  AllocFloats(&out->vertices, vertices);
+  AllocFloats(&out->normals, normals);
+  AllocFloats(&out->texCoords, texCoords);
+  AllocInts(&out->coordIndex, indices);
+  AllocInts(&out->normalsIndex, indices);
+  AllocInts(&out->textureIndex, indices);
+
+  for (i = 0; i < n; i++)
     {
-      theMesh->normalsIndex[coordCount] = -1;
-    }
-    }
+      OBJParser *c = &chunks[i];
 
-  coordCount++;
+      AppendIndices(&out->coordIndex, &c->coordIndex, &c->relativeCoords, vertexBase);
+      AppendIndices(&out->normalsIndex, &c->normalsIndex, &c->relativeNormals, normalBase);
+      AppendIndices(&out->textureIndex, &c->textureIndex, &c->relativeTexCoords, texCoordBase);
+      vertexBase += c->vertices.count / 3;
+      normalBase += c->normals.count / 3;
+      texCoordBase += c->texCoords.count / 2;
+
+      AppendFloats(&out->vertices, &c->vertices);
+      AppendFloats(&out->normals, &c->normals);
+      AppendFloats(&out->texCoords, &c->texCoords);
+
+      out->hasNormalIndices |= c->hasNormalIndices;
+      out->hasTexCoordIndices |= c->hasTexCoordIndices;
+    }
 }
 
-static void ParseOBJ(MeshPtr theMesh)
+static void ParseOBJChunked(const char *data, size_t size, OBJParser *parser)
 {
-  int tokenType;
+  OBJParser chunks[OBJ_MAX_CHUNKS];
+  pthread_t threads[OBJ_MAX_CHUNKS];
+  bool started[OBJ_MAX_CHUNKS];
+  long cores = sysconf(_SC_NPROCESSORS_ONLN);
+  int n = size / OBJ_MIN_CHUNK_SIZE;
+  int i;
+  const char *start = data;
+  const char *end = data + size;
 
-  tokenType = 0;
-  while (tokenType != kEOF)
+  if (n > cores) n = cores;
+  if (n > OBJ_MAX_CHUNKS) n = OBJ_MAX_CHUNKS;
+  if (n < 2)
     {
-      OBJGetToken(&tokenType);
-      switch (tokenType)
+      memset(parser, 0, sizeof(OBJParser));
+      parser->p = data;
+      parser->end = end;
+      ParseOBJ(parser);
+      return;
+    }
+
+  memset(chunks, 0, sizeof(chunks));
+  for (i = 0; i < n; i++)
     {
-    case vToken:
-      ReadOneVertex(theMesh);
-      break;
-    case vnToken:
-      ReadOneNormal(theMesh);
-      break;
-    case vtToken:
-      ReadOneTexture(theMesh);
-      break;
-    case fToken:
-      ReadOneFace(theMesh);
-      break;
-    case kReal:
-      // Ignore
-      break;
-    case crlfToken:
-      break;
-    case kUnknown:
-      SkipToCRLF();
-      //while (tokenType != crlfToken && tokenType != kEOF)
-      //    OBJGetToken(&tokenType);
-      break;
+      // Move the nominal split point to the start of the next line
+      const char *split = (i == n - 1) ? end : data + size / n * (i + 1);
+
+      if (split < start)
+        split = start;
+      while (split < end && !IsLineEnd(*split))
+        split++;
+      while (split < end && IsLineEnd(*split))
+        split++;
+      chunks[i].p = start;
+      chunks[i].end = split;
+      start = split;
     }
+
+  // The calling thread takes the first chunk
+  for (i = 1; i < n; i++)
+    started[i] = (pthread_create(&threads[i], NULL, ParseOBJThread, &chunks[i]) == 0);
+  ParseOBJ(&chunks[0]);
+  for (i = 1; i < n; i++)
+    {
+      if (started[i])
+        pthread_join(threads[i], NULL);
+      else
+        ParseOBJ(&chunks[i]);
     }
-}
 
+  MergeOBJParsers(chunks, n, parser);
+}
 
 static struct Mesh * LoadOBJ(const char *filename)
 {
   Mesh *theMesh;
+  OBJParser parser;
+  struct stat st;
+  void *data = NULL;
+  int fd;
 
-  theMesh = malloc(sizeof(Mesh));
-  theMesh->coordIndex = NULL;
-  theMesh->vertices = NULL;
-  // ProcessMesh may deal with these
-  theMesh->triangleCountList = NULL;
-  theMesh->vertexNormals = NULL;
-  theMesh->vertexToTriangleTable = NULL;
-  theMesh->textureCoords = NULL;
-  theMesh->textureIndex = NULL;
-  theMesh->normalsIndex = NULL;
-
-  hasPositionIndices = true;
-  hasTexCoordIndices = false;
-  hasNormalIndices = false;
-
-  vertCount=0;
-  texCount=0;
-  normalsCount=0;
-  coordCount=0;
-
-  fp = fopen(filename, "rw");
-  if (fp == NULL)
+  fd = open(filename, O_RDONLY);
+  if (fd < 0 || fstat(fd, &st) != 0)
     {
       fprintf(stderr, "Unable to open file\n");
       fflush(stderr);
+      if (fd >= 0)
+        close(fd);
       return NULL;
     }
-  ParseOBJ(theMesh);
-  fclose(fp);
-
-  // Allocate arrays!
-  if (vertCount > 0)
-    theMesh->vertices = malloc(sizeof(GLfloat) * vertCount);
-  if (texCount > 0)
-    theMesh->textureCoords = malloc(sizeof(GLfloat) * texCount);
-  if (normalsCount > 0)
-    theMesh->vertexNormals = malloc(sizeof(GLfloat) * normalsCount);
-  if (hasPositionIndices)
-    theMesh->coordIndex = malloc(sizeof(int) * coordCount);
-  if (hasNormalIndices)
-    theMesh->normalsIndex = malloc(sizeof(int) * coordCount);
-  if (hasTexCoordIndices)
-    theMesh->textureIndex = malloc(sizeof(int) * coordCount);
-
-  // Zero again
-  vertCount=0;
-  texCount=0;
-  normalsCount=0;
-  coordCount=0;
-
-  fp = fopen(filename, "rw");
-  if (fp == NULL) return NULL;
-  ParseOBJ(theMesh);
-  fclose(fp);
-
-  theMesh->vertexCount = vertCount/3;
-  theMesh->coordCount = coordCount;
-
-  // Counters for tex and normals, texCount and normalsCount
-  theMesh->texCount = texCount/2;
-  theMesh->normalsCount = normalsCount/3; // Should be the same as vertexCount!
-  // This assumption could make handling of some models break!
+  if (st.st_size > 0)
+    {
+      data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+      if (data == MAP_FAILED)
+        {
+          fprintf(stderr, "Unable to map file\n");
+          fflush(stderr);
+          close(fd);
+          return NULL;
+        }
+      posix_madvise(data, st.st_size, POSIX_MADV_SEQUENTIAL);
+    }
+  close(fd);
+
+  ParseOBJChunked(data, st.st_size, &parser);
+  free(parser.relativeCoords.data);
+  free(parser.relativeNormals.data);
+  free(parser.relativeTexCoords.data);
+  if (data != NULL)
+    munmap(data, st.st_size);
+
+  theMesh = malloc(sizeof(Mesh));
+  memset(theMesh, 0, sizeof(Mesh));
+
+  theMesh->vertices = TakeArray(parser.vertices.data, parser.vertices.count);
+  theMesh->textureCoords = TakeArray(parser.texCoords.data, parser.texCoords.count);
+  theMesh->vertexNormals = TakeArray(parser.normals.data, parser.normals.count);
+  theMesh->coordIndex = parser.coordIndex.data;
+  if (theMesh->coordIndex == NULL)
+    theMesh->coordIndex = malloc(sizeof(int));
+
+  if (parser.hasNormalIndices)
+    theMesh->normalsIndex = parser.normalsIndex.data;
+  else
+    free(parser.normalsIndex.data);
+  if (parser.hasTexCoordIndices)
+    theMesh->textureIndex = parser.textureIndex.data;
+  else
+    free(parser.textureIndex.data);
+
+  theMesh->vertexCount = parser.vertices.count / 3;
+  theMesh->coordCount = parser.coordIndex.count;
+  theMesh->texCount = parser.texCoords.count / 2;
+  theMesh->normalsCount = parser.normals.count / 3;
 
   return theMesh;
 }
 
+static void DisposeMesh(Mesh *theMesh)
+{
+  free(theMesh->vertices);
+  free(theMesh->vertexNormals);
+  free(theMesh->textureCoords);
+  free(theMesh->coordIndex);
+  free(theMesh->normalsIndex);
+  free(theMesh->textureIndex);
+  free(theMesh);
+}
+
+
 void DecomposeToTriangles(struct Mesh *theMesh)
 {
   int i, vertexCount, triangleCount;
@@ -680,84 +791,88 @@ static void generateNormals(Mesh* mesh)
 }
 
 
+typedef struct
+{
+  int positionIndex;
+  int normalIndex;
+  int texCoordIndex;
+} IndexTriplet;
+
+static uint32_t HashTriplet(const IndexTriplet *t)
+{
+  uint32_t h = (uint32_t)t->positionIndex * 0x9e3779b1u;
+
+  h ^= (uint32_t)t->normalIndex * 0x85ebca77u;
+  h ^= (uint32_t)t->texCoordIndex * 0xc2b2ae3du;
+  h ^= h >> 15;
+  h *= 0x2c1b3c6du;
+  h ^= h >> 12;
+  return h;
+}
+
 static Model* generateModel(Mesh* mesh)
 {
   // Convert from Mesh format (multiple index lists) to Model format
   // (one index list) by generating a new set of vertices/indices
-  // and where new vertices have been created whenever necessary
-
-
-  typedef struct
-  {
-    int positionIndex;
-    int normalIndex;
-    int texCoordIndex;
-    int newIndex;
-  } IndexTriplet;
-
-  int hashGap = 6;
-
-  int indexHashMapSize = (mesh->vertexCount * hashGap + mesh->coordCount);
-
-  IndexTriplet* indexHashMap = malloc(sizeof(IndexTriplet)
-                      * indexHashMapSize);
-
+  // and where new vertices have been created whenever necessary.
+  // Unique triplets are found with an open-addressing hash table of at
+  // least twice the number of indices, so probes stay short and the
+  // table never fills. New vertices are numbered by first use.
+
+  IndexTriplet* uniqueVertices = malloc(sizeof(IndexTriplet)
+                                        * (mesh->coordCount > 0 ? mesh->coordCount : 1));
+  uint32_t tableSize = 16;
+  uint32_t mask;
+  int* table;
   int numNewVertices = 0;
   int index;
 
-  int maxValue = 0;
-
   Model* model = malloc(sizeof(Model));
   memset(model, 0, sizeof(Model));
 
   model->indexArray = malloc(sizeof(GLuint) * mesh->coordCount);
   model->numIndices = mesh->coordCount;
 
-  memset(indexHashMap, 0xff, sizeof(IndexTriplet) * indexHashMapSize);
+  while (tableSize < 2 * (uint32_t)mesh->coordCount)
+    tableSize *= 2;
+  mask = tableSize - 1;
+  table = malloc(sizeof(int) * tableSize);
+  memset(table, 0xff, sizeof(int) * tableSize); // -1, empty
 
   for (index = 0; index < mesh->coordCount; index++)
     {
-      IndexTriplet currentVertex = { -1, -1, -1, -1 };
-      int insertPos = 0;
+      IndexTriplet currentVertex = { -1, -1, -1 };
+      uint32_t slot;
+
       if (mesh->coordIndex)
-    currentVertex.positionIndex = mesh->coordIndex[index];
+        currentVertex.positionIndex = mesh->coordIndex[index];
       if (mesh->normalsIndex)
-    currentVertex.normalIndex = mesh->normalsIndex[index];
+        currentVertex.normalIndex = mesh->normalsIndex[index];
       if (mesh->textureIndex)
-    currentVertex.texCoordIndex = mesh->textureIndex[index];
-
-      if (maxValue < currentVertex.texCoordIndex)
-    maxValue = currentVertex.texCoordIndex;
-
-      if (currentVertex.positionIndex >= 0)
-    insertPos = currentVertex.positionIndex * hashGap;
+        currentVertex.texCoordIndex = mesh->textureIndex[index];
 
-      while (1)
-    {
-      if (indexHashMap[insertPos].newIndex == -1)
-        {
-          currentVertex.newIndex = numNewVertices++;
-          indexHashMap[insertPos] = currentVertex;
-          break;
-        }
-      else if (indexHashMap[insertPos].positionIndex
-           == currentVertex.positionIndex
-           && indexHashMap[insertPos].normalIndex
-           == currentVertex.normalIndex
-           && indexHashMap[insertPos].texCoordIndex
-           == currentVertex.texCoordIndex)
+      for (slot = HashTriplet(&currentVertex) & mask; ; slot = (slot + 1) & mask)
         {
-          currentVertex.newIndex = indexHashMap[insertPos].newIndex;
-          break;
+          IndexTriplet *found;
+
+          if (table[slot] == -1)
+            {
+              uniqueVertices[numNewVertices] = currentVertex;
+              table[slot] = numNewVertices++;
+              break;
+            }
+          found = &uniqueVertices[table[slot]];
+          if (found->positionIndex == currentVertex.positionIndex
+              && found->normalIndex == currentVertex.normalIndex
+              && found->texCoordIndex == currentVertex.texCoordIndex)
+            break;
         }
-      else
-        insertPos++;
-    }
-
 
-      model->indexArray[index] = currentVertex.newIndex;
+      model->indexArray[index] = table[slot];
     }
 
+  free(table);
+
   if (mesh->vertices)
     model->vertexArray = malloc(sizeof(GLfloat) * 3 * numNewVertices);
   if (mesh->vertexNormals)
@@ -767,31 +882,30 @@ static Model* generateModel(Mesh* mesh)
 
   model->numVertices = numNewVertices;
 
-  for (index = 0; index < indexHashMapSize; index++)
-    {
-      if (indexHashMap[index].newIndex != -1)
+  for (index = 0; index < numNewVertices; index++)
     {
+      IndexTriplet *v = &uniqueVertices[index];
+
       if (mesh->vertices)
-        memcpy(&model->vertexArray[3 * indexHashMap[index].newIndex],
-           &mesh->vertices[3 * indexHashMap[index].positionIndex],
-           3 * sizeof(GLfloat));
+        memcpy(&model->vertexArray[3 * index],
+               &mesh->vertices[3 * v->positionIndex],
+               3 * sizeof(GLfloat));
 
       if (mesh->vertexNormals)
-        memcpy(&model->normalArray[3 * indexHashMap[index].newIndex],
-           &mesh->vertexNormals[3 * indexHashMap[index].normalIndex],
-           3 * sizeof(GLfloat));
+        memcpy(&model->normalArray[3 * index],
+               &mesh->vertexNormals[3 * v->normalIndex],
+               3 * sizeof(GLfloat));
 
       if (mesh->textureCoords)
         {
-          model->texCoordArray[2 * indexHashMap[index].newIndex + 0]
-        = mesh->textureCoords[2 * indexHashMap[index].texCoordIndex + 0];
-          model->texCoordArray[2 * indexHashMap[index].newIndex + 1]
-        = 1 - mesh->textureCoords[2 * indexHashMap[index].texCoordIndex + 1];
+          model->texCoordArray[2 * index + 0]
+            = mesh->textureCoords[2 * v->texCoordIndex + 0];
+          model->texCoordArray[2 * index + 1]
+            = 1 - mesh->textureCoords[2 * v->texCoordIndex + 1];
         }
     }
-    }
 
-  free(indexHashMap);
+  free(uniqueVertices);
 
   return model;
 }
@@ -811,16 +925,369 @@ Model* LoadModel(char* name)
 
   model = generateModel(mesh);
 
+  DisposeMesh(mesh);
+
   return model;
 }
 
 
+// Binary model cache
+//
+// A header followed by the vertex, normal, texture coordinate and index
+// arrays and the meshlet ranges and bounds, each starting on a 16 byte
+// boundary. The cache is valid for a
+// source file of the same size and modification time, processed by the
+// same MODEL_CACHE_VERSION with the same options.
+
+typedef struct
+{
+  char magic[4];
+  uint32_t version;
+  uint32_t options;
+  uint32_t arrays; // Bit 0: normals, bit 1: texture coordinates
+  int64_t sourceSize;
+  int64_t sourceMtime;
+  int64_t sourceMtimeNsec;
+  int32_t numVertices;
+  int32_t numIndices;
+  int32_t numLods;
+  ModelLod lods[kMaxLods];
+  GLfloat center[3];
+  GLfloat radius;
+  int32_t numMeshlets;
+} ModelCacheHeader;
+
+#define kCacheAlign 16
+#define CacheAlign(n) (((n) + kCacheAlign - 1) & ~(size_t)(kCacheAlign - 1))
+
+static void FillCacheHeader(ModelCacheHeader *h, struct stat *source, unsigned int options)
+{
+  memset(h, 0, sizeof(ModelCacheHeader));
+  memcpy(h->magic, "CPGM", 4);
+  h->version = MODEL_CACHE_VERSION;
+  h->options = options;
+  h->sourceSize = source->st_size;
+  h->sourceMtime = source->st_mtim.tv_sec;
+  h->sourceMtimeNsec = source->st_mtim.tv_nsec;
+}
+
+static size_t CacheArraySizes(const ModelCacheHeader *h, size_t sizes[6])
+{
+  sizes[0] = sizeof(GLfloat) * 3 * h->numVertices;
+  sizes[1] = (h->arrays & 1) ? sizeof(GLfloat) * 3 * h->numVertices : 0;
+  sizes[2] = (h->arrays & 2) ? sizeof(GLfloat) * 2 * h->numVertices : 0;
+  sizes[3] = sizeof(GLuint) * h->numIndices;
+  sizes[4] = sizeof(GLuint) * 2 * h->numMeshlets;
+  sizes[5] = sizeof(GLfloat) * 8 * MeshletStride(h->numMeshlets);
+  return CacheAlign(sizeof(ModelCacheHeader)) + CacheAlign(sizes[0])
+    + CacheAlign(sizes[1]) + CacheAlign(sizes[2]) + CacheAlign(sizes[3])
+    + CacheAlign(sizes[4]) + CacheAlign(sizes[5]);
+}
+
+// Map a valid cache file, or return NULL
+static Model* MapModelCache(char* cacheName, struct stat *source, unsigned int options)
+{
+  ModelCacheHeader expected;
+  const ModelCacheHeader *h;
+  struct stat st;
+  size_t sizes[6];
+  char *data, *p;
+  Model *m;
+  int fd;
+
+  fd = open(cacheName, O_RDONLY);
+  if (fd < 0)
+    return NULL;
+  if (fstat(fd, &st) != 0 || st.st_size < (off_t)sizeof(ModelCacheHeader))
+    {
+      close(fd);
+      return NULL;
+    }
+  data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED)
+    return NULL;
+
+  h = (const ModelCacheHeader *)data;
+  FillCacheHeader(&expected, source, options);
+  if (memcmp(h->magic, expected.magic, 4) != 0
+      || h->version != expected.version
+      || h->options != expected.options
+      || h->sourceSize != expected.sourceSize
+      || h->sourceMtime != expected.sourceMtime
+      || h->sourceMtimeNsec != expected.sourceMtimeNsec
+      || h->numVertices < 0 || h->numIndices < 0
+      || h->numLods < 0 || h->numLods > kMaxLods || h->numMeshlets < 0
+      || CacheArraySizes(h, sizes) != (size_t)st.st_size)
+    {
+      munmap(data, st.st_size);
+      return NULL;
+    }
+
+  m = malloc(sizeof(Model));
+  memset(m, 0, sizeof(Model));
+  m->numVertices = h->numVertices;
+  m->numIndices = h->numIndices;
+  m->numLods = h->numLods;
+  memcpy(m->lods, h->lods, sizeof(m->lods));
+  memcpy(m->center, h->center, sizeof(m->center));
+  m->radius = h->radius;
+  m->mapping = data;
+  m->mappingSize = st.st_size;
+
+  p = data + CacheAlign(sizeof(ModelCacheHeader));
+  m->vertexArray = (GLfloat *)p;
+  p += CacheAlign(sizes[0]);
+  if (sizes[1])
+    m->normalArray = (GLfloat *)p;
+  p += CacheAlign(sizes[1]);
+  if (sizes[2])
+    m->texCoordArray = (GLfloat *)p;
+  p += CacheAlign(sizes[2]);
+  m->indexArray = (GLuint *)p;
+  p += CacheAlign(sizes[3]);
+
+  // Meshlets are read every frame, so they stay resident when the rest
+  // of the mapping is released
+  if (h->numMeshlets > 0)
+    {
+      m->numMeshlets = h->numMeshlets;
+      m->meshletRanges = malloc(sizes[4]);
+      memcpy(m->meshletRanges, p, sizes[4]);
+      p += CacheAlign(sizes[4]);
+      m->meshletBounds = malloc(sizes[5]);
+      memcpy(m->meshletBounds, p, sizes[5]);
+    }
+
+  return m;
+}
+
+static void WriteModelCache(Model *m, char* cacheName, struct stat *source, unsigned int options)
+{
+  static const char zeros[kCacheAlign];
+  ModelCacheHeader h;
+  const void *arrays[6];
+  size_t sizes[6];
+  char *tempName;
+  FILE *f;
+  int i, ok, fd;
+
+  FillCacheHeader(&h, source, options);
+  h.arrays = (m->normalArray ? 1 : 0) | (m->texCoordArray ? 2 : 0);
+  h.numVertices = m->numVertices;
+  h.numIndices = m->numIndices;
+  h.numLods = m->numLods;
+  memcpy(h.lods, m->lods, sizeof(h.lods));
+  memcpy(h.center, m->center, sizeof(h.center));
+  h.radius = m->radius;
+  h.numMeshlets = m->numMeshlets;
+  CacheArraySizes(&h, sizes);
+  arrays[0] = m->vertexArray;
+  arrays[1] = m->normalArray;
+  arrays[2] = m->texCoordArray;
+  arrays[3] = m->indexArray;
+  arrays[4] = m->meshletRanges;
+  arrays[5] = m->meshletBounds;
+
+  // Write to a temporary file and rename, so readers never see half a
+  // cache. The name is unique, as threads of one process may load the
+  // same model at once.
+  tempName = malloc(strlen(cacheName) + 8);
+  sprintf(tempName, "%s.XXXXXX", cacheName);
+  fd = mkstemp(tempName);
+  if (fd < 0)
+    {
+      free(tempName);
+      return;
+    }
+  fchmod(fd, 0644);
+  f = fdopen(fd, "wb");
+  if (f == NULL)
+    {
+      close(fd);
+      remove(tempName);
+      free(tempName);
+      return;
+    }
+  ok = fwrite(&h, sizeof(h), 1, f) == 1
+    && fwrite(zeros, CacheAlign(sizeof(h)) - sizeof(h), 1, f) <= 1;
+  for (i = 0; i < 6 && ok; i++)
+    if (sizes[i] > 0)
+      ok = fwrite(arrays[i], sizes[i], 1, f) == 1
+        && fwrite(zeros, CacheAlign(sizes[i]) - sizes[i], 1, f) <= 1;
+  ok = (fclose(f) == 0) && ok;
+  if (!ok || rename(tempName, cacheName) != 0)
+    {
+      fprintf(stderr, "Unable to write model cache %s\n", cacheName);
+      remove(tempName);
+    }
+  free(tempName);
+}
+
+Model* LoadModelCached(char* name, char* cacheName, unsigned int options)
+{
+  struct stat source;
+  Model *m;
+
+  if (stat(name, &source) != 0)
+    {
+      fprintf(stderr, "Unable to open file\n");
+      fflush(stderr);
+      return NULL;
+    }
+  m = MapModelCache(cacheName, &source, options);
+  if (m != NULL)
+    return m;
+
+  m = LoadModel(name);
+  if (m != NULL)
+    {
+      OptimizeModel(m, options);
+      WriteModelCache(m, cacheName, &source, options);
+    }
+  return m;
+}
+
+void DrawModelMeshlets(Model *m, const GLfloat *modelview, const GLfloat *projection, int cones)
+{
+    GLenum type = m->indexType ? m->indexType : GL_UNSIGNED_INT;
+    size_t indexSize = type == GL_UNSIGNED_SHORT ? sizeof(GLushort) : sizeof(GLuint);
+    char *visible;
+    GLsizei *counts;
+    const GLvoid **offsets;
+    int i, draws = 0, triangles = 0;
+    GLboolean culling;
+
+    if (m->numMeshlets == 0)
+    {
+        DrawModel(m);
+        return;
+    }
+
+    visible = malloc(m->numMeshlets);
+    counts = malloc(sizeof(GLsizei) * m->numMeshlets);
+    offsets = malloc(sizeof(GLvoid *) * m->numMeshlets);
+    CullMeshlets(m, modelview, projection, cones, visible);
+
+    // Meshlets are consecutive in the index array, so runs of visible
+    // ones are drawn as one range
+    for (i = 0; i < m->numMeshlets; i++)
+    {
+        if (!visible[i])
+        {
+            drawStats.culled++;
+            continue;
+        }
+        if (i > 0 && visible[i-1])
+            counts[draws-1] += m->meshletRanges[2*i + 1];
+        else
+        {
+            offsets[draws] = (const GLvoid *)(m->meshletRanges[2*i] * indexSize);
+            counts[draws++] = m->meshletRanges[2*i + 1];
+        }
+        triangles += m->meshletRanges[2*i + 1] / 3;
+    }
+
+    glBindVertexArray(m->vao);
+    culling = glIsEnabled(GL_CULL_FACE);
+    if (cones && !culling)
+        glEnable(GL_CULL_FACE);
+    if (draws > 0)
+        glMultiDrawElements(GL_TRIANGLES, counts, type, offsets, draws);
+    if (cones && !culling)
+        glDisable(GL_CULL_FACE);
+
+    drawStats.stateChanges++;
+    drawStats.drawCalls++;
+    drawStats.triangles += triangles;
+
+    free(visible);
+    free(counts);
+    free(offsets);
+}
+
+void ReleaseModelArrays(Model *m)
+{
+  if (m->mapping != NULL)
+    munmap(m->mapping, m->mappingSize);
+  else
+    {
+      free(m->vertexArray);
+      free(m->normalArray);
+      free(m->texCoordArray);
+      free(m->colorArray);
+      free(m->indexArray);
+    }
+  m->vertexArray = m->normalArray = m->texCoordArray = m->colorArray = NULL;
+  m->indexArray = NULL;
+  m->mapping = NULL;
+  m->mappingSize = 0;
+}
+
+int RefetchModelArrays(Model *m, char* name, char* cacheName, unsigned int options)
+{
+  Model *fetched;
+
+  if (cacheName != NULL)
+    fetched = LoadModelCached(name, cacheName, options);
+  else
+    {
+      fetched = LoadModel(name);
+      if (fetched != NULL)
+        OptimizeModel(fetched, options);
+    }
+  if (fetched == NULL)
+    return 0;
+
+  if (fetched->numVertices != m->numVertices || fetched->numIndices != m->numIndices)
+    {
+      ReleaseModelArrays(fetched);
+      free(fetched->meshletRanges);
+      free(fetched->meshletBounds);
+      free(fetched);
+      return 0;
+    }
+  ReleaseModelArrays(m);
+  m->vertexArray = fetched->vertexArray;
+  m->normalArray = fetched->normalArray;
+  m->texCoordArray = fetched->texCoordArray;
+  m->indexArray = fetched->indexArray;
+  m->mapping = fetched->mapping;
+  m->mappingSize = fetched->mappingSize;
+  free(fetched->meshletRanges);
+  free(fetched->meshletBounds);
+  free(fetched);
+  return 1;
+}
+
+
 // NEW for lab 2 2012
 
 void DrawModel(Model *m)
 {
+    DrawModelLod(m, 0);
+}
+
+void DrawModelLod(Model *m, int level)
+{
+    GLenum type = m->indexType ? m->indexType : GL_UNSIGNED_INT;
+    size_t indexSize = type == GL_UNSIGNED_SHORT ? sizeof(GLushort) : sizeof(GLuint);
+    int first = 0, count = m->numIndices;
+
+    if (m->numLods > 0)
+    {
+        if (level >= m->numLods) level = m->numLods - 1;
+        if (level < 0) level = 0;
+        first = m->lods[level].first;
+        count = m->lods[level].count;
+    }
+
     glBindVertexArray(m->vao);  // Select VAO
-    glDrawElements(GL_TRIANGLES, m->numIndices, GL_UNSIGNED_INT, 0L);
+    glDrawElements(GL_TRIANGLES, count, type, (GLvoid *)(first * indexSize));
+
+    drawStats.stateChanges++;
+    drawStats.drawCalls++;
+    drawStats.triangles += count / 3;
 }
 
 Model* LoadModelPlus(char* name,
@@ -832,7 +1299,39 @@ Model* LoadModelPlus(char* name,
     Model *m;
 
     m = LoadModel(name);
+    if (m != NULL)
+        UploadModel(m, program, vertexVariableName, normalVariableName, texCoordVariableName);
+    return m;
+}
 
+// 16-bit indices when every vertex can be addressed
+static void UploadIndices(Model *m)
+{
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, m->ib);
+    if (m->numVertices < 65536)
+    {
+        GLushort *shortIndices = malloc(sizeof(GLushort) * (m->numIndices > 0 ? m->numIndices : 1));
+        int i;
+
+        for (i = 0; i < m->numIndices; i++)
+            shortIndices[i] = m->indexArray[i];
+        glBufferData(GL_ELEMENT_ARRAY_BUFFER, m->numIndices*sizeof(GLushort), shortIndices, GL_STATIC_DRAW);
+        free(shortIndices);
+        m->indexType = GL_UNSIGNED_SHORT;
+    }
+    else
+    {
+        glBufferData(GL_ELEMENT_ARRAY_BUFFER, m->numIndices*sizeof(GLuint), m->indexArray, GL_STATIC_DRAW);
+        m->indexType = GL_UNSIGNED_INT;
+    }
+}
+
+void UploadModel(Model *m,
+            GLuint program,
+            char* vertexVariableName,
+            char* normalVariableName,
+            char* texCoordVariableName)
+{
     glGenVertexArrays(1, &m->vao);
     glGenBuffers(1, &m->vb);
     glGenBuffers(1, &m->ib);
@@ -863,8 +1362,222 @@ Model* LoadModelPlus(char* name,
         glEnableVertexAttribArray(glGetAttribLocation(program, texCoordVariableName));
     }
 
-    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, m->ib);
-    glBufferData(GL_ELEMENT_ARRAY_BUFFER, m->numIndices*sizeof(GLuint), m->indexArray, GL_STATIC_DRAW);
+    m->positionOffset[0] = m->positionOffset[1] = m->positionOffset[2] = 0;
+    m->positionScale[0] = m->positionScale[1] = m->positionScale[2] = 1;
+    UploadIndices(m);
+}
 
-    return m;
+// Compact encodings for UploadModelInterleaved
+
+static GLushort FloatToHalf(float f)
+{
+    union { float f; uint32_t u; } bits;
+    uint32_t sign, exponent, mantissa;
+
+    bits.f = f;
+    sign = (bits.u >> 16) & 0x8000;
+    exponent = (bits.u >> 23) & 0xff;
+    mantissa = bits.u & 0x7fffff;
+
+    if (exponent == 0xff) // Inf and NaN
+        return sign | 0x7c00 | (mantissa ? 0x200 : 0);
+    if (exponent > 142) // Overflow to Inf
+        return sign | 0x7c00;
+    if (exponent < 113) // Denormal, or zero
+    {
+        uint32_t shift, half, rest;
+
+        if (exponent < 102)
+            return sign;
+        mantissa |= 0x800000;
+        shift = 126 - exponent;
+        half = mantissa >> shift;
+        rest = mantissa & ((1u << shift) - 1);
+        if (rest > (1u << (shift - 1)) || (rest == (1u << (shift - 1)) && (half & 1)))
+            half++;
+        return sign | half;
+    }
+    // Normal; rounding may carry into the exponent, and up to Inf
+    exponent = ((exponent - 112) << 10) | (mantissa >> 13);
+    if ((mantissa & 0x1fff) > 0x1000 || ((mantissa & 0x1fff) == 0x1000 && (exponent & 1)))
+        exponent++;
+    return sign | exponent;
+}
+
+static GLuint PackNormal(const GLfloat *n)
+{
+    GLuint packed = 0;
+    int k;
+
+    for (k = 0; k < 3; k++)
+    {
+        float c = n[k] < -1 ? -1 : (n[k] > 1 ? 1 : n[k]);
+        packed |= ((GLuint)(GLint)lrintf(c * 511) & 0x3ff) << (10 * k);
+    }
+    return packed;
+}
+
+static GLushort Unorm16(float f)
+{
+    return (GLushort)lrintf((f < 0 ? 0 : (f > 1 ? 1 : f)) * 65535);
+}
+
+typedef struct
+{
+    const GLfloat *source;
+    int array; // kVertexPosition, kVertexNormal or kVertexTexCoord
+    GLint location;
+    int components; // In the Model array
+    int size; // Components given to GL
+    GLenum type;
+    GLboolean normalized;
+    int offset; // In bytes
+} AttribLayout;
+
+// Pick the GL type of an attribute, and its size in bytes padded to 4
+static int LayoutAttrib(Model *m, AttribLayout *l, int encoding)
+{
+    int v;
+
+    l->size = l->components;
+    l->type = GL_FLOAT;
+    l->normalized = GL_FALSE;
+    if (encoding == kVertexCompact)
+    {
+        switch (l->array)
+        {
+            case kVertexPosition:
+                l->type = GL_UNSIGNED_SHORT;
+                l->normalized = GL_TRUE;
+                return 8;
+            case kVertexNormal:
+                l->size = 4;
+                l->type = GL_INT_2_10_10_10_REV;
+                l->normalized = GL_TRUE;
+                return 4;
+            case kVertexTexCoord:
+                // Normalized shorts when the coordinates allow, else halves
+                l->type = GL_UNSIGNED_SHORT;
+                l->normalized = GL_TRUE;
+                for (v = 0; v < m->numVertices * l->components; v++)
+                    if (l->source[v] < 0 || l->source[v] > 1)
+                        l->type = GL_HALF_FLOAT;
+                return (l->components * 2 + 3) & ~3;
+        }
+    }
+    return l->components * sizeof(GLfloat);
+}
+
+static void EncodeAttrib(Model *m, const AttribLayout *l, const GLfloat *value, char *out)
+{
+    int k;
+
+    switch (l->type)
+    {
+        case GL_INT_2_10_10_10_REV:
+            *(GLuint *)out = PackNormal(value);
+            break;
+        case GL_HALF_FLOAT:
+            for (k = 0; k < l->components; k++)
+                ((GLushort *)out)[k] = FloatToHalf(value[k]);
+            break;
+        case GL_UNSIGNED_SHORT:
+            if (l->array == kVertexPosition)
+            {
+                for (k = 0; k < 3; k++)
+                    ((GLushort *)out)[k] = Unorm16((value[k] - m->positionOffset[k]) / m->positionScale[k]);
+                ((GLushort *)out)[3] = 0;
+            }
+            else
+                for (k = 0; k < l->components; k++)
+                    ((GLushort *)out)[k] = Unorm16(value[k]);
+            break;
+        default:
+            memcpy(out, value, l->components * sizeof(GLfloat));
+    }
+}
+
+// Set the position dequantization to the bounds of the mesh
+static void MeasurePositions(Model *m)
+{
+    int v, k;
+
+    for (k = 0; k < 3; k++)
+    {
+        GLfloat lo = m->numVertices > 0 ? m->vertexArray[k] : 0;
+        GLfloat hi = lo;
+
+        for (v = 1; v < m->numVertices; v++)
+        {
+            GLfloat c = m->vertexArray[3*v + k];
+            if (c < lo) lo = c;
+            if (c > hi) hi = c;
+        }
+        m->positionOffset[k] = lo;
+        m->positionScale[k] = hi > lo ? hi - lo : 1;
+    }
+}
+
+void UploadModelInterleaved(Model *m, GLuint program, const VertexFormat *format)
+{
+    AttribLayout layout[kMaxVertexAttribs];
+    int used = 0;
+    int stride = 0; // In bytes
+    char *interleaved;
+    int i, k, v;
+
+    for (k = 0; k < 3; k++)
+    {
+        m->positionOffset[k] = 0;
+        m->positionScale[k] = 1;
+    }
+
+    for (i = 0; i < format->numAttribs && i < kMaxVertexAttribs; i++)
+    {
+        const VertexAttrib *a = &format->attribs[i];
+        AttribLayout *l = &layout[used];
+
+        l->source = NULL;
+        l->array = a->array;
+        l->components = 3;
+        switch (a->array)
+        {
+            case kVertexPosition: l->source = m->vertexArray; break;
+            case kVertexNormal: l->source = m->normalArray; break;
+            case kVertexTexCoord: l->source = m->texCoordArray; l->components = 2; break;
+        }
+        if (l->source == NULL || a->name == NULL)
+            continue;
+        l->location = glGetAttribLocation(program, a->name);
+        if (l->location < 0)
+            continue;
+        if (a->array == kVertexPosition && a->encoding == kVertexCompact)
+            MeasurePositions(m);
+        l->offset = stride;
+        stride += LayoutAttrib(m, l, a->encoding);
+        used++;
+    }
+
+    interleaved = calloc(m->numVertices > 0 ? m->numVertices : 1, stride > 0 ? stride : 1);
+    for (v = 0; v < m->numVertices; v++)
+        for (i = 0; i < used; i++)
+            EncodeAttrib(m, &layout[i], &layout[i].source[v * layout[i].components],
+                interleaved + v * stride + layout[i].offset);
+
+    glGenVertexArrays(1, &m->vao);
+    glGenBuffers(1, &m->vb);
+    glGenBuffers(1, &m->ib);
+    glBindVertexArray(m->vao);
+
+    glBindBuffer(GL_ARRAY_BUFFER, m->vb);
+    glBufferData(GL_ARRAY_BUFFER, m->numVertices*stride, interleaved, GL_STATIC_DRAW);
+    for (i = 0; i < used; i++)
+    {
+        glVertexAttribPointer(layout[i].location, layout[i].size, layout[i].type, layout[i].normalized,
+            stride, (GLvoid *)(size_t)layout[i].offset);
+        glEnableVertexAttribArray(layout[i].location);
+    }
+    free(interleaved);
+
+    UploadIndices(m);
 }
@@ -0,0 +1,1334 @@
+// Mesh optimization for the post-transform vertex cache
+//
+// Triangle order after Tom Forsyth, "Linear-Speed Vertex Cache
+// Optimisation", 2006. Overdraw ordering after Sander, Nehab and Barczak,
+// "Fast Triangle Reordering for Vertex Locality and Reduced Overdraw", 2007.
+
+#include "meshopt.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <stdint.h>
+#include <pthread.h>
+#ifdef __SSE__
+#include <xmmintrin.h>
+#include <emmintrin.h>
+#endif
+
+#define kCacheSize 32 // Modelled LRU cache for scoring
+#define kMaxValence 32 // Valence scores are tabulated up to here
+#define kReportCacheSize 16 // FIFO used for the ACMR report
+
+static float cacheScore[kCacheSize];
+static float valenceScore[kMaxValence];
+static pthread_once_t scoresOnce = PTHREAD_ONCE_INIT;
+
+static void InitScores(void)
+{
+  int i;
+
+  for (i = 0; i < kCacheSize; i++)
+    {
+      if (i < 3)
+        cacheScore[i] = 0.75f; // The last triangle, fixed to discourage strips
+      else
+        cacheScore[i] = powf(1.0f - (float)(i - 3) / (kCacheSize - 3), 1.5f);
+    }
+  for (i = 0; i < kMaxValence; i++)
+    valenceScore[i] = i > 0 ? 2.0f / sqrtf(i) : 0;
+}
+
+static float VertexScore(int cachePosition, int activeTris)
+{
+  float score;
+
+  if (activeTris == 0)
+    return -1.0f; // No triangles left, never wanted
+  score = cachePosition >= 0 ? cacheScore[cachePosition] : 0;
+  return score + valenceScore[activeTris < kMaxValence ? activeTris : kMaxValence - 1];
+}
+
+static void OptimizeVertexCache(GLuint *indices, int numIndices, int numVertices)
+{
+  int numTris = numIndices / 3;
+  int *activeTris = calloc(numVertices + 1, sizeof(int));
+  int *offsets = calloc(numVertices + 1, sizeof(int));
+  int *adjacency = malloc(sizeof(int) * (numIndices > 0 ? numIndices : 1));
+  int *cachePosition = malloc(sizeof(int) * (numVertices > 0 ? numVertices : 1));
+  float *vertexScore = malloc(sizeof(float) * (numVertices > 0 ? numVertices : 1));
+  float *triScore = malloc(sizeof(float) * (numTris > 0 ? numTris : 1));
+  char *emitted = calloc(numTris + 1, 1);
+  GLuint *out = malloc(sizeof(GLuint) * (numIndices > 0 ? numIndices : 1));
+  int cache[kCacheSize + 3];
+  int cacheCount = 0;
+  int nextScan = 0;
+  int best = -1;
+  float bestScore = -1;
+  int i, t, v, k;
+
+  // Triangle lists per vertex
+  for (i = 0; i < numIndices; i++)
+    activeTris[indices[i]]++;
+  for (v = 0; v < numVertices; v++)
+    offsets[v + 1] = offsets[v] + activeTris[v];
+  memset(activeTris, 0, sizeof(int) * numVertices);
+  for (i = 0; i < numIndices; i++)
+    {
+      v = indices[i];
+      adjacency[offsets[v] + activeTris[v]++] = i / 3;
+    }
+
+  for (v = 0; v < numVertices; v++)
+    {
+      cachePosition[v] = -1;
+      vertexScore[v] = VertexScore(-1, activeTris[v]);
+    }
+  for (t = 0; t < numTris; t++)
+    {
+      triScore[t] = vertexScore[indices[3*t]] + vertexScore[indices[3*t+1]] + vertexScore[indices[3*t+2]];
+      if (triScore[t] > bestScore)
+        {
+          bestScore = triScore[t];
+          best = t;
+        }
+    }
+
+  for (i = 0; i < numTris; i++)
+    {
+      int newCache[kCacheSize + 3];
+      int newCount = 0;
+
+      if (best < 0)
+        {
+          // Nothing in the cache has triangles left, continue anywhere
+          while (emitted[nextScan])
+            nextScan++;
+          best = nextScan;
+        }
+      emitted[best] = 1;
+      for (k = 0; k < 3; k++)
+        {
+          int j, *tris;
+
+          v = indices[3*best + k];
+          out[3*i + k] = v;
+          newCache[newCount++] = v;
+
+          // Remove the triangle from the vertex' list of active triangles
+          tris = &adjacency[offsets[v]];
+          for (j = 0; j < activeTris[v]; j++)
+            if (tris[j] == best)
+              {
+                tris[j] = tris[--activeTris[v]];
+                break;
+              }
+        }
+
+      // The emitted vertices go first in the cache, the rest are pushed back
+      for (k = 0; k < cacheCount; k++)
+        {
+          v = cache[k];
+          if (v != newCache[0] && v != newCache[1] && v != newCache[2])
+            newCache[newCount++] = v;
+        }
+
+      cacheCount = newCount < kCacheSize ? newCount : kCacheSize;
+      for (k = 0; k < newCount; k++)
+        {
+          v = newCache[k];
+          cachePosition[v] = k < kCacheSize ? k : -1;
+          vertexScore[v] = VertexScore(cachePosition[v], activeTris[v]);
+          if (k < kCacheSize)
+            cache[k] = v;
+        }
+
+      // Rescore the triangles touched by the cache and pick the best one
+      best = -1;
+      bestScore = -1;
+      for (k = 0; k < newCount; k++)
+        {
+          int j;
+
+          v = newCache[k];
+          for (j = 0; j < activeTris[v]; j++)
+            {
+              t = adjacency[offsets[v] + j];
+              triScore[t] = vertexScore[indices[3*t]] + vertexScore[indices[3*t+1]] + vertexScore[indices[3*t+2]];
+              if (triScore[t] > bestScore)
+                {
+                  bestScore = triScore[t];
+                  best = t;
+                }
+            }
+        }
+    }
+
+  memcpy(indices, out, sizeof(GLuint) * numTris * 3);
+
+  free(activeTris);
+  free(offsets);
+  free(adjacency);
+  free(cachePosition);
+  free(vertexScore);
+  free(triScore);
+  free(emitted);
+  free(out);
+}
+
+
+// Overdraw: split the cache optimized order into clusters where the cache
+// starts over, and draw the clusters facing away from the centre first.
+
+typedef struct
+{
+  int first; // First triangle
+  int count;
+  float sortKey;
+} Cluster;
+
+static int CompareClusters(const void *a, const void *b)
+{
+  const Cluster *ca = a;
+  const Cluster *cb = b;
+
+  if (ca->sortKey != cb->sortKey)
+    return ca->sortKey > cb->sortKey ? -1 : 1;
+  return ca->first - cb->first;
+}
+
+static void OptimizeOverdraw(GLuint *indices, int numIndices, const GLfloat *vertices, int numVertices)
+{
+  int numTris = numIndices / 3;
+  int *insertedAt = malloc(sizeof(int) * (numVertices > 0 ? numVertices : 1));
+  Cluster *clusters = malloc(sizeof(Cluster) * (numTris > 0 ? numTris : 1));
+  GLuint *out;
+  int numClusters = 0;
+  int misses = 0;
+  float center[3] = {0, 0, 0};
+  int c, t, v, k;
+
+  if (vertices == NULL || numTris == 0)
+    {
+      free(insertedAt);
+      free(clusters);
+      return;
+    }
+
+  for (v = 0; v < numVertices; v++)
+    {
+      insertedAt[v] = -kReportCacheSize - 1;
+      for (k = 0; k < 3; k++)
+        center[k] += vertices[3*v + k] / numVertices;
+    }
+
+  for (t = 0; t < numTris; t++)
+    {
+      int triMisses = 0;
+
+      for (k = 0; k < 3; k++)
+        {
+          v = indices[3*t + k];
+          if (misses - insertedAt[v] > kReportCacheSize)
+            {
+              insertedAt[v] = misses++;
+              triMisses++;
+            }
+        }
+      if (t == 0 || triMisses == 3)
+        {
+          clusters[numClusters].first = t;
+          clusters[numClusters].count = 0;
+          numClusters++;
+        }
+      clusters[numClusters - 1].count++;
+    }
+
+  // Sort key: how much the cluster faces away from the centre of the mesh
+  for (c = 0; c < numClusters; c++)
+    {
+      float centroid[3] = {0, 0, 0};
+      float normal[3] = {0, 0, 0};
+      float area = 0, length, dot = 0;
+
+      for (t = clusters[c].first; t < clusters[c].first + clusters[c].count; t++)
+        {
+          const GLfloat *p0 = &vertices[3 * indices[3*t]];
+          const GLfloat *p1 = &vertices[3 * indices[3*t+1]];
+          const GLfloat *p2 = &vertices[3 * indices[3*t+2]];
+          float e1[3], e2[3], n[3], a;
+
+          for (k = 0; k < 3; k++)
+            {
+              e1[k] = p1[k] - p0[k];
+              e2[k] = p2[k] - p0[k];
+            }
+          n[0] = e1[1]*e2[2] - e1[2]*e2[1];
+          n[1] = e1[2]*e2[0] - e1[0]*e2[2];
+          n[2] = e1[0]*e2[1] - e1[1]*e2[0];
+          a = sqrtf(n[0]*n[0] + n[1]*n[1] + n[2]*n[2]);
+          for (k = 0; k < 3; k++)
+            {
+              centroid[k] += a * (p0[k] + p1[k] + p2[k]) / 3;
+              normal[k] += n[k];
+            }
+          area += a;
+        }
+      length = sqrtf(normal[0]*normal[0] + normal[1]*normal[1] + normal[2]*normal[2]);
+      for (k = 0; k < 3 && area > 0 && length > 0; k++)
+        dot += (centroid[k] / area - center[k]) * normal[k] / length;
+      clusters[c].sortKey = dot;
+    }
+
+  qsort(clusters, numClusters, sizeof(Cluster), CompareClusters);
+
+  out = malloc(sizeof(GLuint) * numIndices);
+  for (c = 0, t = 0; c < numClusters; c++)
+    {
+      memcpy(&out[3*t], &indices[3 * clusters[c].first], sizeof(GLuint) * 3 * clusters[c].count);
+      t += clusters[c].count;
+    }
+  memcpy(indices, out, sizeof(GLuint) * numIndices);
+
+  free(out);
+  free(insertedAt);
+  free(clusters);
+}
+
+
+// Renumber the vertices in order of first use, for vertex fetch locality
+
+static void PermuteArray(GLfloat **array, int components, const int *remap, int numVertices)
+{
+  GLfloat *permuted;
+  int v;
+
+  if (*array == NULL)
+    return;
+  permuted = malloc(sizeof(GLfloat) * components * (numVertices > 0 ? numVertices : 1));
+  for (v = 0; v < numVertices; v++)
+    memcpy(&permuted[components * remap[v]], &(*array)[components * v], sizeof(GLfloat) * components);
+  free(*array);
+  *array = permuted;
+}
+
+static void OptimizeVertexFetch(Model *m)
+{
+  int *remap = malloc(sizeof(int) * (m->numVertices > 0 ? m->numVertices : 1));
+  int next = 0;
+  int i, v;
+
+  for (v = 0; v < m->numVertices; v++)
+    remap[v] = -1;
+  for (i = 0; i < m->numIndices; i++)
+    {
+      v = m->indexArray[i];
+      if (remap[v] < 0)
+        remap[v] = next++;
+      m->indexArray[i] = remap[v];
+    }
+  // Unreferenced vertices go last
+  for (v = 0; v < m->numVertices; v++)
+    if (remap[v] < 0)
+      remap[v] = next++;
+
+  PermuteArray(&m->vertexArray, 3, remap, m->numVertices);
+  PermuteArray(&m->normalArray, 3, remap, m->numVertices);
+  PermuteArray(&m->texCoordArray, 2, remap, m->numVertices);
+  free(remap);
+}
+
+
+// Levels of detail by quadric error edge collapse, after Garland and
+// Heckbert, "Surface Simplification Using Quadric Error Metrics", 1997.
+// Vertices are only collapsed onto other vertices, so that every level
+// indexes the same vertex arrays. Vertices sharing a position are
+// collapsed together; those on open borders or texture/normal seams only
+// along their border or seam.
+
+#define kLodRatio 0.5f // Triangles kept per level
+#define kMinLodTriangles 32
+#define kBorderWeight 10.0 // Of the planes that hold borders and seams in place
+
+#define kInterior 0
+#define kBorder 1
+#define kSeam 2
+#define kLocked 3
+
+typedef struct
+{
+  double a[10]; // xx xy xz xd yy yz yd zz zd dd
+  double w;
+} Quadric;
+
+static void QuadricAddPlane(Quadric *q, const double n[3], double d, double w)
+{
+  q->a[0] += w * n[0] * n[0];
+  q->a[1] += w * n[0] * n[1];
+  q->a[2] += w * n[0] * n[2];
+  q->a[3] += w * n[0] * d;
+  q->a[4] += w * n[1] * n[1];
+  q->a[5] += w * n[1] * n[2];
+  q->a[6] += w * n[1] * d;
+  q->a[7] += w * n[2] * n[2];
+  q->a[8] += w * n[2] * d;
+  q->a[9] += w * d * d;
+  q->w += w;
+}
+
+// Mean squared distance to the planes of the quadric
+static double QuadricError(const Quadric *q, const GLfloat *p)
+{
+  double x = p[0], y = p[1], z = p[2];
+  double e = q->a[0]*x*x + 2*q->a[1]*x*y + 2*q->a[2]*x*z + 2*q->a[3]*x
+    + q->a[4]*y*y + 2*q->a[5]*y*z + 2*q->a[6]*y
+    + q->a[7]*z*z + 2*q->a[8]*z
+    + q->a[9];
+
+  return q->w > 0 && e > 0 ? e / q->w : 0;
+}
+
+// Set of 64 bit keys, for edges as vertex pairs
+typedef struct
+{
+  uint64_t *keys;
+  uint32_t mask;
+} EdgeSet;
+
+#define kNoEdge (~(uint64_t)0)
+#define EdgeKey(a, b) (((uint64_t)(uint32_t)(a) << 32) | (uint32_t)(b))
+
+static void EdgeSetInit(EdgeSet *s, int count)
+{
+  uint32_t size = 16;
+
+  while (size < 2 * (uint32_t)count)
+    size *= 2;
+  s->mask = size - 1;
+  s->keys = malloc(sizeof(uint64_t) * size);
+  memset(s->keys, 0xff, sizeof(uint64_t) * size);
+}
+
+static uint32_t EdgeSlot(const EdgeSet *s, uint64_t key)
+{
+  uint32_t slot = (uint32_t)((key * 0x9e3779b97f4a7c15ull) >> 32) & s->mask;
+
+  while (s->keys[slot] != kNoEdge && s->keys[slot] != key)
+    slot = (slot + 1) & s->mask;
+  return slot;
+}
+
+// Returns 0 if the key was already present
+static int EdgeSetInsert(EdgeSet *s, uint64_t key)
+{
+  uint32_t slot = EdgeSlot(s, key);
+
+  if (s->keys[slot] == key)
+    return 0;
+  s->keys[slot] = key;
+  return 1;
+}
+
+static int EdgeSetHas(const EdgeSet *s, uint64_t key)
+{
+  return s->keys[EdgeSlot(s, key)] == key;
+}
+
+typedef struct
+{
+  const GLfloat *vertices;
+  int numVertices;
+  GLuint *indices; // The working triangle list
+  int numTris;
+  int *positionOf; // First vertex with the same position
+  char *kind; // kInterior ... kLocked, by position
+  EdgeSet special; // Border and seam edges, by position, smaller first
+  Quadric *quadrics; // By position
+  GLuint *remap;
+  char *locked;
+  int *triOffsets; // Triangles around each position
+  int *tris;
+  double maxError;
+} Simplifier;
+
+typedef struct
+{
+  int u, v; // Collapse position u onto v
+  double cost;
+} Collapse;
+
+static int CompareCollapses(const void *a, const void *b)
+{
+  const Collapse *ca = a;
+  const Collapse *cb = b;
+
+  if (ca->cost != cb->cost)
+    return ca->cost < cb->cost ? -1 : 1;
+  return ca->u != cb->u ? ca->u - cb->u : ca->v - cb->v;
+}
+
+static int TriPosition(const Simplifier *s, int t, int k)
+{
+  return s->positionOf[s->indices[3*t + k]];
+}
+
+static void TriNormal(const GLfloat *p0, const GLfloat *p1, const GLfloat *p2, double n[3])
+{
+  double e1[3], e2[3];
+  int k;
+
+  for (k = 0; k < 3; k++)
+    {
+      e1[k] = p1[k] - p0[k];
+      e2[k] = p2[k] - p0[k];
+    }
+  n[0] = e1[1]*e2[2] - e1[2]*e2[1];
+  n[1] = e1[2]*e2[0] - e1[0]*e2[2];
+  n[2] = e1[0]*e2[1] - e1[1]*e2[0];
+}
+
+static void FindPositions(Simplifier *s)
+{
+  uint32_t size = 16, mask, slot;
+  int *table;
+  int v;
+
+  while (size < 2 * (uint32_t)s->numVertices)
+    size *= 2;
+  mask = size - 1;
+  table = malloc(sizeof(int) * size);
+  memset(table, 0xff, sizeof(int) * size);
+  for (v = 0; v < s->numVertices; v++)
+    {
+      const GLfloat *p = &s->vertices[3*v];
+      uint32_t bits[3];
+
+      memcpy(bits, p, sizeof(bits));
+      slot = (bits[0] * 0x9e3779b1u ^ bits[1] * 0x85ebca77u ^ bits[2] * 0xc2b2ae3du) & mask;
+      while (table[slot] != -1 && memcmp(&s->vertices[3 * table[slot]], p, sizeof(GLfloat) * 3) != 0)
+        slot = (slot + 1) & mask;
+      if (table[slot] == -1)
+        table[slot] = v;
+      s->positionOf[v] = table[slot];
+    }
+  free(table);
+}
+
+// Classify positions, and set up the quadrics of the faces and of the
+// planes through borders and seams
+static void ClassifyPositions(Simplifier *s)
+{
+  EdgeSet wedgeEdges, positionEdges;
+  int *borderCount = calloc(s->numVertices + 1, sizeof(int));
+  int *seamCount = calloc(s->numVertices + 1, sizeof(int));
+  int t, k, v;
+
+  EdgeSetInit(&wedgeEdges, s->numTris * 3);
+  EdgeSetInit(&positionEdges, s->numTris * 3);
+  EdgeSetInit(&s->special, s->numTris * 3);
+
+  for (t = 0; t < s->numTris; t++)
+    for (k = 0; k < 3; k++)
+      {
+        int a = s->indices[3*t + k], b = s->indices[3*t + (k+1) % 3];
+        int pa = s->positionOf[a], pb = s->positionOf[b];
+
+        EdgeSetInsert(&wedgeEdges, EdgeKey(a, b));
+        if (!EdgeSetInsert(&positionEdges, EdgeKey(pa, pb)))
+          s->kind[pa] = s->kind[pb] = kLocked; // Not manifold
+      }
+
+  for (t = 0; t < s->numTris; t++)
+    {
+      const GLfloat *p[3];
+      double n[3], area;
+
+      for (k = 0; k < 3; k++)
+        p[k] = &s->vertices[3 * s->indices[3*t + k]];
+      TriNormal(p[0], p[1], p[2], n);
+      area = sqrt(n[0]*n[0] + n[1]*n[1] + n[2]*n[2]);
+      if (area > 0)
+        {
+          for (k = 0; k < 3; k++)
+            n[k] /= area;
+          for (k = 0; k < 3; k++)
+            QuadricAddPlane(&s->quadrics[TriPosition(s, t, k)], n, -(n[0]*p[0][0] + n[1]*p[0][1] + n[2]*p[0][2]), area / 2);
+        }
+
+      for (k = 0; k < 3; k++)
+        {
+          int a = s->indices[3*t + k], b = s->indices[3*t + (k+1) % 3];
+          int pa = s->positionOf[a], pb = s->positionOf[b];
+          const GLfloat *pp = &s->vertices[3*pa], *pq = &s->vertices[3*pb];
+          double e[3], c[3], length2, length;
+
+          if (!EdgeSetHas(&positionEdges, EdgeKey(pb, pa)))
+            {
+              borderCount[pa]++;
+              borderCount[pb]++;
+            }
+          else if (!EdgeSetHas(&wedgeEdges, EdgeKey(b, a)) && pa < pb)
+            {
+              seamCount[pa]++;
+              seamCount[pb]++;
+            }
+          else
+            continue;
+          EdgeSetInsert(&s->special, pa < pb ? EdgeKey(pa, pb) : EdgeKey(pb, pa));
+
+          // A plane along the edge, perpendicular to the face
+          e[0] = pq[0] - pp[0];
+          e[1] = pq[1] - pp[1];
+          e[2] = pq[2] - pp[2];
+          length2 = e[0]*e[0] + e[1]*e[1] + e[2]*e[2];
+          c[0] = e[1]*n[2] - e[2]*n[1];
+          c[1] = e[2]*n[0] - e[0]*n[2];
+          c[2] = e[0]*n[1] - e[1]*n[0];
+          length = sqrt(c[0]*c[0] + c[1]*c[1] + c[2]*c[2]);
+          if (length > 0 && area > 0)
+            {
+              double d;
+
+              c[0] /= length;
+              c[1] /= length;
+              c[2] /= length;
+              d = -(c[0]*pp[0] + c[1]*pp[1] + c[2]*pp[2]);
+              QuadricAddPlane(&s->quadrics[pa], c, d, kBorderWeight * length2);
+              QuadricAddPlane(&s->quadrics[pb], c, d, kBorderWeight * length2);
+            }
+        }
+    }
+
+  for (v = 0; v < s->numVertices; v++)
+    {
+      if (s->positionOf[v] != v || s->kind[v] == kLocked)
+        continue;
+      if (borderCount[v] > 0)
+        s->kind[v] = borderCount[v] == 2 && seamCount[v] == 0 ? kBorder : kLocked;
+      else if (seamCount[v] > 0)
+        s->kind[v] = seamCount[v] == 2 ? kSeam : kLocked;
+    }
+
+  free(wedgeEdges.keys);
+  free(positionEdges.keys);
+  free(borderCount);
+  free(seamCount);
+}
+
+static int CanCollapse(const Simplifier *s, int u, int v)
+{
+  switch (s->kind[u])
+    {
+      case kInterior:
+        return 1;
+      case kBorder:
+      case kSeam:
+        return EdgeSetHas(&s->special, u < v ? EdgeKey(u, v) : EdgeKey(v, u));
+    }
+  return 0;
+}
+
+static double CollapseCost(const Simplifier *s, int u, int v)
+{
+  Quadric q = s->quadrics[u];
+  int k;
+
+  for (k = 0; k < 10; k++)
+    q.a[k] += s->quadrics[v].a[k];
+  q.w += s->quadrics[v].w;
+  return QuadricError(&q, &s->vertices[3*v]);
+}
+
+// Try to collapse position u onto v. Returns the number of triangles
+// removed, or -1 when the collapse would flip a triangle or tear a seam.
+static int TryCollapse(Simplifier *s, int u, int v)
+{
+  GLuint from[8], to[8];
+  int numPairs = 0, removed = 0;
+  int i, j, k, t;
+
+  // Pair each vertex at u with the vertex at v on the same side of seams
+  for (i = s->triOffsets[u]; i < s->triOffsets[u + 1]; i++)
+    {
+      int ku = -1, kv = -1;
+
+      t = s->tris[i];
+      for (k = 0; k < 3; k++)
+        {
+          if (TriPosition(s, t, k) == u) ku = k;
+          if (TriPosition(s, t, k) == v) kv = k;
+        }
+      if (kv < 0)
+        continue;
+      removed++;
+      for (j = 0; j < numPairs; j++)
+        if (from[j] == s->indices[3*t + ku])
+          break;
+      if (j < numPairs)
+        {
+          if (to[j] != s->indices[3*t + kv])
+            return -1;
+          continue;
+        }
+      if (numPairs == 8)
+        return -1;
+      from[numPairs] = s->indices[3*t + ku];
+      to[numPairs] = s->indices[3*t + kv];
+      numPairs++;
+    }
+  if (removed == 0)
+    return -1;
+
+  for (i = s->triOffsets[u]; i < s->triOffsets[u + 1]; i++)
+    {
+      const GLfloat *p[3], *q[3];
+      double n0[3], n1[3];
+      int ku = -1, kv = -1;
+
+      t = s->tris[i];
+      for (k = 0; k < 3; k++)
+        {
+          if (TriPosition(s, t, k) == u) ku = k;
+          if (TriPosition(s, t, k) == v) kv = k;
+        }
+      if (kv >= 0)
+        continue;
+      for (j = 0; j < numPairs; j++)
+        if (from[j] == s->indices[3*t + ku])
+          break;
+      if (j == numPairs)
+        return -1; // A vertex at u with no counterpart at v
+
+      // The triangle must not flip when u moves to v
+      for (k = 0; k < 3; k++)
+        {
+          p[k] = &s->vertices[3 * s->indices[3*t + k]];
+          q[k] = k == ku ? &s->vertices[3*v] : p[k];
+        }
+      TriNormal(p[0], p[1], p[2], n0);
+      TriNormal(q[0], q[1], q[2], n1);
+      if (n0[0]*n1[0] + n0[1]*n1[1] + n0[2]*n1[2] <= 0)
+        return -1;
+    }
+
+  for (j = 0; j < numPairs; j++)
+    s->remap[from[j]] = to[j];
+  return removed;
+}
+
+// One pass of independent collapses, cheapest first. Returns the number
+// of triangles removed.
+static int SimplifyPass(Simplifier *s, int targetTris)
+{
+  Collapse *collapses = malloc(sizeof(Collapse) * (s->numTris * 3 + 1));
+  int numCollapses = 0, removed = 0;
+  int i, k, t, v;
+
+  // Triangles around each position
+  memset(s->triOffsets, 0, sizeof(int) * (s->numVertices + 1));
+  for (t = 0; t < s->numTris; t++)
+    for (k = 0; k < 3; k++)
+      s->triOffsets[TriPosition(s, t, k) + 1]++;
+  for (v = 0; v < s->numVertices; v++)
+    s->triOffsets[v + 1] += s->triOffsets[v];
+  for (t = 0; t < s->numTris; t++)
+    for (k = 0; k < 3; k++)
+      s->tris[s->triOffsets[TriPosition(s, t, k)]++] = t;
+  for (v = s->numVertices; v > 0; v--)
+    s->triOffsets[v] = s->triOffsets[v - 1];
+  s->triOffsets[0] = 0;
+
+  for (t = 0; t < s->numTris; t++)
+    for (k = 0; k < 3; k++)
+      {
+        int a = TriPosition(s, t, k), b = TriPosition(s, t, (k+1) % 3);
+        Collapse c;
+
+        c.cost = -1;
+        if (CanCollapse(s, a, b))
+          {
+            c.u = a;
+            c.v = b;
+            c.cost = CollapseCost(s, a, b);
+          }
+        if (CanCollapse(s, b, a))
+          {
+            double cost = CollapseCost(s, b, a);
+
+            if (c.cost < 0 || cost < c.cost)
+              {
+                c.u = b;
+                c.v = a;
+                c.cost = cost;
+              }
+          }
+        if (c.cost >= 0)
+          collapses[numCollapses++] = c;
+      }
+  qsort(collapses, numCollapses, sizeof(Collapse), CompareCollapses);
+
+  for (v = 0; v < s->numVertices; v++)
+    {
+      s->remap[v] = v;
+      s->locked[v] = 0;
+    }
+
+  for (i = 0; i < numCollapses && s->numTris - removed > targetTris; i++)
+    {
+      Collapse *c = &collapses[i];
+      int count;
+
+      if (s->locked[c->u] || s->locked[c->v])
+        continue;
+      count = TryCollapse(s, c->u, c->v);
+      if (count < 0)
+        continue;
+
+      removed += count;
+      if (c->cost > s->maxError)
+        s->maxError = c->cost;
+      for (k = 0; k < 10; k++)
+        s->quadrics[c->v].a[k] += s->quadrics[c->u].a[k];
+      s->quadrics[c->v].w += s->quadrics[c->u].w;
+
+      // Keep the neighbourhood fixed for the rest of the pass
+      for (k = s->triOffsets[c->u]; k < s->triOffsets[c->u + 1]; k++)
+        {
+          int j;
+
+          for (j = 0; j < 3; j++)
+            s->locked[TriPosition(s, s->tris[k], j)] = 1;
+        }
+    }
+  free(collapses);
+
+  // Apply the collapses and drop the triangles that became degenerate
+  for (t = 0, i = 0; t < s->numTris; t++)
+    {
+      GLuint a = s->remap[s->indices[3*t]];
+      GLuint b = s->remap[s->indices[3*t + 1]];
+      GLuint c = s->remap[s->indices[3*t + 2]];
+
+      if (s->positionOf[a] == s->positionOf[b]
+          || s->positionOf[b] == s->positionOf[c]
+          || s->positionOf[c] == s->positionOf[a])
+        continue;
+      s->indices[3*i] = a;
+      s->indices[3*i + 1] = b;
+      s->indices[3*i + 2] = c;
+      i++;
+    }
+  removed = s->numTris - i;
+  s->numTris = i;
+  return removed;
+}
+
+static void ComputeBounds(Model *m)
+{
+  GLfloat lo[3], hi[3];
+  double radius2 = 0;
+  int v, k;
+
+  for (k = 0; k < 3; k++)
+    lo[k] = hi[k] = m->numVertices > 0 ? m->vertexArray[k] : 0;
+  for (v = 1; v < m->numVertices; v++)
+    for (k = 0; k < 3; k++)
+      {
+        if (m->vertexArray[3*v + k] < lo[k]) lo[k] = m->vertexArray[3*v + k];
+        if (m->vertexArray[3*v + k] > hi[k]) hi[k] = m->vertexArray[3*v + k];
+      }
+  for (k = 0; k < 3; k++)
+    m->center[k] = (lo[k] + hi[k]) / 2;
+  for (v = 0; v < m->numVertices; v++)
+    {
+      double d2 = 0;
+
+      for (k = 0; k < 3; k++)
+        d2 += (m->vertexArray[3*v + k] - m->center[k]) * (m->vertexArray[3*v + k] - m->center[k]);
+      if (d2 > radius2)
+        radius2 = d2;
+    }
+  m->radius = sqrt(radius2);
+}
+
+void GenerateModelLods(Model *m)
+{
+  Simplifier s;
+  GLuint *levels = NULL;
+  int numLevelIndices = 0;
+  int t, k;
+
+  if (m->mapping != NULL || m->vertexArray == NULL || m->numLods > 0)
+    return;
+  ComputeBounds(m);
+  m->numLods = 1;
+  m->lods[0].first = 0;
+  m->lods[0].count = m->numIndices;
+  m->lods[0].error = 0;
+
+  memset(&s, 0, sizeof(s));
+  s.vertices = m->vertexArray;
+  s.numVertices = m->numVertices;
+  s.indices = malloc(sizeof(GLuint) * (m->numIndices + 1));
+  s.positionOf = malloc(sizeof(int) * (m->numVertices + 1));
+  s.kind = calloc(m->numVertices + 1, 1);
+  s.quadrics = calloc(m->numVertices + 1, sizeof(Quadric));
+  s.remap = malloc(sizeof(GLuint) * (m->numVertices + 1));
+  s.locked = malloc(m->numVertices + 1);
+  s.triOffsets = malloc(sizeof(int) * (m->numVertices + 1));
+  s.tris = malloc(sizeof(int) * (m->numIndices + 1));
+  FindPositions(&s);
+
+  // Work on the triangles that span three positions
+  for (t = 0; t < m->numIndices / 3; t++)
+    {
+      GLuint *tri = &m->indexArray[3*t];
+
+      if (s.positionOf[tri[0]] == s.positionOf[tri[1]]
+          || s.positionOf[tri[1]] == s.positionOf[tri[2]]
+          || s.positionOf[tri[2]] == s.positionOf[tri[0]])
+        continue;
+      memcpy(&s.indices[3 * s.numTris++], tri, sizeof(GLuint) * 3);
+    }
+  ClassifyPositions(&s);
+
+  pthread_once(&scoresOnce, InitScores);
+  while (m->numLods < kMaxLods)
+    {
+      int previous = m->lods[m->numLods - 1].count / 3;
+      int target = (int)(previous * kLodRatio);
+      ModelLod *lod;
+
+      if (target < kMinLodTriangles)
+        break;
+      while (s.numTris > target && SimplifyPass(&s, target) > 0)
+        ;
+      if (s.numTris > previous * (1 + kLodRatio) / 2)
+        break; // Not worth a level
+
+      lod = &m->lods[m->numLods++];
+      lod->first = m->numIndices + numLevelIndices;
+      lod->count = s.numTris * 3;
+      lod->error = sqrt(s.maxError);
+      levels = realloc(levels, sizeof(GLuint) * (numLevelIndices + lod->count));
+      memcpy(&levels[numLevelIndices], s.indices, sizeof(GLuint) * lod->count);
+      OptimizeVertexCache(&levels[numLevelIndices], lod->count, m->numVertices);
+      numLevelIndices += lod->count;
+    }
+
+  if (numLevelIndices > 0)
+    {
+      m->indexArray = realloc(m->indexArray, sizeof(GLuint) * (m->numIndices + numLevelIndices));
+      memcpy(&m->indexArray[m->numIndices], levels, sizeof(GLuint) * numLevelIndices);
+      m->numIndices += numLevelIndices;
+    }
+
+  printf("Model LODs:");
+  for (k = 0; k < m->numLods; k++)
+    printf(" %d", m->lods[k].count / 3);
+  printf(" triangles\n");
+
+  free(levels);
+  free(s.indices);
+  free(s.positionOf);
+  free(s.kind);
+  free(s.special.keys);
+  free(s.quadrics);
+  free(s.remap);
+  free(s.locked);
+  free(s.triOffsets);
+  free(s.tris);
+}
+
+int SelectModelLod(Model *m, float pixelsPerUnit, float maxPixels)
+{
+  int level;
+
+  for (level = m->numLods - 1; level > 0; level--)
+    if (m->lods[level].error * pixelsPerUnit <= maxPixels)
+      return level;
+  return 0;
+}
+
+
+// Meshlets: clusters of neighbouring triangles up to the triangle and
+// vertex limits, with a bounding sphere and a cone holding the triangle
+// normals, for culling as in Zeux Kapoulkine's meshoptimizer. The full
+// mesh is reordered so that each meshlet is a range of the index array.
+
+#define kMeshletConeWeight 2.0 // Normal deviation against new vertices
+
+static void MeshletBounds(Model *m, int meshlet, int stride)
+{
+  GLuint first = m->meshletRanges[2*meshlet], count = m->meshletRanges[2*meshlet + 1];
+  GLfloat *b = m->meshletBounds;
+  GLfloat lo[3], hi[3], center[3];
+  double axis[3] = {0, 0, 0}, radius2 = 0, length, minDot = 1;
+  GLuint i;
+  int k;
+
+  for (k = 0; k < 3; k++)
+    {
+      lo[k] = hi[k] = m->vertexArray[3 * m->indexArray[first] + k];
+      for (i = first; i < first + count; i++)
+        {
+          GLfloat c = m->vertexArray[3 * m->indexArray[i] + k];
+          if (c < lo[k]) lo[k] = c;
+          if (c > hi[k]) hi[k] = c;
+        }
+      center[k] = (lo[k] + hi[k]) / 2;
+    }
+  for (i = first; i < first + count; i++)
+    {
+      const GLfloat *p = &m->vertexArray[3 * m->indexArray[i]];
+      double d2 = 0;
+
+      for (k = 0; k < 3; k++)
+        d2 += (p[k] - center[k]) * (p[k] - center[k]);
+      if (d2 > radius2)
+        radius2 = d2;
+    }
+
+  // Cone axis from the area weighted normals, and the widest deviation
+  for (i = first; i < first + count; i += 3)
+    {
+      double n[3];
+
+      TriNormal(&m->vertexArray[3 * m->indexArray[i]], &m->vertexArray[3 * m->indexArray[i+1]],
+                &m->vertexArray[3 * m->indexArray[i+2]], n);
+      for (k = 0; k < 3; k++)
+        axis[k] += n[k];
+    }
+  length = sqrt(axis[0]*axis[0] + axis[1]*axis[1] + axis[2]*axis[2]);
+  for (k = 0; k < 3 && length > 0; k++)
+    axis[k] /= length;
+  for (i = first; i < first + count && length > 0; i += 3)
+    {
+      double n[3], area;
+
+      TriNormal(&m->vertexArray[3 * m->indexArray[i]], &m->vertexArray[3 * m->indexArray[i+1]],
+                &m->vertexArray[3 * m->indexArray[i+2]], n);
+      area = sqrt(n[0]*n[0] + n[1]*n[1] + n[2]*n[2]);
+      if (area > 0 && (n[0]*axis[0] + n[1]*axis[1] + n[2]*axis[2]) / area < minDot)
+        minDot = (n[0]*axis[0] + n[1]*axis[1] + n[2]*axis[2]) / area;
+    }
+
+  for (k = 0; k < 3; k++)
+    {
+      b[k * stride + meshlet] = center[k];
+      b[(4 + k) * stride + meshlet] = axis[k];
+    }
+  b[3 * stride + meshlet] = sqrt(radius2);
+  // Sine of the cone angle; 1 never culls, for cones of 90 degrees or more
+  b[7 * stride + meshlet] = length > 0 && minDot > 0 ? sqrt(1 - minDot * minDot) : 1;
+}
+
+static void CloseMeshlet(Model *m, GLuint first, GLuint end)
+{
+  m->meshletRanges[2 * m->numMeshlets] = first;
+  m->meshletRanges[2 * m->numMeshlets + 1] = end - first;
+  m->numMeshlets++;
+}
+
+void GenerateModelMeshlets(Model *m)
+{
+  int numIndices = m->numLods > 0 ? m->lods[0].count : m->numIndices;
+  int numTris = numIndices / 3;
+  int *offsets, *adjacency, *stamp;
+  float *normals;
+  char *emitted;
+  GLuint *out;
+  GLuint first = 0, end = 0;
+  int verts[kMeshletVertices];
+  int numVerts = 0, meshletTris = 0, seed = 0;
+  double axis[3] = {0, 0, 0};
+  int stride, meshlet, i, k, t, v;
+
+  if (m->mapping != NULL || m->vertexArray == NULL || m->numMeshlets > 0 || numTris == 0)
+    return;
+
+  // Triangles around each vertex, and unit triangle normals
+  offsets = calloc(m->numVertices + 1, sizeof(int));
+  adjacency = malloc(sizeof(int) * numTris * 3);
+  for (i = 0; i < numTris * 3; i++)
+    offsets[m->indexArray[i] + 1]++;
+  for (v = 0; v < m->numVertices; v++)
+    offsets[v + 1] += offsets[v];
+  for (i = 0; i < numTris * 3; i++)
+    adjacency[offsets[m->indexArray[i]]++] = i / 3;
+  for (v = m->numVertices; v > 0; v--)
+    offsets[v] = offsets[v - 1];
+  offsets[0] = 0;
+
+  normals = malloc(sizeof(float) * 3 * numTris);
+  for (t = 0; t < numTris; t++)
+    {
+      double n[3], length;
+
+      TriNormal(&m->vertexArray[3 * m->indexArray[3*t]], &m->vertexArray[3 * m->indexArray[3*t+1]],
+                &m->vertexArray[3 * m->indexArray[3*t+2]], n);
+      length = sqrt(n[0]*n[0] + n[1]*n[1] + n[2]*n[2]);
+      for (k = 0; k < 3; k++)
+        normals[3*t + k] = length > 0 ? n[k] / length : 0;
+    }
+
+  stamp = malloc(sizeof(int) * m->numVertices);
+  for (v = 0; v < m->numVertices; v++)
+    stamp[v] = -1;
+  emitted = calloc(numTris, 1);
+  out = malloc(sizeof(GLuint) * numTris * 3);
+  m->meshletRanges = malloc(sizeof(GLuint) * 2 * numTris);
+
+  // Grow each meshlet from a seed in index order, preferring triangles
+  // that add few vertices and keep the normal cone narrow
+  for (i = 0; i < numTris; i++)
+    {
+      int best = -1;
+      double bestScore = 0, length;
+
+      length = sqrt(axis[0]*axis[0] + axis[1]*axis[1] + axis[2]*axis[2]);
+      for (k = 0; k < numVerts && meshletTris < kMeshletTriangles; k++)
+        {
+          int j;
+
+          for (j = offsets[verts[k]]; j < offsets[verts[k] + 1]; j++)
+            {
+              int extra = 0, c;
+              double score, dot = 0;
+
+              t = adjacency[j];
+              if (emitted[t])
+                continue;
+              for (c = 0; c < 3; c++)
+                extra += stamp[m->indexArray[3*t + c]] != m->numMeshlets;
+              if (numVerts + extra > kMeshletVertices)
+                continue;
+              for (c = 0; c < 3 && length > 0; c++)
+                dot += normals[3*t + c] * axis[c] / length;
+              score = extra + kMeshletConeWeight * (1 - dot);
+              if (best < 0 || score < bestScore)
+                {
+                  best = t;
+                  bestScore = score;
+                }
+            }
+        }
+
+      if (best < 0)
+        {
+          if (meshletTris > 0)
+            {
+              CloseMeshlet(m, first, end);
+              first = end;
+              numVerts = meshletTris = 0;
+              axis[0] = axis[1] = axis[2] = 0;
+            }
+          while (emitted[seed])
+            seed++;
+          best = seed;
+        }
+
+      emitted[best] = 1;
+      for (k = 0; k < 3; k++)
+        {
+          v = m->indexArray[3*best + k];
+          out[end++] = v;
+          if (stamp[v] != m->numMeshlets)
+            {
+              stamp[v] = m->numMeshlets;
+              verts[numVerts++] = v;
+            }
+          axis[k] += normals[3*best + k];
+        }
+      meshletTris++;
+    }
+  CloseMeshlet(m, first, end);
+
+  memcpy(m->indexArray, out, sizeof(GLuint) * numTris * 3);
+  free(offsets);
+  free(adjacency);
+  free(normals);
+  free(stamp);
+  free(emitted);
+  free(out);
+
+  stride = MeshletStride(m->numMeshlets);
+  m->meshletBounds = calloc(8 * stride, sizeof(GLfloat));
+  for (meshlet = 0; meshlet < m->numMeshlets; meshlet++)
+    MeshletBounds(m, meshlet, stride);
+
+  printf("Model meshlets: %d\n", m->numMeshlets);
+}
+
+void SetModelMeshlets(Model *m, int count, const GLuint *ranges)
+{
+  int stride, meshlet;
+
+  if (m->vertexArray == NULL || m->numMeshlets > 0 || count == 0)
+    return;
+
+  m->numMeshlets = count;
+  m->meshletRanges = malloc(sizeof(GLuint) * 2 * count);
+  memcpy(m->meshletRanges, ranges, sizeof(GLuint) * 2 * count);
+  stride = MeshletStride(count);
+  m->meshletBounds = calloc(8 * stride, sizeof(GLfloat));
+  for (meshlet = 0; meshlet < count; meshlet++)
+    MeshletBounds(m, meshlet, stride);
+}
+
+int CullMeshlets(Model *m, const GLfloat *modelview, const GLfloat *projection, int cones, char *visible)
+{
+  const GLfloat *b = m->meshletBounds;
+  int stride = MeshletStride(m->numMeshlets);
+  GLfloat mvp[16], planes[6][4], eye[3];
+  double a[9], det;
+  int i, j, k, count = 0;
+
+  // Frustum planes in model space, from the rows of the projection times
+  // the modelview
+  for (i = 0; i < 4; i++)
+    for (j = 0; j < 4; j++)
+      {
+        mvp[4*j + i] = 0;
+        for (k = 0; k < 4; k++)
+          mvp[4*j + i] += projection[4*k + i] * modelview[4*j + k];
+      }
+  for (i = 0; i < 6; i++)
+    {
+      int row = i / 2;
+      float sign = i % 2 ? -1 : 1;
+      double length;
+
+      for (j = 0; j < 4; j++)
+        planes[i][j] = mvp[4*j + 3] + sign * mvp[4*j + row];
+      length = sqrt(planes[i][0]*planes[i][0] + planes[i][1]*planes[i][1] + planes[i][2]*planes[i][2]);
+      for (j = 0; j < 4 && length > 0; j++)
+        planes[i][j] /= length;
+    }
+
+  // The eye in model space, -A^-1 t for the modelview [A t]
+  for (i = 0; i < 3; i++)
+    for (j = 0; j < 3; j++)
+      a[3*i + j] = modelview[4*j + i];
+  det = a[0]*(a[4]*a[8] - a[5]*a[7]) - a[1]*(a[3]*a[8] - a[5]*a[6]) + a[2]*(a[3]*a[7] - a[4]*a[6]);
+  if (det == 0)
+    det = 1;
+  {
+    double t[3] = {modelview[12], modelview[13], modelview[14]};
+    double inv[9];
+
+    inv[0] = (a[4]*a[8] - a[5]*a[7]) / det;
+    inv[1] = (a[2]*a[7] - a[1]*a[8]) / det;
+    inv[2] = (a[1]*a[5] - a[2]*a[4]) / det;
+    inv[3] = (a[5]*a[6] - a[3]*a[8]) / det;
+    inv[4] = (a[0]*a[8] - a[2]*a[6]) / det;
+    inv[5] = (a[2]*a[3] - a[0]*a[5]) / det;
+    inv[6] = (a[3]*a[7] - a[4]*a[6]) / det;
+    inv[7] = (a[1]*a[6] - a[0]*a[7]) / det;
+    inv[8] = (a[0]*a[4] - a[1]*a[3]) / det;
+    for (i = 0; i < 3; i++)
+      eye[i] = -(inv[3*i]*t[0] + inv[3*i + 1]*t[1] + inv[3*i + 2]*t[2]);
+  }
+
+#ifdef __SSE__
+  for (i = 0; i < m->numMeshlets; i += 4)
+    {
+      __m128 cx = _mm_loadu_ps(&b[i]), cy = _mm_loadu_ps(&b[stride + i]);
+      __m128 cz = _mm_loadu_ps(&b[2*stride + i]), r = _mm_loadu_ps(&b[3*stride + i]);
+      __m128 nr = _mm_sub_ps(_mm_setzero_ps(), r);
+      __m128 inside = _mm_castsi128_ps(_mm_set1_epi32(-1));
+      __m128 vx, vy, vz, dist, facing, back;
+      int mask;
+
+      for (j = 0; j < 6; j++)
+        {
+          __m128 d = _mm_add_ps(
+            _mm_add_ps(_mm_mul_ps(_mm_set1_ps(planes[j][0]), cx), _mm_mul_ps(_mm_set1_ps(planes[j][1]), cy)),
+            _mm_add_ps(_mm_mul_ps(_mm_set1_ps(planes[j][2]), cz), _mm_set1_ps(planes[j][3])));
+          inside = _mm_and_ps(inside, _mm_cmpgt_ps(d, nr));
+        }
+
+      vx = _mm_sub_ps(cx, _mm_set1_ps(eye[0]));
+      vy = _mm_sub_ps(cy, _mm_set1_ps(eye[1]));
+      vz = _mm_sub_ps(cz, _mm_set1_ps(eye[2]));
+      dist = _mm_sqrt_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(vx, vx), _mm_mul_ps(vy, vy)), _mm_mul_ps(vz, vz)));
+      facing = _mm_add_ps(_mm_add_ps(
+        _mm_mul_ps(_mm_loadu_ps(&b[4*stride + i]), vx),
+        _mm_mul_ps(_mm_loadu_ps(&b[5*stride + i]), vy)),
+        _mm_mul_ps(_mm_loadu_ps(&b[6*stride + i]), vz));
+      back = _mm_cmpgt_ps(facing, _mm_add_ps(_mm_mul_ps(_mm_loadu_ps(&b[7*stride + i]), dist), r));
+      if (!cones)
+        back = _mm_setzero_ps();
+
+      mask = _mm_movemask_ps(_mm_andnot_ps(back, inside));
+      for (k = 0; k < 4 && i + k < m->numMeshlets; k++)
+        {
+          visible[i + k] = (mask >> k) & 1;
+          count += visible[i + k];
+        }
+    }
+#else
+  for (i = 0; i < m->numMeshlets; i++)
+    {
+      float r = b[3*stride + i], v[3], dist;
+      char in = 1;
+
+      for (j = 0; j < 6; j++)
+        in &= planes[j][0]*b[i] + planes[j][1]*b[stride + i] + planes[j][2]*b[2*stride + i] + planes[j][3] > -r;
+      for (k = 0; k < 3; k++)
+        v[k] = b[k*stride + i] - eye[k];
+      dist = sqrtf(v[0]*v[0] + v[1]*v[1] + v[2]*v[2]);
+      if (cones && b[4*stride + i]*v[0] + b[5*stride + i]*v[1] + b[6*stride + i]*v[2] > b[7*stride + i]*dist + r)
+        in = 0;
+      visible[i] = in;
+      count += in;
+    }
+#endif
+  return count;
+}
+
+float ModelACMR(Model *m, int cacheSize)
+{
+  int numIndices = m->numLods > 0 ? m->lods[0].count : m->numIndices;
+  int *insertedAt;
+  int misses = 0;
+  int i, v;
+
+  if (numIndices < 3)
+    return 0;
+  insertedAt = malloc(sizeof(int) * (m->numVertices > 0 ? m->numVertices : 1));
+  for (v = 0; v < m->numVertices; v++)
+    insertedAt[v] = -cacheSize - 1;
+  for (i = 0; i < numIndices; i++)
+    {
+      v = m->indexArray[i];
+      if (misses - insertedAt[v] > cacheSize)
+        insertedAt[v] = misses++;
+    }
+  free(insertedAt);
+  return (float)misses / (numIndices / 3);
+}
+
+void OptimizeModel(Model *m, unsigned int options)
+{
+  // Mapped (cached) models are already processed, and read only
+  if (m->mapping != NULL)
+    return;
+
+  pthread_once(&scoresOnce, InitScores);
+  if (options & (kModelOptimizeVertexCache | kModelOptimizeOverdraw))
+    {
+      float before = ModelACMR(m, kReportCacheSize);
+
+      OptimizeVertexCache(m->indexArray, m->numIndices, m->numVertices);
+      if (options & kModelOptimizeOverdraw)
+        OptimizeOverdraw(m->indexArray, m->numIndices, m->vertexArray, m->numVertices);
+      OptimizeVertexFetch(m);
+
+      printf("Optimized model: ACMR %.3f -> %.3f (FIFO %d)\n", before, ModelACMR(m, kReportCacheSize), kReportCacheSize);
+    }
+  if (options & kModelLods)
+    GenerateModelLods(m);
+  if (options & kModelMeshlets)
+    GenerateModelMeshlets(m);
+}
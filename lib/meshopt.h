@@ -0,0 +1,37 @@
+#ifndef meshopt_h
+#define meshopt_h
+
+#include "loadobj.h"
+
+// Reorder the triangles and vertices of a loaded model, as selected by the
+// kModelOptimize* options, and then build its levels of detail with
+// kModelLods and meshlets with kModelMeshlets. Prints the ACMR before and
+// after.
+void OptimizeModel(Model *m, unsigned int options);
+
+// Append simplified levels of detail to the index array, each with about
+// half the triangles of the one before, and set the bounding sphere
+void GenerateModelLods(Model *m);
+
+// Split the full mesh into meshlets of at most kMeshletTriangles triangles
+// and kMeshletVertices vertices, in index order
+void GenerateModelMeshlets(Model *m);
+
+// Use count first, count pairs of the index array as meshlets, of any size,
+// for meshes laid out in ranges of their own such as terrain chunks
+void SetModelMeshlets(Model *m, int count, const GLuint *ranges);
+
+// Flag the meshlets that may be visible through the frustum of the column
+// major modelview and projection, and with cones, not facing away. Cones
+// only hold for meshes drawn with back faces culled. Returns the count.
+int CullMeshlets(Model *m, const GLfloat *modelview, const GLfloat *projection, int cones, char *visible);
+
+// The coarsest level whose error is at most maxPixels on screen, where one
+// model unit at the distance of the model covers pixelsPerUnit pixels
+int SelectModelLod(Model *m, float pixelsPerUnit, float maxPixels);
+
+// Average cache miss ratio (transformed vertices per triangle) of the
+// index order, for a FIFO post-transform cache of the given size
+float ModelACMR(Model *m, int cacheSize);
+
+#endif
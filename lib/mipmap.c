@@ -0,0 +1,516 @@
+// Mip chain filtering and caching
+//
+// Each level is filtered from the one before it, separably: a horizontal
+// pass into a float buffer and a vertical pass out of it. The taps cover
+// the source area of each destination texel, so odd sizes are filtered
+// without shifting the image. The Kaiser filter is a windowed sinc with
+// the parameters of the NVIDIA Texture Tools; width 3, alpha 4.
+
+#define _POSIX_C_SOURCE 200809L
+#include "mipmap.h"
+#include <math.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define MIP_CACHE_VERSION 1
+#define MIP_MAX_THREADS 64
+#define kMipMinRowsPerThread 32
+#define kKaiserWidth 3.0f
+#define kKaiserAlpha 4.0f
+#define kPi 3.14159265358979f
+
+typedef struct
+{
+  int taps; // Per destination texel
+  int *index; // Source texel of each tap, clamped to the edge
+  float *weight;
+} FilterTaps;
+
+typedef struct
+{
+  const MipLevel *src;
+  MipLevel *dst;
+  const FilterTaps *x, *y;
+  float *temp; // src->height rows of dst->width texels
+  int bpp;
+  unsigned int options;
+  int first, last; // Rows of this job
+} MipJob;
+
+static float toLinear[256];
+static pthread_once_t tableOnce = PTHREAD_ONCE_INIT;
+
+static void InitTables(void)
+{
+  int i;
+
+  for (i = 0; i < 256; i++)
+    {
+      float c = i / 255.0f;
+      toLinear[i] = c <= 0.04045f ? c / 12.92f : powf((c + 0.055f) / 1.055f, 2.4f);
+    }
+}
+
+static GLubyte ToByte(float c)
+{
+  c = c * 255.0f + 0.5f;
+  if (c <= 0.0f)
+    return 0;
+  if (c >= 255.0f)
+    return 255;
+  return (GLubyte)c;
+}
+
+static GLubyte ToSRGB(float c)
+{
+  if (c <= 0.0f)
+    return 0;
+  if (c >= 1.0f)
+    return 255;
+  return ToByte(c <= 0.0031308f ? c * 12.92f : 1.055f * powf(c, 1.0f / 2.4f) - 0.055f);
+}
+
+static float BesselI0(float x)
+{
+  float sum = 1.0f, term = 1.0f, k;
+
+  for (k = 1.0f; k < 32.0f && term > 1e-7f * sum; k += 1.0f)
+    {
+      term *= (x * x) / (4.0f * k * k);
+      sum += term;
+    }
+  return sum;
+}
+
+// Filter weight at t destination texels from the center
+static float Kaiser(float t)
+{
+  float s, r;
+
+  if (fabsf(t) >= kKaiserWidth)
+    return 0.0f;
+  s = t == 0.0f ? 1.0f : sinf(kPi * t) / (kPi * t);
+  r = t / kKaiserWidth;
+  return s * BesselI0(kKaiserAlpha * sqrtf(1.0f - r * r)) / BesselI0(kKaiserAlpha);
+}
+
+static void MakeTaps(FilterTaps *f, int srcSize, int dstSize, int kaiser)
+{
+  float scale = (float)srcSize / dstSize;
+  float radius = kaiser ? kKaiserWidth * scale : 0.5f * scale;
+  int i, k;
+
+  f->taps = (int)ceilf(2.0f * radius) + 1;
+  f->index = malloc(sizeof(int) * f->taps * dstSize);
+  f->weight = malloc(sizeof(float) * f->taps * dstSize);
+  for (i = 0; i < dstSize; i++)
+    {
+      float center = (i + 0.5f) * scale;
+      int first = (int)floorf(center - radius);
+      float sum = 0.0f;
+
+      for (k = 0; k < f->taps; k++)
+        {
+          int j = first + k;
+          float w;
+
+          if (kaiser)
+            w = Kaiser((j + 0.5f - center) / scale);
+          else
+            { // Overlap of the source texel with the destination texel
+              float lo = fmaxf((float)j, center - radius);
+              float hi = fminf((float)(j + 1), center + radius);
+              w = hi > lo ? hi - lo : 0.0f;
+            }
+          f->index[i * f->taps + k] = j < 0 ? 0 : (j >= srcSize ? srcSize - 1 : j);
+          f->weight[i * f->taps + k] = w;
+          sum += w;
+        }
+      for (k = 0; k < f->taps; k++)
+        f->weight[i * f->taps + k] /= sum;
+    }
+}
+
+static void FreeTaps(FilterTaps *f)
+{
+  free(f->index);
+  free(f->weight);
+}
+
+static void FilterRows(MipJob *job)
+{
+  const MipLevel *src = job->src;
+  int bpp = job->bpp, linear = (job->options & kMipSRGB) != 0;
+  int y, x, k, c;
+
+  for (y = job->first; y < job->last; y++)
+    {
+      const GLubyte *row = src->pixels + (size_t)y * src->width * bpp;
+      float *out = job->temp + (size_t)y * job->dst->width * bpp;
+
+      for (x = 0; x < job->dst->width; x++)
+        {
+          const int *index = job->x->index + x * job->x->taps;
+          const float *weight = job->x->weight + x * job->x->taps;
+
+          for (c = 0; c < bpp; c++)
+            out[x * bpp + c] = 0.0f;
+          for (k = 0; k < job->x->taps; k++)
+            {
+              const GLubyte *p = row + index[k] * bpp;
+
+              if (weight[k] == 0.0f)
+                continue;
+              for (c = 0; c < bpp; c++)
+                out[x * bpp + c] += weight[k] * (linear && c < 3 ? toLinear[p[c]] : p[c] / 255.0f);
+            }
+        }
+    }
+}
+
+static void FilterColumns(MipJob *job)
+{
+  MipLevel *dst = job->dst;
+  int bpp = job->bpp, linear = (job->options & kMipSRGB) != 0;
+  size_t stride = (size_t)dst->width * bpp;
+  float sum[4];
+  int y, x, k, c;
+
+  for (y = job->first; y < job->last; y++)
+    {
+      const int *index = job->y->index + y * job->y->taps;
+      const float *weight = job->y->weight + y * job->y->taps;
+      GLubyte *out = dst->pixels + y * stride;
+
+      for (x = 0; x < dst->width; x++)
+        {
+          for (c = 0; c < bpp; c++)
+            sum[c] = 0.0f;
+          for (k = 0; k < job->y->taps; k++)
+            {
+              const float *p = job->temp + index[k] * stride + x * bpp;
+
+              if (weight[k] == 0.0f)
+                continue;
+              for (c = 0; c < bpp; c++)
+                sum[c] += weight[k] * p[c];
+            }
+          for (c = 0; c < bpp; c++)
+            out[x * bpp + c] = linear && c < 3 ? ToSRGB(sum[c]) : ToByte(sum[c]);
+        }
+    }
+}
+
+static void *FilterRowsThread(void *job)
+{
+  FilterRows(job);
+  return NULL;
+}
+
+static void *FilterColumnsThread(void *job)
+{
+  FilterColumns(job);
+  return NULL;
+}
+
+// Split rows into bands, one per thread, the first for the calling thread
+static void RunBands(MipJob *base, int rows, void *(*thread)(void *))
+{
+  MipJob jobs[MIP_MAX_THREADS];
+  pthread_t threads[MIP_MAX_THREADS];
+  int started[MIP_MAX_THREADS];
+  long cores = sysconf(_SC_NPROCESSORS_ONLN);
+  int n = rows / kMipMinRowsPerThread;
+  int i;
+
+  if (n > cores) n = cores;
+  if (n > MIP_MAX_THREADS) n = MIP_MAX_THREADS;
+  if (n < 1) n = 1;
+  for (i = 0; i < n; i++)
+    {
+      jobs[i] = *base;
+      jobs[i].first = rows * i / n;
+      jobs[i].last = rows * (i + 1) / n;
+    }
+  for (i = 1; i < n; i++)
+    started[i] = (pthread_create(&threads[i], NULL, thread, &jobs[i]) == 0);
+  thread(&jobs[0]);
+  for (i = 1; i < n; i++)
+    {
+      if (started[i])
+        pthread_join(threads[i], NULL);
+      else
+        thread(&jobs[i]);
+    }
+}
+
+void BuildMipChain(MipChain *chain, unsigned int options)
+{
+  int bpp = chain->bytesPerPixel;
+  int i;
+
+  pthread_once(&tableOnce, InitTables);
+  for (i = 1; i < kMaxMipLevels; i++)
+    {
+      const MipLevel *src = &chain->levels[i - 1];
+      MipLevel *dst = &chain->levels[i];
+      FilterTaps x, y;
+      MipJob job;
+
+      if (src->width == 1 && src->height == 1)
+        break;
+      dst->width = src->width > 1 ? src->width / 2 : 1;
+      dst->height = src->height > 1 ? src->height / 2 : 1;
+      dst->pixels = malloc((size_t)dst->width * dst->height * bpp);
+      MakeTaps(&x, src->width, dst->width, options & kMipKaiser);
+      MakeTaps(&y, src->height, dst->height, options & kMipKaiser);
+
+      memset(&job, 0, sizeof(job));
+      job.src = src;
+      job.dst = dst;
+      job.x = &x;
+      job.y = &y;
+      job.bpp = bpp;
+      job.options = options;
+      job.temp = malloc(sizeof(float) * src->height * dst->width * bpp);
+      RunBands(&job, src->height, FilterRowsThread);
+      RunBands(&job, dst->height, FilterColumnsThread);
+
+      free(job.temp);
+      FreeTaps(&x);
+      FreeTaps(&y);
+    }
+  chain->numLevels = i;
+}
+
+void FreeMipChain(MipChain *chain)
+{
+  int i;
+
+  if (chain->mapping != NULL)
+    munmap(chain->mapping, chain->mappingSize);
+  else
+    for (i = 0; i < chain->numLevels; i++)
+      free(chain->levels[i].pixels);
+  memset(chain, 0, sizeof(MipChain));
+}
+
+GLuint UploadMipChain(MipChain *chain)
+{
+  GLenum type = chain->bytesPerPixel == 3 ? GL_RGB : GL_RGBA;
+  GLenum format = chain->bytesPerPixel == 3 ? GL_RGB8 : GL_RGBA8;
+  GLint alignment;
+  GLuint tex;
+  int i;
+
+  glGenTextures(1, &tex);
+  glBindTexture(GL_TEXTURE_2D, tex);
+  glGetIntegerv(GL_UNPACK_ALIGNMENT, &alignment);
+  glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+  if (HasTextureStorage())
+    glTexStorage2D(GL_TEXTURE_2D, chain->numLevels, format, chain->levels[0].width, chain->levels[0].height);
+  else
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, chain->numLevels - 1);
+  for (i = 0; i < chain->numLevels; i++)
+    {
+      const MipLevel *l = &chain->levels[i];
+
+      if (HasTextureStorage())
+        glTexSubImage2D(GL_TEXTURE_2D, i, 0, 0, l->width, l->height, type, GL_UNSIGNED_BYTE, l->pixels);
+      else
+        glTexImage2D(GL_TEXTURE_2D, i, format, l->width, l->height, 0, type, GL_UNSIGNED_BYTE, l->pixels);
+    }
+  glPixelStorei(GL_UNPACK_ALIGNMENT, alignment);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+  return tex;
+}
+
+
+// Mip chain cache
+//
+// A header followed by the pixels of each level, each starting on a 16
+// byte boundary. The cache is valid for a source file of the same size
+// and modification time, filtered by the same MIP_CACHE_VERSION with the
+// same options.
+
+typedef struct
+{
+  char magic[4];
+  uint32_t version;
+  uint32_t options;
+  int32_t bytesPerPixel;
+  int64_t sourceSize;
+  int64_t sourceMtime;
+  int64_t sourceMtimeNsec;
+  int32_t numLevels;
+  int32_t width[kMaxMipLevels];
+  int32_t height[kMaxMipLevels];
+} MipCacheHeader;
+
+#define kCacheAlign 16
+#define CacheAlign(n) (((n) + kCacheAlign - 1) & ~(size_t)(kCacheAlign - 1))
+
+static void FillCacheHeader(MipCacheHeader *h, struct stat *source, unsigned int options)
+{
+  memset(h, 0, sizeof(MipCacheHeader));
+  memcpy(h->magic, "CPGT", 4);
+  h->version = MIP_CACHE_VERSION;
+  h->options = options;
+  h->sourceSize = source->st_size;
+  h->sourceMtime = source->st_mtim.tv_sec;
+  h->sourceMtimeNsec = source->st_mtim.tv_nsec;
+}
+
+// Size of the cache file, or 0 for an invalid header
+static size_t CacheLevelSizes(const MipCacheHeader *h, size_t sizes[kMaxMipLevels])
+{
+  size_t total = CacheAlign(sizeof(MipCacheHeader));
+  int i;
+
+  if ((h->bytesPerPixel != 3 && h->bytesPerPixel != 4)
+      || h->numLevels < 1 || h->numLevels > kMaxMipLevels)
+    return 0;
+  for (i = 0; i < h->numLevels; i++)
+    {
+      if (h->width[i] < 1 || h->height[i] < 1)
+        return 0;
+      sizes[i] = (size_t)h->width[i] * h->height[i] * h->bytesPerPixel;
+      total += CacheAlign(sizes[i]);
+    }
+  return total;
+}
+
+static int MapMipCache(char *cacheName, struct stat *source, unsigned int options, MipChain *chain)
+{
+  MipCacheHeader expected;
+  const MipCacheHeader *h;
+  size_t sizes[kMaxMipLevels];
+  struct stat st;
+  char *data, *p;
+  int fd, i;
+
+  fd = open(cacheName, O_RDONLY);
+  if (fd < 0)
+    return 0;
+  if (fstat(fd, &st) != 0 || st.st_size < (off_t)sizeof(MipCacheHeader))
+    {
+      close(fd);
+      return 0;
+    }
+  data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED)
+    return 0;
+
+  h = (const MipCacheHeader *)data;
+  FillCacheHeader(&expected, source, options);
+  if (memcmp(h->magic, expected.magic, 4) != 0
+      || h->version != expected.version
+      || h->options != expected.options
+      || h->sourceSize != expected.sourceSize
+      || h->sourceMtime != expected.sourceMtime
+      || h->sourceMtimeNsec != expected.sourceMtimeNsec
+      || CacheLevelSizes(h, sizes) != (size_t)st.st_size)
+    {
+      munmap(data, st.st_size);
+      return 0;
+    }
+
+  memset(chain, 0, sizeof(MipChain));
+  chain->bytesPerPixel = h->bytesPerPixel;
+  chain->numLevels = h->numLevels;
+  chain->mapping = data;
+  chain->mappingSize = st.st_size;
+  p = data + CacheAlign(sizeof(MipCacheHeader));
+  for (i = 0; i < h->numLevels; i++)
+    {
+      chain->levels[i].width = h->width[i];
+      chain->levels[i].height = h->height[i];
+      chain->levels[i].pixels = (GLubyte *)p;
+      p += CacheAlign(sizes[i]);
+    }
+  return 1;
+}
+
+static void WriteMipCache(MipChain *chain, char *cacheName, struct stat *source, unsigned int options)
+{
+  static const char zeros[kCacheAlign];
+  MipCacheHeader h;
+  size_t sizes[kMaxMipLevels];
+  char *tempName;
+  FILE *f;
+  int i, ok, fd;
+
+  FillCacheHeader(&h, source, options);
+  h.bytesPerPixel = chain->bytesPerPixel;
+  h.numLevels = chain->numLevels;
+  for (i = 0; i < chain->numLevels; i++)
+    {
+      h.width[i] = chain->levels[i].width;
+      h.height[i] = chain->levels[i].height;
+    }
+  CacheLevelSizes(&h, sizes);
+
+  // Write to a temporary file and rename, so readers never see half a
+  // cache. The name is unique, as streaming threads of one process may
+  // write the same cache at once.
+  tempName = malloc(strlen(cacheName) + 8);
+  sprintf(tempName, "%s.XXXXXX", cacheName);
+  fd = mkstemp(tempName);
+  if (fd < 0)
+    {
+      free(tempName);
+      return;
+    }
+  fchmod(fd, 0644);
+  f = fdopen(fd, "wb");
+  if (f == NULL)
+    {
+      close(fd);
+      remove(tempName);
+      free(tempName);
+      return;
+    }
+  ok = fwrite(&h, sizeof(h), 1, f) == 1
+    && fwrite(zeros, CacheAlign(sizeof(h)) - sizeof(h), 1, f) <= 1;
+  for (i = 0; i < chain->numLevels && ok; i++)
+    ok = fwrite(chain->levels[i].pixels, sizes[i], 1, f) == 1
+      && fwrite(zeros, CacheAlign(sizes[i]) - sizes[i], 1, f) <= 1;
+  ok = (fclose(f) == 0) && ok;
+  if (!ok || rename(tempName, cacheName) != 0)
+    {
+      fprintf(stderr, "Unable to write texture cache %s\n", cacheName);
+      remove(tempName);
+    }
+  free(tempName);
+}
+
+int LoadMipChainCached(char *name, char *cacheName, unsigned int options, MipChain *chain)
+{
+  TextureData tex;
+  struct stat source;
+
+  memset(chain, 0, sizeof(MipChain));
+  if (stat(name, &source) != 0)
+    {
+      printf("could not open file %s\n", name);
+      return 0;
+    }
+  if (cacheName != NULL && MapMipCache(cacheName, &source, options, chain))
+    return 1;
+
+  if (!LoadTGATextureData(name, &tex))
+    return 0;
+  chain->bytesPerPixel = tex.bpp / 8;
+  chain->levels[0].width = tex.width;
+  chain->levels[0].height = tex.height;
+  chain->levels[0].pixels = tex.imageData;
+  BuildMipChain(chain, options);
+  if (cacheName != NULL)
+    WriteMipCache(chain, cacheName, &source, options);
+  return 1;
+}
@@ -0,0 +1,42 @@
+#ifndef mipmap_h
+#define mipmap_h
+
+#include "LoadTGA2.h"
+
+#define kMaxMipLevels 16
+
+// Options for building a mip chain
+#define kMipKaiser 0x1 // Kaiser windowed sinc filter; box filter without
+#define kMipSRGB 0x2 // Filter the color channels in linear light
+
+typedef struct
+{
+  GLint width, height;
+  GLubyte *pixels;
+} MipLevel;
+
+typedef struct
+{
+  GLint bytesPerPixel; // 3 or 4
+  GLint numLevels;
+  MipLevel levels[kMaxMipLevels]; // Level 0 is the full image
+  void *mapping; // Cache file the levels point into, or NULL
+  size_t mappingSize;
+} MipChain;
+
+// Filter levels 1 and up, down to 1x1, from level 0 of the chain. The rows
+// of each level are split over the processors.
+void BuildMipChain(MipChain *chain, unsigned int options);
+
+// Load a TGA file with its mip chain from a cache file written by an
+// earlier call with the same options, or decode, filter and write the
+// cache. A NULL cacheName skips the cache. Returns 0 on failure.
+int LoadMipChainCached(char *name, char *cacheName, unsigned int options, MipChain *chain);
+
+void FreeMipChain(MipChain *chain);
+
+// Create a texture with immutable storage for, and the pixels of, every
+// level of the chain
+GLuint UploadMipChain(MipChain *chain);
+
+#endif
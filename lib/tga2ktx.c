@@ -0,0 +1,57 @@
+// Convert TGA textures to KTX files with block compressed mip chains
+//
+// tga2ktx [-box] [-srgb] input.tga... writes input.ktx next to each input;
+// 24 bit images become BC1 and 32 bit images BC3. The mip chain is filtered
+// as the texture loader would, with the Kaiser filter unless -box. Not meant
+// for heightmaps, which are read back as data.
+
+#include "ktx.h"
+
+int main(int argc, char **argv)
+{
+  unsigned int options = kMipKaiser;
+  int i, failed = 0, files = 0;
+
+  for (i = 1; i < argc; i++)
+    {
+      MipChain chain;
+      char *out, *dot;
+
+      if (strcmp(argv[i], "-box") == 0)
+        {
+          options &= ~kMipKaiser;
+          continue;
+        }
+      if (strcmp(argv[i], "-srgb") == 0)
+        {
+          options |= kMipSRGB;
+          continue;
+        }
+
+      files++;
+      if (!LoadMipChainCached(argv[i], NULL, options, &chain))
+        {
+          failed++;
+          continue;
+        }
+      out = malloc(strlen(argv[i]) + 5);
+      strcpy(out, argv[i]);
+      dot = strrchr(out, '.');
+      if (dot != NULL && strchr(dot, '/') == NULL)
+        *dot = '\0';
+      strcat(out, ".ktx");
+      if (WriteKTX(out, &chain))
+        printf("%s: %dx%d, %d levels, %s\n", out, chain.levels[0].width, chain.levels[0].height,
+               chain.numLevels, chain.bytesPerPixel == 4 ? "BC3" : "BC1");
+      else
+        failed++;
+      FreeMipChain(&chain);
+      free(out);
+    }
+  if (files == 0)
+    {
+      fprintf(stderr, "usage: %s [-box] [-srgb] input.tga...\n", argv[0]);
+      return 2;
+    }
+  return failed > 0;
+}
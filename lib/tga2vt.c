@@ -0,0 +1,72 @@
+// Convert TGA images to tiled mip pyramids for virtual texturing
+//
+// tga2vt [-box] [-srgb] [-tile N] [-border N] input.tga... writes input.vt
+// next to each input. The mip chain is filtered as the texture loader
+// would, with the Kaiser filter unless -box. The whole image is filtered
+// in memory; only the renderer streams it by tiles.
+
+#include "vtfile.h"
+
+int main(int argc, char **argv)
+{
+  unsigned int options = kMipKaiser;
+  int tileSize = kVTTileSize, border = kVTBorder;
+  int i, failed = 0, files = 0;
+
+  for (i = 1; i < argc; i++)
+    {
+      MipChain chain;
+      VTFile vt;
+      char *out, *dot;
+
+      if (strcmp(argv[i], "-box") == 0)
+        {
+          options &= ~kMipKaiser;
+          continue;
+        }
+      if (strcmp(argv[i], "-srgb") == 0)
+        {
+          options |= kMipSRGB;
+          continue;
+        }
+      if (strcmp(argv[i], "-tile") == 0 && i + 1 < argc)
+        {
+          tileSize = atoi(argv[++i]);
+          continue;
+        }
+      if (strcmp(argv[i], "-border") == 0 && i + 1 < argc)
+        {
+          border = atoi(argv[++i]);
+          continue;
+        }
+
+      files++;
+      if (!LoadMipChainCached(argv[i], NULL, options, &chain))
+        {
+          failed++;
+          continue;
+        }
+      out = malloc(strlen(argv[i]) + 4);
+      strcpy(out, argv[i]);
+      dot = strrchr(out, '.');
+      if (dot != NULL && strchr(dot, '/') == NULL)
+        *dot = '\0';
+      strcat(out, ".vt");
+      if (WriteVTFile(out, &chain, tileSize, border) && OpenVTFile(out, &vt))
+        {
+          printf("%s: %dx%d, %d levels of %d texel tiles\n", out, vt.width, vt.height,
+                 vt.numLevels, vt.tileSize);
+          CloseVTFile(&vt);
+        }
+      else
+        failed++;
+      FreeMipChain(&chain);
+      free(out);
+    }
+  if (files == 0)
+    {
+      fprintf(stderr, "usage: %s [-box] [-srgb] [-tile N] [-border N] input.tga...\n", argv[0]);
+      return 2;
+    }
+  return failed > 0;
+}
@@ -0,0 +1,185 @@
+// Tiled mip pyramids for virtual textures
+//
+// After a header padded to a page, the tiles follow level by level, each
+// level row by row from the bottom. Every tile has the same size, so the
+// offset of any tile follows from the header without an index.
+
+#define _POSIX_C_SOURCE 200809L
+#include "vtfile.h"
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define VT_FILE_VERSION 1
+#define kVTHeaderBytes 4096
+
+typedef struct
+{
+  char magic[4]; // "CPVT"
+  uint32_t version;
+  uint32_t width, height;
+  uint32_t tileSize, border;
+  uint32_t numLevels;
+} VTHeader;
+
+// Levels, and the tiles of each, down to the first level of one tile
+static int LayOut(VTFile *vt)
+{
+  int i, width = vt->width, height = vt->height;
+  size_t tiles = 0;
+
+  for (i = 0; i < kMaxMipLevels; i++)
+    {
+      vt->pagesX[i] = (width + vt->tileSize - 1) / vt->tileSize;
+      vt->pagesY[i] = (height + vt->tileSize - 1) / vt->tileSize;
+      vt->firstTile[i] = tiles;
+      tiles += (size_t)vt->pagesX[i] * vt->pagesY[i];
+      if (vt->pagesX[i] == 1 && vt->pagesY[i] == 1)
+        return i + 1;
+      width = width > 1 ? width / 2 : 1;
+      height = height > 1 ? height / 2 : 1;
+    }
+  return 0;
+}
+
+size_t VTTileBytes(const VTFile *vt)
+{
+  size_t side = vt->tileSize + 2 * vt->border;
+  return side * side * 4;
+}
+
+const GLubyte *VTTile(const VTFile *vt, int level, int x, int y)
+{
+  return vt->tiles + (vt->firstTile[level] + (size_t)y * vt->pagesX[level] + x) * VTTileBytes(vt);
+}
+
+int WriteVTFile(char *name, const MipChain *chain, int tileSize, int border)
+{
+  static const GLubyte zeros[kVTHeaderBytes];
+  const int side = tileSize + 2 * border;
+  const int bpp = chain->bytesPerPixel;
+  VTFile vt;
+  VTHeader h;
+  GLubyte *tile;
+  FILE *f;
+  int i, ok, px, py, x, y;
+
+  memset(&vt, 0, sizeof(vt));
+  vt.width = chain->levels[0].width;
+  vt.height = chain->levels[0].height;
+  vt.tileSize = tileSize;
+  vt.border = border;
+  vt.numLevels = LayOut(&vt);
+  if (tileSize < 1 || border < 1 || vt.numLevels == 0 || vt.numLevels > chain->numLevels)
+    {
+      fprintf(stderr, "Unable to tile %s\n", name);
+      return 0;
+    }
+
+  memcpy(h.magic, "CPVT", 4);
+  h.version = VT_FILE_VERSION;
+  h.width = vt.width;
+  h.height = vt.height;
+  h.tileSize = tileSize;
+  h.border = border;
+  h.numLevels = vt.numLevels;
+
+  f = fopen(name, "wb");
+  if (f == NULL)
+    return 0;
+  ok = fwrite(&h, sizeof(h), 1, f) == 1
+    && fwrite(zeros, kVTHeaderBytes - sizeof(h), 1, f) == 1;
+  tile = malloc(VTTileBytes(&vt));
+  for (i = 0; i < vt.numLevels && ok; i++)
+    {
+      const MipLevel *l = &chain->levels[i];
+
+      for (py = 0; py < vt.pagesY[i] && ok; py++)
+        for (px = 0; px < vt.pagesX[i] && ok; px++)
+          {
+            // Borders, and tiles past the edge of the level, repeat its
+            // last texels
+            for (y = 0; y < side; y++)
+              for (x = 0; x < side; x++)
+                {
+                  int sx = px * tileSize + x - border;
+                  int sy = py * tileSize + y - border;
+                  const GLubyte *p;
+                  GLubyte *q = &tile[(y * side + x) * 4];
+
+                  sx = sx < 0 ? 0 : (sx >= l->width ? l->width - 1 : sx);
+                  sy = sy < 0 ? 0 : (sy >= l->height ? l->height - 1 : sy);
+                  p = &l->pixels[((size_t)sy * l->width + sx) * bpp];
+                  memcpy(q, p, 3);
+                  q[3] = bpp == 4 ? p[3] : 255;
+                }
+            ok = fwrite(tile, VTTileBytes(&vt), 1, f) == 1;
+          }
+    }
+  free(tile);
+  ok = (fclose(f) == 0) && ok;
+  if (!ok)
+    fprintf(stderr, "Unable to write %s\n", name);
+  return ok;
+}
+
+int OpenVTFile(char *name, VTFile *vt)
+{
+  const VTHeader *h;
+  struct stat st;
+  void *data;
+  size_t tiles;
+  int fd;
+
+  memset(vt, 0, sizeof(VTFile));
+  fd = open(name, O_RDONLY);
+  if (fd < 0)
+    {
+      printf("could not open file %s\n", name);
+      return 0;
+    }
+  if (fstat(fd, &st) != 0 || st.st_size < kVTHeaderBytes)
+    {
+      close(fd);
+      printf("could not read header of %s\n", name);
+      return 0;
+    }
+  data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED)
+    return 0;
+  h = (const VTHeader *)data;
+
+  vt->width = h->width;
+  vt->height = h->height;
+  vt->tileSize = h->tileSize;
+  vt->border = h->border;
+  if (memcmp(h->magic, "CPVT", 4) != 0 || h->version != VT_FILE_VERSION
+      || h->width < 1 || h->height < 1 || h->tileSize < 1 || h->border < 1
+      || (vt->numLevels = LayOut(vt)) == 0 || (uint32_t)vt->numLevels != h->numLevels)
+    {
+      printf("unsupported format in %s\n", name);
+      munmap(data, st.st_size);
+      return 0;
+    }
+  tiles = vt->firstTile[vt->numLevels - 1] + 1;
+  if ((size_t)st.st_size < kVTHeaderBytes + tiles * VTTileBytes(vt))
+    {
+      printf("truncated tiles in %s\n", name);
+      munmap(data, st.st_size);
+      return 0;
+    }
+  vt->tiles = (const GLubyte *)data + kVTHeaderBytes;
+  vt->mapping = data;
+  vt->mappingSize = st.st_size;
+  return 1;
+}
+
+void CloseVTFile(VTFile *vt)
+{
+  if (vt->mapping != NULL)
+    munmap(vt->mapping, vt->mappingSize);
+  memset(vt, 0, sizeof(VTFile));
+}
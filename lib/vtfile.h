@@ -0,0 +1,40 @@
+#ifndef vtfile_h
+#define vtfile_h
+
+#include "mipmap.h"
+
+// Default tile size and border of tga2vt; a tile with its border is 136
+// texels square
+#define kVTTileSize 128
+#define kVTBorder 4
+
+// Tiled mip pyramid of a virtual texture. Every level is cut into tiles of
+// tileSize texels square, each with a border of its neighbours' texels so
+// that it can be filtered on its own. Levels go down to one tile.
+typedef struct
+{
+  GLint width, height; // Texels of level 0
+  GLint tileSize, border;
+  GLint numLevels;
+  GLint pagesX[kMaxMipLevels], pagesY[kMaxMipLevels]; // Tiles of each level
+  size_t firstTile[kMaxMipLevels]; // Index of the first tile of each level
+  const GLubyte *tiles;
+  void *mapping;
+  size_t mappingSize;
+} VTFile;
+
+// Map a file written by WriteVTFile. Returns 0 on failure.
+int OpenVTFile(char *name, VTFile *vt);
+void CloseVTFile(VTFile *vt);
+
+// Bytes of one RGBA tile with its border
+size_t VTTileBytes(const VTFile *vt);
+
+// Tile x, y of a level, RGBA with rows from the bottom. Touching it reads
+// it from disk, so the streaming thread does that.
+const GLubyte *VTTile(const VTFile *vt, int level, int x, int y);
+
+// Cut the levels of a chain into tiles. Returns 0 on failure.
+int WriteVTFile(char *name, const MipChain *chain, int tileSize, int border);
+
+#endif
@@ -117,7 +117,9 @@ namespace CPGL {
 
         void BaseElement::DRAW() {
             if(!parent) invalidate_cache = false;
+            stats::clock::time_point start = stats::clock::now();
             draw();
+            stats::element_drawn(this, std::chrono::duration<float, std::milli>(stats::clock::now() - start).count());
             for(basemap::iterator it = children.begin(); it != children.end(); ++it) {
                 (*it)->DRAW();
             }
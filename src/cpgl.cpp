@@ -24,6 +24,8 @@
 #include <dlfcn.h>
 #include "yaml-cpp/yaml.h"
 #include "Window.hpp"
+#include "stats.hpp"
+#include "streaming.hpp"
 
 namespace CPGL {
     using namespace core;
@@ -42,6 +44,8 @@ namespace CPGL {
 
     void init(int& argc, char* argv[], const YAML::Node& c, window_handle_callback_t wincb) {
         config = c;
+        stats::configure(config["monitor"]);
+        streaming::configure(config["textures"]);
         glut::init(argc, argv, start, wincb);
     }
 
@@ -23,6 +23,8 @@
 #include <boost/bind.hpp>
 #include "types.hpp"
 #include "Window.hpp"
+#include "stats.hpp"
+#include "streaming.hpp"
 
 namespace CPGL {
     namespace glut {
@@ -100,8 +102,15 @@ namespace CPGL {
 
             glutmap::iterator w = windows.find(window);
             if(w == windows.end()) return;
+            stats::begin_frame();
             w->second->DRAW();
-            glutSwapBuffers();//glutPostRedisplay();
+            stats::end_draw();
+            streaming::update();
+            {
+                stats::Scope s("glutSwapBuffers");
+                glutSwapBuffers();//glutPostRedisplay();
+            }
+            stats::end_frame();
         }
         void reshape(int w, int h) {
             //~ std::cout << "reshape" << std::endl;
@@ -4,6 +4,7 @@
 #include <CL/opencl.h>
 #include "opencl.hpp"
 #include <vector>
+#include <algorithm>
 #include <fstream>
 #include "yaml-cpp/yaml.h"
 
@@ -57,6 +58,35 @@ namespace CPGL {
 
             // Choose the first device
             deviceUsed = 0;
+
+            profiling = config["opencl"]["profiling"].as<bool>(false);
+        }
+
+        void Host::record_profile(const std::string& kernel_name, cl_event event) {
+            cl_ulong queued, submit, start, end;
+            clGetEventProfilingInfo(event, CL_PROFILING_COMMAND_QUEUED, sizeof(cl_ulong), &queued, NULL);
+            clGetEventProfilingInfo(event, CL_PROFILING_COMMAND_SUBMIT, sizeof(cl_ulong), &submit, NULL);
+            clGetEventProfilingInfo(event, CL_PROFILING_COMMAND_START, sizeof(cl_ulong), &start, NULL);
+            error_code = clGetEventProfilingInfo(event, CL_PROFILING_COMMAND_END, sizeof(cl_ulong), &end, NULL);
+            if(error_code != CL_SUCCESS) return;
+
+            KernelProfile& p = profiles[kernel_name];
+            ++p.count;
+            p.total_ns += end - start;
+            p.max_ns = std::max(p.max_ns, end - start);
+            p.queue_ns += start - queued;
+            p.max_queue_ns = std::max(p.max_queue_ns, start - queued);
+            p.submit_ns += submit - queued;
+        }
+
+        void Host::print_profile(std::ostream& out) const {
+            for(profile_map::const_iterator it = profiles.begin(); it != profiles.end(); ++it) {
+                const KernelProfile& p = it->second;
+                out << it->first << ": " << p.count << " launches, "
+                    << p.mean_ms() << " ms mean, " << p.max_ms() << " ms max, queue latency "
+                    << p.mean_queue_ms() << " ms mean, " << p.max_queue_ms() << " ms max ("
+                    << p.mean_submit_ms() << " ms to submit)" << std::endl;
+            }
         }
 
         Host::Host() {
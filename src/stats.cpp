@@ -0,0 +1,172 @@
+/**
+ * Copyright 2012 Jonatan Olofsson
+ *
+ * This file is part of C++ GL Framework (CPGL).
+ *
+ * CPGL is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * CPGL is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with CPGL.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "stats.hpp"
+#include "BaseElement.hpp"
+#include <algorithm>
+#include <cstdio>
+#include <unistd.h>
+
+namespace CPGL {
+    namespace stats {
+        static const size_t MAX_CALLS = 8;
+
+        clock::time_point frame_start;
+        FrameStats current, last;
+
+        // Slowest element and calls of the frame being drawn, and of the last one
+        struct Attribution {
+            core::BaseElement* element;
+            float element_ms;
+            std::vector<Call> calls;
+        };
+        Attribution drawing, drawn;
+
+        float budget = 33.3;
+        float bin = 1.0;
+        std::vector<unsigned long> bins(100, 0);
+        boost::circular_buffer<Stutter> log(64);
+        unsigned long stutter_total = 0;
+
+        static float ms_between(const clock::time_point& a, const clock::time_point& b) {
+            return std::chrono::duration<float, std::milli>(b - a).count();
+        }
+
+        void configure(const YAML::Node& c) {
+            budget = c["budget_ms"].as<float>(budget);
+            // At least one bin, of positive width, for record to index
+            bin = c["bin_ms"].as<float>(bin);
+            if(!(bin > 0)) bin = 1.0;
+            bins.assign(std::max(1, c["bins"].as<int>(bins.size())), 0);
+            log.set_capacity(c["log_size"].as<int>(log.capacity()));
+        }
+
+        static void record(const unsigned long frame, const float ms) {
+            size_t b = std::min(size_t(ms / bin), bins.size() - 1);
+            ++bins[b];
+            if(ms <= budget) return;
+
+            ++stutter_total;
+            Stutter s;
+            s.frame = frame;
+            s.frame_ms = ms;
+            s.element_ms = drawn.element_ms;
+            if(drawn.element) {
+                s.element = drawn.element->id.empty() ? drawn.element->config["type"].as<std::string>("") : drawn.element->id;
+            }
+            s.calls = drawn.calls;
+            log.push_back(s);
+        }
+
+        void begin_frame() {
+            clock::time_point now = clock::now();
+            if(current.frame > 0) {
+                current.frame_ms = ms_between(frame_start, now);
+                record(current.frame - 1, current.frame_ms);
+            }
+            frame_start = now;
+            resetDrawStats();
+            drawing.element = NULL;
+            drawing.element_ms = 0;
+            drawing.calls.clear();
+        }
+
+        void end_draw() {
+            current.draw_ms = ms_between(frame_start, clock::now());
+        }
+
+        void end_frame() {
+            current.draw = drawStats;
+            // Reading /proc is cheap, but not every frame
+            if(current.frame % 30 == 0) current.resident_kb = resident_memory_kb();
+            last = current;
+            ++current.frame;
+            std::swap(drawn, drawing);
+        }
+
+        const FrameStats& last_frame() {
+            return last;
+        }
+
+        void element_drawn(core::BaseElement* element, float ms) {
+            if(ms > drawing.element_ms) {
+                drawing.element = element;
+                drawing.element_ms = ms;
+            }
+        }
+
+        Scope::Scope(const char* n) : name(n), start(clock::now()) {}
+
+        Scope::~Scope() {
+            clock::time_point end = clock::now();
+            Call call = {name, ms_between(frame_start, start), ms_between(start, end)};
+            std::vector<Call>& calls = drawing.calls;
+            if(calls.size() < MAX_CALLS) {
+                calls.push_back(call);
+                return;
+            }
+            // Keep the slowest calls only
+            std::vector<Call>::iterator fastest = calls.begin();
+            for(std::vector<Call>::iterator it = calls.begin(); it != calls.end(); ++it) {
+                if(it->ms < fastest->ms) fastest = it;
+            }
+            if(fastest->ms < call.ms) *fastest = call;
+        }
+
+        float budget_ms() {
+            return budget;
+        }
+
+        float bin_ms() {
+            return bin;
+        }
+
+        const std::vector<unsigned long>& histogram() {
+            return bins;
+        }
+
+        const boost::circular_buffer<Stutter>& stutters() {
+            return log;
+        }
+
+        unsigned long stutter_count() {
+            return stutter_total;
+        }
+
+        void print_stutters(std::ostream& out) {
+            out << stutter_total << " frames over the " << budget << " ms budget, last " << log.size() << ":" << std::endl;
+            for(boost::circular_buffer<Stutter>::const_iterator s = log.begin(); s != log.end(); ++s) {
+                out << "  frame " << s->frame << ": " << s->frame_ms << " ms, slowest element '"
+                    << s->element << "' " << s->element_ms << " ms" << std::endl;
+                for(std::vector<Call>::const_iterator c = s->calls.begin(); c != s->calls.end(); ++c) {
+                    out << "    " << c->name << " " << c->ms << " ms at +" << c->start_ms << " ms" << std::endl;
+                }
+            }
+        }
+
+        long resident_memory_kb() {
+            long pages = 0;
+            FILE* f = fopen("/proc/self/statm", "r");
+            if(f == NULL) return 0;
+            if(fscanf(f, "%*s %ld", &pages) != 1) pages = 0;
+            fclose(f);
+            return pages * (sysconf(_SC_PAGESIZE) / 1024);
+        }
+    }
+}
@@ -0,0 +1,319 @@
+/**
+ * Copyright 2012 Jonatan Olofsson
+ *
+ * This file is part of C++ GL Framework (CPGL).
+ *
+ * CPGL is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * CPGL is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with CPGL.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "streaming.hpp"
+#include "virtual_texture.hpp"
+#include "tools.hpp"
+#include "stats.hpp"
+#include <boost/thread.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/condition_variable.hpp>
+#include <algorithm>
+#include <deque>
+#include <vector>
+#include <cstring>
+#include <iostream>
+
+namespace CPGL {
+    namespace streaming {
+        struct Request {
+            GLuint texture;
+            std::string path;
+            std::string cache;
+            bool mipmaps;
+            GLint layer;    // Of a texture array, or -1
+        };
+
+        // A decoded image and how far its upload has come
+        struct Image {
+            GLuint texture;
+            GLenum format;
+            GLenum internal_format;
+            int bytes_per_pixel;
+            MipChain chain;
+            int level;  // Level being uploaded, counting down to 0
+            int row;    // First row of it not yet uploaded
+            GLint layer;
+            bool allocated;
+        };
+
+        struct Staging {
+            GLuint buffer;
+            size_t size;
+            GLsync fence;
+        };
+
+        int workers = 2;
+        size_t upload_bytes = 1024 * 1024;
+        size_t staging_count = 4;
+        size_t staging_bytes = 256 * 1024;
+
+        // Shared with the workers
+        boost::mutex queue_mutex;
+        boost::condition_variable queue_ready;
+        std::deque<Request> requests;
+        std::deque<Image> decoded;
+        bool stopping = false;
+        unsigned int options = 0;   // Set before the workers start
+
+        // Owned by the GL thread
+        std::deque<Image> uploads;
+        std::vector<Staging> ring;
+        size_t ring_next = 0;
+        size_t requested = 0;
+
+        void configure(const YAML::Node& c) {
+            workers = std::max(1, c["workers"].as<int>(workers));
+            upload_bytes = c["upload_kb"].as<size_t>(upload_bytes / 1024) * 1024;
+            staging_count = std::max(1, c["staging_buffers"].as<int>(staging_count));
+            staging_bytes = c["staging_kb"].as<size_t>(staging_bytes / 1024) * 1024;
+        }
+
+        static void decode(const Request& request, const unsigned int options) {
+            TextureData tex;
+            Image image;
+            image.texture = request.texture;
+            image.layer = request.layer;
+            image.row = 0;
+            image.allocated = false;
+            memset(&image.chain, 0, sizeof(MipChain));
+            if(request.mipmaps) {
+                LoadMipChainCached(
+                    const_cast<char*>(request.path.c_str()),
+                    request.cache.empty() ? NULL : const_cast<char*>(request.cache.c_str()),
+                    options, &image.chain);
+            } else if(LoadTGATextureData(const_cast<char*>(request.path.c_str()), &tex)) {
+                image.chain.bytesPerPixel = tex.bpp / 8;
+                image.chain.numLevels = 1;
+                image.chain.levels[0].width = tex.width;
+                image.chain.levels[0].height = tex.height;
+                image.chain.levels[0].pixels = tex.imageData;
+            }
+            if(image.chain.numLevels == 0) {
+                std::cerr << "Failed to load texture: " << request.path << std::endl;
+            }
+            image.bytes_per_pixel = image.chain.bytesPerPixel;
+            image.format = (image.bytes_per_pixel == 3 ? GL_RGB : GL_RGBA);
+            image.internal_format = (image.bytes_per_pixel == 3 ? GL_RGB8 : GL_RGBA8);
+            image.level = image.chain.numLevels - 1;
+
+            boost::mutex::scoped_lock lock(queue_mutex);
+            decoded.push_back(image);
+        }
+
+        static void work() {
+            for(;;) {
+                Request request;
+                {
+                    boost::mutex::scoped_lock lock(queue_mutex);
+                    while(requests.empty() && !stopping) queue_ready.wait(lock);
+                    if(stopping) return;
+                    request = requests.front();
+                    requests.pop_front();
+                }
+                decode(request, options);
+            }
+        }
+
+        // Started with the first request; joined at exit
+        struct Pool {
+            boost::thread_group threads;
+            ~Pool() {
+                {
+                    boost::mutex::scoped_lock lock(queue_mutex);
+                    stopping = true;
+                }
+                queue_ready.notify_all();
+                threads.join_all();
+            }
+        };
+        Pool pool;
+
+        static void queue(const Request& request) {
+            if(pool.threads.size() == 0) {
+                options = tools::texture_options();
+                for(int i = 0; i < workers; ++i) pool.threads.create_thread(work);
+            }
+            {
+                boost::mutex::scoped_lock lock(queue_mutex);
+                requests.push_back(request);
+            }
+            queue_ready.notify_one();
+            ++requested;
+        }
+
+        GLuint load_texture(const std::string path, const bool create_mipmaps, const std::string cache) {
+            static const GLubyte grey[4] = {128, 128, 128, 255};
+            GLuint tex;
+            glGenTextures(1, &tex);
+            glBindTexture(GL_TEXTURE_2D, tex);
+            glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, 1, 1, 0, GL_RGBA, GL_UNSIGNED_BYTE, grey);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, 0);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, create_mipmaps ? GL_LINEAR_MIPMAP_LINEAR : GL_LINEAR);
+
+            Request request = {tex, path, cache, create_mipmaps, -1};
+            queue(request);
+            return tex;
+        }
+
+        void load_texture_layer(const GLuint array, const GLint layer, const std::string path, const std::string cache) {
+            Request request = {array, path, cache, true, layer};
+            queue(request);
+        }
+
+        size_t pending() {
+            return requested;
+        }
+
+        // Allocate every level of a mipmapped image. The coarsest one is
+        // tiny and given its pixels right away, so the texture stays complete
+        // while the finer levels are streamed outside the base level.
+        static void allocate(Image& image) {
+            const int n = image.chain.numLevels;
+            glBindTexture(GL_TEXTURE_2D, image.texture);
+            for(int i = 0; i < n; ++i) {
+                const MipLevel& l = image.chain.levels[i];
+                glTexImage2D(GL_TEXTURE_2D, i, image.internal_format, l.width, l.height, 0, image.format, GL_UNSIGNED_BYTE,
+                    i == n - 1 ? l.pixels : NULL);
+            }
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, n - 1);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_BASE_LEVEL, n - 1);
+            --image.level;
+            image.allocated = true;
+        }
+
+        // Upload the next rows of an image through one staging buffer.
+        // Returns the bytes used, or 0 when the ring has no free buffer.
+        static size_t upload(Image& image, size_t budget) {
+            const MipLevel& l = image.chain.levels[image.level];
+            const size_t row_bytes = l.width * image.bytes_per_pixel;
+            const bool whole = (image.chain.numLevels == 1 && image.layer < 0);
+            int rows = l.height - image.row;
+            if(!whole) {
+                // Levels outside the base level may arrive in slices
+                rows = std::min<size_t>(rows, std::max<size_t>(1, std::min(budget, staging_bytes) / row_bytes));
+            }
+            const size_t bytes = rows * row_bytes;
+
+            Staging& s = ring[ring_next];
+            if(s.fence) {
+                if(glClientWaitSync(s.fence, 0, 0) == GL_TIMEOUT_EXPIRED) return 0;
+                glDeleteSync(s.fence);
+                s.fence = 0;
+            }
+            glBindBuffer(GL_PIXEL_UNPACK_BUFFER, s.buffer);
+            if(bytes > s.size) {
+                s.size = bytes;
+                glBufferData(GL_PIXEL_UNPACK_BUFFER, s.size, NULL, GL_STREAM_DRAW);
+            }
+            void* dst = glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, bytes, GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT);
+            if(dst == NULL) {
+                glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+                return 0;
+            }
+            memcpy(dst, l.pixels + image.row * row_bytes, bytes);
+            glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+
+            if(image.layer >= 0) {
+                // Array storage is shared, so leave the caller's binding be
+                GLint bound;
+                glGetIntegerv(GL_TEXTURE_BINDING_2D_ARRAY, &bound);
+                glBindTexture(GL_TEXTURE_2D_ARRAY, image.texture);
+                glTexSubImage3D(GL_TEXTURE_2D_ARRAY, image.level, 0, image.row, image.layer, l.width, rows, 1, image.format, GL_UNSIGNED_BYTE, 0);
+                glBindTexture(GL_TEXTURE_2D_ARRAY, bound);
+            } else {
+                glBindTexture(GL_TEXTURE_2D, image.texture);
+                if(whole) {
+                    // Without mip levels the placeholder is replaced in one go
+                    glTexImage2D(GL_TEXTURE_2D, 0, image.internal_format, l.width, l.height, 0, image.format, GL_UNSIGNED_BYTE, 0);
+                } else {
+                    glTexSubImage2D(GL_TEXTURE_2D, image.level, 0, image.row, l.width, rows, image.format, GL_UNSIGNED_BYTE, 0);
+                }
+            }
+            s.fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+            glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+            ring_next = (ring_next + 1) % ring.size();
+
+            image.row += rows;
+            if(image.row == l.height) {
+                // The level is whole; sample from it from the next frame on
+                if(image.layer < 0) glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_BASE_LEVEL, image.level);
+                --image.level;
+                image.row = 0;
+            }
+            return bytes;
+        }
+
+        void update() {
+            update_virtual_textures();
+            if(requested == 0) return;
+            stats::Scope s("texture uploads");
+            {
+                boost::mutex::scoped_lock lock(queue_mutex);
+                while(!decoded.empty()) {
+                    uploads.push_back(decoded.front());
+                    decoded.pop_front();
+                }
+            }
+
+            if(ring.empty()) {
+                ring.resize(staging_count);
+                for(size_t i = 0; i < ring.size(); ++i) {
+                    glGenBuffers(1, &ring[i].buffer);
+                    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, ring[i].buffer);
+                    glBufferData(GL_PIXEL_UNPACK_BUFFER, staging_bytes, NULL, GL_STREAM_DRAW);
+                    ring[i].size = staging_bytes;
+                    ring[i].fence = 0;
+                }
+                glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+            }
+
+            GLint alignment;
+            glGetIntegerv(GL_UNPACK_ALIGNMENT, &alignment);
+            glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+
+            // The first upload of a frame always goes, however large
+            size_t spent = 0;
+            bool first = true;
+            while(!uploads.empty() && (first || spent < upload_bytes)) {
+                Image& image = uploads.front();
+                if(image.chain.numLevels == 0) {
+                    // Failed to decode; keep the placeholder
+                    uploads.pop_front();
+                    --requested;
+                    continue;
+                }
+                if(!image.allocated && image.chain.numLevels > 1 && image.layer < 0) allocate(image);
+
+                if(image.level >= 0) {
+                    size_t bytes = upload(image, first ? upload_bytes : upload_bytes - spent);
+                    if(bytes == 0) break;
+                    spent += bytes;
+                    first = false;
+                }
+                if(image.level < 0) {
+                    FreeMipChain(&image.chain);
+                    uploads.pop_front();
+                    --requested;
+                }
+            }
+            glPixelStorei(GL_UNPACK_ALIGNMENT, alignment);
+        }
+    }
+}
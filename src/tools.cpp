@@ -20,11 +20,19 @@
 #include "yaml-cpp/yaml.h"
 #include "tools.hpp"
 #include "GL_utilities.h"
+#include "stats.hpp"
+#include "streaming.hpp"
 #include <iostream>
+#include <cmath>
+#include <algorithm>
+#include <cstring>
+#include <map>
+#include <vector>
 
 #include <string>
 #include <fstream>
 #include <streambuf>
+#include <sys/stat.h>
 
 namespace CPGL {
     extern YAML::Node config;
@@ -58,6 +66,24 @@ namespace CPGL {
             printProgramInfoLog(p);
             return p;
         }
+        GLuint load_shaders(const std::string module, const std::string vs, const std::string fs, const GLuint library) {
+            std::string path =
+                config["directories"]["root"].as<std::string>("")
+                + config["directories"]["element_files"].as<std::string>("")
+                + module + "/"
+                + config["directories"]["shaders"].as<std::string>("");
+
+            std::cout << "Loading shaders: " <<  path << std::endl;
+
+            GLuint p = glCreateProgram();
+            glAttachShader(p,compile_shader(GL_VERTEX_SHADER, path + vs));
+            glAttachShader(p,compile_shader(GL_FRAGMENT_SHADER, path + fs));
+            glAttachShader(p,library);
+            glLinkProgram(p);
+            glUseProgram(p);
+            printProgramInfoLog(p);
+            return p;
+        }
         GLuint load_shaders(const std::string module, const std::string vs, const std::string gs, const std::string fs) {
             std::string path =
                 config["directories"]["root"].as<std::string>("")
@@ -77,62 +103,363 @@ namespace CPGL {
             return p;
         }
 
+        VertexFormat vertex_format(const char* position, const char* normal, const char* texcoord) {
+            const int compact = config["mesh_compact"].as<bool>(true) ? kVertexCompact : kVertexFloat;
+            const VertexAttrib attribs[] = {
+                {kVertexPosition, position, kVertexFloat},
+                {kVertexNormal, normal, compact},
+                {kVertexTexCoord, texcoord, compact}
+            };
+            VertexFormat format;
+            format.numAttribs = 0;
+            for(int i = 0; i < 3; ++i) {
+                if(attribs[i].name) format.attribs[format.numAttribs++] = attribs[i];
+            }
+            return format;
+        }
+
         Model* load_model(
             const std::string module,
             const std::string name,
             const GLuint program,
             const std::string vertexVariableName,
             const std::string normalVariableName,
-            const std::string texCoordVariableName)
+            const std::string texCoordVariableName,
+            const std::string residency)
         {
-            std::string path =
-                config["directories"]["root"].as<std::string>("")
+            VertexFormat format = vertex_format(
+                vertexVariableName.c_str(),
+                normalVariableName.c_str(),
+                texCoordVariableName.c_str());
+            return load_model(module, name, program, format, residency);
+        }
+
+        Model* load_model(
+            const std::string module,
+            const std::string name,
+            const GLuint program,
+            const VertexFormat& format,
+            const std::string residency)
+        {
+            std::string path = model_path(module, name);
+                std::cout << "Loading model: " <<  path << std::endl;
+            stats::Scope s("load_model");
+
+            Model* m;
+            unsigned int options = model_options();
+            if(config["mesh_cache"].as<bool>(true)) {
+                std::string cache = model_cache_path(module, name, path);
+                m = LoadModelCached(const_cast<char*>(path.c_str()), const_cast<char*>(cache.c_str()), options);
+            } else {
+                m = LoadModel(const_cast<char*>(path.c_str()));
+                if(m != NULL) OptimizeModel(m, options);
+            }
+            if(m == NULL) return m;
+
+            UploadModelInterleaved(m, program, &format);
+            std::string policy = residency.empty() ? config["mesh_residency"].as<std::string>("drop") : residency;
+            if(policy == "drop") {
+                ReleaseModelArrays(m);
+            } else if(policy != "keep") {
+                std::cerr << "Unknown mesh residency: " << policy << std::endl;
+            }
+            return m;
+        }
+
+        bool fetch_model(const std::string module, const std::string name, Model* m) {
+            if(m->vertexArray != NULL) return true;
+            stats::Scope s("fetch_model");
+            std::string path = model_path(module, name);
+            if(config["mesh_cache"].as<bool>(true)) {
+                std::string cache = model_cache_path(module, name, path);
+                return RefetchModelArrays(m, const_cast<char*>(path.c_str()), const_cast<char*>(cache.c_str()), model_options());
+            }
+            return RefetchModelArrays(m, const_cast<char*>(path.c_str()), NULL, model_options());
+        }
+
+        void draw_model(Model* m, const float* modelview, const float* projection) {
+            int lod = select_lod(m, modelview, projection);
+            if(lod == 0 && m->numMeshlets > 0) {
+                DrawModelMeshlets(m, modelview, projection, config["mesh_meshlet_cones"].as<bool>(false));
+            } else {
+                DrawModelLod(m, lod);
+            }
+        }
+
+        std::string model_path(const std::string module, const std::string name) {
+            return config["directories"]["root"].as<std::string>("")
                 + config["directories"]["element_files"].as<std::string>("")
                 + module + "/"
                 + config["directories"]["models"].as<std::string>("")
                 + name;
-                std::cout << "Loading model: " <<  path << std::endl;
+        }
 
-            return LoadModelPlus(
-                const_cast<char*>(path.c_str()),
-                program,
-                const_cast<char*>(vertexVariableName.c_str()),
-                const_cast<char*>(normalVariableName.c_str()),
-                const_cast<char*>(texCoordVariableName.c_str())
-            );
+        unsigned int model_options() {
+            unsigned int options = 0;
+            if(config["mesh_optimize"].as<bool>(true)) options |= kModelOptimizeVertexCache;
+            if(config["mesh_overdraw"].as<bool>(false)) options |= kModelOptimizeOverdraw;
+            if(config["mesh_lods"].as<bool>(false)) options |= kModelLods;
+            if(config["mesh_meshlets"].as<bool>(false)) options |= kModelMeshlets;
+            return options;
         }
 
-        GLuint load_texture(const std::string module, const std::string texture, const GLuint which_tex, const bool create_mipmaps) {
-            glActiveTexture(which_tex);
-            GLuint tex;
-            std::string path =
-                config["directories"]["root"].as<std::string>("")
+        int select_lod(const Model* m, const float* modelview, const float* projection) {
+            if(m->numLods < 2) return 0;
+
+            // Distance to the bounding sphere, and the largest scale of the model
+            float distance = -(modelview[2] * m->center[0] + modelview[6] * m->center[1]
+                + modelview[10] * m->center[2] + modelview[14]);
+            float scale = 0;
+            for(int i = 0; i < 3; ++i) {
+                scale = std::max(scale, std::sqrt(modelview[4*i] * modelview[4*i]
+                    + modelview[4*i+1] * modelview[4*i+1] + modelview[4*i+2] * modelview[4*i+2]));
+            }
+            if(distance <= m->radius * scale) return 0;
+
+            GLint viewport[4];
+            glGetIntegerv(GL_VIEWPORT, viewport);
+            float pixels_per_unit = scale * projection[5] * viewport[3] / 2 / distance;
+            return SelectModelLod(const_cast<Model*>(m), pixels_per_unit, config["lod_pixels"].as<float>(1.0));
+        }
+
+        std::string model_cache_path(const std::string module, const std::string name, const std::string path) {
+            if(config["directories"]["cache"]) {
+                return config["directories"]["root"].as<std::string>("")
+                    + config["directories"]["cache"].as<std::string>()
+                    + module + "_" + name + ".mesh";
+            }
+            return path + ".mesh";
+        }
+
+        std::string texture_path(const std::string module, const std::string texture) {
+            return config["directories"]["root"].as<std::string>("")
                 + config["directories"]["element_files"].as<std::string>("")
                 + module + "/"
                 + config["directories"]["textures"].as<std::string>("")
                 + texture;
+        }
+
+        std::string texture_cache_path(const std::string module, const std::string texture, const std::string path) {
+            if(!config["texture_cache"].as<bool>(true)) return "";
+            if(config["directories"]["cache"]) {
+                return config["directories"]["root"].as<std::string>("")
+                    + config["directories"]["cache"].as<std::string>()
+                    + module + "_" + texture + ".mips";
+            }
+            return path + ".mips";
+        }
+
+        unsigned int texture_options() {
+            unsigned int options = 0;
+            if(config["texture_filter"].as<std::string>("kaiser") == "kaiser") options |= kMipKaiser;
+            if(config["texture_srgb"].as<bool>(false)) options |= kMipSRGB;
+            return options;
+        }
+
+        std::string compressed_path(const std::string path) {
+            const size_t dot = path.rfind('.');
+            if(dot != std::string::npos && path.compare(dot, std::string::npos, ".ktx") == 0) return path;
+            if(!config["texture_ktx"].as<bool>(true) || dot == std::string::npos) return "";
+
+            // Prefer a converted KTX file, unless the image is newer
+            std::string ktx = path.substr(0, dot) + ".ktx";
+            struct stat image, compressed;
+            if(stat(ktx.c_str(), &compressed) != 0) return "";
+            if(stat(path.c_str(), &image) == 0 && image.st_mtime > compressed.st_mtime) return "";
+            return ktx;
+        }
+
+        bool load_mip_chain(const std::string module, const std::string texture, MipChain* chain) {
+            std::string path = texture_path(module, texture);
+            // Only when asked for by name; image data must not be lossy by surprise
+            if(compressed_path(path) == path) {
+                KTXTexture file;
+                if(!LoadKTX(const_cast<char*>(path.c_str()), &file)) return false;
+                DecodeKTX(&file, chain);
+                FreeKTX(&file);
+                return true;
+            }
+            std::string cache = texture_cache_path(module, texture, path);
+            return LoadMipChainCached(
+                const_cast<char*>(path.c_str()),
+                cache.empty() ? NULL : const_cast<char*>(cache.c_str()),
+                texture_options(), chain);
+        }
+
+        GLuint load_texture(const std::string module, const std::string texture, const GLuint which_tex, const bool create_mipmaps) {
+            glActiveTexture(which_tex);
+            GLuint tex = 0;
+            std::string path = texture_path(module, texture);
             std::cout << "Loading texture: " <<  path << std::endl;
+            stats::Scope s("load_texture");
 
-            LoadTGATextureSimple(const_cast<char*>(path.c_str()), &tex);
-            if(create_mipmaps) generate_mipmaps(tex);
+            std::string ktx = compressed_path(path);
+            if(!ktx.empty()) {
+                KTXTexture file;
+                if(LoadKTX(const_cast<char*>(ktx.c_str()), &file)) {
+                    tex = UploadKTX(&file);
+                    FreeKTX(&file);
+                }
+            } else if(create_mipmaps) {
+                MipChain chain;
+                if(load_mip_chain(module, texture, &chain)) {
+                    tex = UploadMipChain(&chain);
+                    FreeMipChain(&chain);
+                }
+            } else {
+                LoadTGATextureSimple(const_cast<char*>(path.c_str()), &tex);
+            }
             return tex;
         }
 
         TextureData load_texture_struct(const std::string module, const std::string texture, const bool create_mipmaps) {
             TextureData tex;
-            std::string path =
-                config["directories"]["root"].as<std::string>("")
-                + config["directories"]["element_files"].as<std::string>("")
-                + module + "/"
-                + config["directories"]["textures"].as<std::string>("")
-                + texture;
+            std::string path = texture_path(module, texture);
             std::cout << "Loading texture struct: " <<  path << std::endl;
+            stats::Scope s("load_texture_struct");
 
-            LoadTGATexture(const_cast<char*>(path.c_str()), &tex);
-            if(create_mipmaps) generate_mipmaps(tex.texID);
+            MipChain chain;
+            const bool compressed = compressed_path(path) == path;
+            if(!(create_mipmaps || compressed) || !load_mip_chain(module, texture, &chain)) {
+                LoadTGATexture(const_cast<char*>(path.c_str()), &tex);
+                return tex;
+            }
+            // The caller owns the image, which may be mapped from the cache
+            const MipLevel& image = chain.levels[0];
+            size_t size = image.width * image.height * chain.bytesPerPixel;
+            tex.imageData = (GLubyte*)malloc(size);
+            memcpy(tex.imageData, image.pixels, size);
+            tex.bpp = chain.bytesPerPixel * 8;
+            tex.width = image.width;
+            tex.height = image.height;
+            tex.texWidth = tex.texHeight = 1.0;
+            tex.texID = UploadMipChain(&chain);
+            FreeMipChain(&chain);
             return tex;
         }
 
+        GLuint load_texture_async(const std::string module, const std::string texture, const bool create_mipmaps) {
+            std::string path = texture_path(module, texture);
+            // Compressed files need no decoding, so load them at once
+            if(!compressed_path(path).empty()) return load_texture(module, texture, GL_TEXTURE0, create_mipmaps);
+            std::cout << "Streaming texture: " <<  path << std::endl;
+            return streaming::load_texture(path, create_mipmaps, texture_cache_path(module, texture, path));
+        }
+
+        struct TextureArray {
+            GLuint texture;
+            GLint used;
+        };
+        typedef std::map<std::pair<GLuint, GLuint>, std::vector<TextureArray> > texture_array_map;
+        typedef std::map<std::string, TextureLayer> texture_layer_map;
+        texture_array_map texture_arrays;
+        texture_layer_map texture_layers;
+        std::vector<GLuint> bound_arrays;   // By texture unit
+
+        static GLint mip_levels(GLuint width, GLuint height) {
+            GLint levels = 1;
+            for(GLuint size = std::max(width, height); size > 1 && levels < kMaxMipLevels; size >>= 1) ++levels;
+            return levels;
+        }
+
+        static void upload_layer(const TextureLayer& layer, const MipChain& chain) {
+            GLint alignment;
+            glGetIntegerv(GL_UNPACK_ALIGNMENT, &alignment);
+            glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+            glBindTexture(GL_TEXTURE_2D_ARRAY, layer.texture);
+            for(int i = 0; i < chain.numLevels; ++i) {
+                const MipLevel& l = chain.levels[i];
+                glTexSubImage3D(GL_TEXTURE_2D_ARRAY, i, 0, 0, layer.layer, l.width, l.height, 1,
+                    chain.bytesPerPixel == 3 ? GL_RGB : GL_RGBA, GL_UNSIGNED_BYTE, l.pixels);
+            }
+            glPixelStorei(GL_UNPACK_ALIGNMENT, alignment);
+            bound_arrays.clear();
+        }
+
+        // A free layer among the arrays of a size, or a new array. Arrays
+        // are RGBA8, so that RGB and RGBA textures may share them.
+        static TextureLayer allocate_layer(GLuint width, GLuint height) {
+            std::vector<TextureArray>& arrays = texture_arrays[std::make_pair(width, height)];
+            GLint capacity = config["texture_layers"].as<GLint>(16), max_layers;
+            glGetIntegerv(GL_MAX_ARRAY_TEXTURE_LAYERS, &max_layers);
+            capacity = std::max(1, std::min(capacity, max_layers));
+            const GLint levels = mip_levels(width, height);
+
+            if(arrays.empty() || arrays.back().used == capacity) {
+                TextureArray array = {0, 0};
+                glGenTextures(1, &array.texture);
+                glBindTexture(GL_TEXTURE_2D_ARRAY, array.texture);
+                if(HasTextureStorage()) {
+                    glTexStorage3D(GL_TEXTURE_2D_ARRAY, levels, GL_RGBA8, width, height, capacity);
+                } else {
+                    for(GLint i = 0; i < levels; ++i) {
+                        glTexImage3D(GL_TEXTURE_2D_ARRAY, i, GL_RGBA8, std::max(1u, width >> i), std::max(1u, height >> i),
+                            capacity, 0, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+                    }
+                    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAX_LEVEL, levels - 1);
+                }
+                glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+                glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+                arrays.push_back(array);
+            }
+            TextureLayer layer = {arrays.back().texture, arrays.back().used++, {1.0f, 1.0f, 0.0f, 0.0f}};
+
+            // Grey until streamed, every level reading the same pixels
+            std::vector<GLubyte> grey(width * height * 4, 128);
+            for(size_t i = 3; i < grey.size(); i += 4) grey[i] = 255;
+            MipChain chain;
+            memset(&chain, 0, sizeof(chain));
+            chain.bytesPerPixel = 4;
+            chain.numLevels = levels;
+            for(GLint i = 0; i < levels; ++i) {
+                chain.levels[i].width = std::max(1u, width >> i);
+                chain.levels[i].height = std::max(1u, height >> i);
+                chain.levels[i].pixels = &grey[0];
+            }
+            upload_layer(layer, chain);
+            return layer;
+        }
+
+        TextureLayer load_texture_layer(const std::string module, const std::string texture) {
+            std::string path = texture_path(module, texture);
+            texture_layer_map::iterator found = texture_layers.find(path);
+            if(found != texture_layers.end()) return found->second;
+            std::cout << "Loading texture layer: " <<  path << std::endl;
+            stats::Scope s("load_texture_layer");
+
+            TextureLayer layer = {0, 0, {1.0f, 1.0f, 0.0f, 0.0f}};
+            if(compressed_path(path) == path) {
+                // Decoded at once; compressed and RGBA8 layers cannot share arrays
+                MipChain chain;
+                if(load_mip_chain(module, texture, &chain)) {
+                    layer = allocate_layer(chain.levels[0].width, chain.levels[0].height);
+                    upload_layer(layer, chain);
+                    FreeMipChain(&chain);
+                }
+            } else {
+                TextureData header;
+                if(LoadTGAHeader(const_cast<char*>(path.c_str()), &header)) {
+                    layer = allocate_layer(header.width, header.height);
+                    streaming::load_texture_layer(layer.texture, layer.layer, path, texture_cache_path(module, texture, path));
+                }
+            }
+            if(layer.texture == 0) {
+                std::cerr << "Failed to load texture layer: " << path << std::endl;
+            }
+            texture_layers[path] = layer;
+            return layer;
+        }
+
+        void bind_texture_layer(const TextureLayer& layer, const GLuint unit) {
+            const size_t i = unit - GL_TEXTURE0;
+            if(i < bound_arrays.size() && bound_arrays[i] == layer.texture) return;
+            if(i >= bound_arrays.size()) bound_arrays.resize(i + 1, 0);
+            glActiveTexture(unit);
+            glBindTexture(GL_TEXTURE_2D_ARRAY, layer.texture);
+            bound_arrays[i] = layer.texture;
+            drawStats.stateChanges++;
+        }
+
         void generate_mipmaps(GLuint tex) {
             glBindTexture(GL_TEXTURE_2D, tex);
             glGenerateMipmap(GL_TEXTURE_2D);
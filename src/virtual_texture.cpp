@@ -0,0 +1,483 @@
+/**
+ * Copyright 2012 Jonatan Olofsson
+ *
+ * This file is part of C++ GL Framework (CPGL).
+ *
+ * CPGL is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * CPGL is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with CPGL.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "virtual_texture.hpp"
+#include "stats.hpp"
+#include "GL_utilities.h"
+#include "yaml-cpp/yaml.h"
+#include <boost/shared_ptr.hpp>
+#include <algorithm>
+#include <climits>
+#include <cmath>
+#include <cstring>
+#include <iostream>
+
+namespace CPGL {
+    extern YAML::Node config;
+    namespace streaming {
+        // Pages are keyed by level, row and column
+        static unsigned long long page_key(int level, int x, int y) {
+            return ((unsigned long long)level << 48) | ((unsigned long long)y << 24) | (unsigned long long)x;
+        }
+        static int page_level(unsigned long long page) { return page >> 48; }
+        static int page_y(unsigned long long page) { return (page >> 24) & 0xffffff; }
+        static int page_x(unsigned long long page) { return page & 0xffffff; }
+
+        // Whether tile p of a level size_p texels long holds all of tile q of
+        // one size_q long, along one axis. Levels round their size down and
+        // their tile counts up, so unless the size is a power of two, the
+        // tiles of one level do not split evenly into those of the next.
+        static bool covers(long long p, long long size_p, long long q, long long size_q, long long tile) {
+            return q * size_p >= p * size_q
+                && std::min((q + 1) * tile, size_q) * size_p <= std::min((p + 1) * tile, size_p) * size_q;
+        }
+
+        static const char* shader_source =
+            "#version 150\n"
+            "uniform sampler2D vt_pages;     // Page table, the levels stacked by rows\n"
+            "uniform sampler2D vt_cache;     // Resident tiles\n"
+            "uniform vec2 vt_size;           // Texels of level 0\n"
+            "uniform int vt_levels;\n"
+            "uniform int vt_rows[16];        // First page table row of each level\n"
+            "uniform float vt_tile;          // Texels of a tile inside its border\n"
+            "uniform float vt_border;\n"
+            "uniform float vt_bias;          // Level bias of the smaller feedback pass\n"
+            "\n"
+            "int vt_level(vec2 uv) {\n"
+            "    vec2 dx = dFdx(uv * vt_size), dy = dFdy(uv * vt_size);\n"
+            "    float lod = 0.5 * log2(max(dot(dx, dx), dot(dy, dy))) + vt_bias;\n"
+            "    return int(clamp(floor(lod + 0.5), 0.0, float(vt_levels - 1)));\n"
+            "}\n"
+            "\n"
+            "vec2 vt_texels(vec2 uv, int level) {\n"
+            "    return fract(uv) * max(vec2(1.0), floor(vt_size / exp2(float(level))));\n"
+            "}\n"
+            "\n"
+            "vec4 vt_sample(vec2 uv) {\n"
+            "    int level = vt_level(uv);\n"
+            "    ivec2 page = ivec2(vt_texels(uv, level) / vt_tile);\n"
+            "    ivec3 e = ivec3(texelFetch(vt_pages, ivec2(page.x, vt_rows[level] + page.y), 0).rgb * 255.0 + 0.5);\n"
+            "\n"
+            "    // The entry may point at a coarser tile holding this one, whose\n"
+            "    // page follows from the texels of its own level\n"
+            "    vec2 texels = vt_texels(uv, e.b);\n"
+            "    ivec2 resident = ivec2(texels / vt_tile);\n"
+            "    vec2 texel = texels - vec2(resident) * vt_tile;\n"
+            "    vec2 cache = vec2(e.rg) * (vt_tile + 2.0 * vt_border) + vt_border + texel;\n"
+            "    return textureLod(vt_cache, cache / vec2(textureSize(vt_cache, 0)), 0.0);\n"
+            "}\n"
+            "\n"
+            "vec4 vt_request(vec2 uv) {\n"
+            "    int level = vt_level(uv);\n"
+            "    ivec2 page = ivec2(vt_texels(uv, level) / vt_tile);\n"
+            "    return vec4(page & 255, (page.x >> 8) | ((page.y >> 8) << 4), level + 1) / 255.0;\n"
+            "}\n";
+
+        VirtualTexture::VirtualTexture(const std::string path) :
+            page_table(0), cache(0), dirty_first(INT_MAX), dirty_last(-1),
+            framebuffer(0), color(0), depth(0), width(0), height(0), previous_framebuffer(0),
+            frame(0), drawn_frame(~0ul), stopping(false)
+        {
+            const YAML::Node c = config["textures"];
+            cache_tiles = std::max(2, c["virtual_cache_tiles"].as<int>(16));
+            divisor = std::max(1, c["virtual_feedback_divisor"].as<int>(8));
+            tiles_per_frame = std::max(1, c["virtual_tiles_per_frame"].as<int>(8));
+            fences[0] = fences[1] = 0;
+            readback[0] = readback[1] = 0;
+
+            if(!OpenVTFile(const_cast<char*>(path.c_str()), &file)) return;
+            const int side = file.tileSize + 2 * file.border;
+            GLint max_size;
+            glGetIntegerv(GL_MAX_TEXTURE_SIZE, &max_size);
+            cache_tiles = std::min(cache_tiles, std::min(max_size / side, 255));
+
+            // Every level's rows of the page table, one table wide
+            int table_rows = 0;
+            for(int i = 0; i < file.numLevels; ++i) {
+                rows.push_back(table_rows);
+                table_rows += file.pagesY[i];
+            }
+            table.resize(file.pagesX[0] * table_rows * 4);
+            glGenTextures(1, &page_table);
+            glBindTexture(GL_TEXTURE_2D, page_table);
+            glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, file.pagesX[0], table_rows, 0, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+
+            glGenTextures(1, &cache);
+            glBindTexture(GL_TEXTURE_2D, cache);
+            glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, cache_tiles * side, cache_tiles * side, 0, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+            Slot free_slot = {0, 0, false};
+            slots.resize(cache_tiles * cache_tiles, free_slot);
+
+            // The one tile of the coarsest level stays, under everything else
+            const int top = file.numLevels - 1;
+            Tile root;
+            root.page = page_key(top, 0, 0);
+            root.texels.assign(VTTile(&file, top, 0, 0), VTTile(&file, top, 0, 0) + VTTileBytes(&file));
+            for(size_t i = 0; i < table.size(); i += 4) table[i + 2] = top;
+            upload_tile(root);
+
+            reader = boost::thread(&VirtualTexture::read, this);
+        }
+
+        // GL objects go with the context; only the reader needs stopping
+        VirtualTexture::~VirtualTexture() {
+            {
+                boost::mutex::scoped_lock lock(mutex);
+                stopping = true;
+            }
+            wake.notify_all();
+            if(reader.joinable()) reader.join();
+            CloseVTFile(&file);
+        }
+
+        void VirtualTexture::read() {
+            for(;;) {
+                Tile tile;
+                {
+                    boost::mutex::scoped_lock lock(mutex);
+                    while(queue.empty() && !stopping) wake.wait(lock);
+                    if(stopping) return;
+                    tile.page = queue.front();
+                    queue.pop_front();
+                }
+                // Reading the mapping is what waits for the disk
+                const GLubyte* texels = VTTile(&file, page_level(tile.page), page_x(tile.page), page_y(tile.page));
+                tile.texels.assign(texels, texels + VTTileBytes(&file));
+                boost::mutex::scoped_lock lock(mutex);
+                ready.push_back(tile);
+            }
+        }
+
+        GLubyte* VirtualTexture::entry(int level, int x, int y) {
+            return &table[((rows[level] + y) * file.pagesX[0] + x) * 4];
+        }
+
+        int VirtualTexture::texels(int level, int axis) const {
+            return std::max(1, (axis ? file.height : file.width) >> level);
+        }
+
+        // The tiles of level k that the page holds all of, along one axis
+        void VirtualTexture::covered(unsigned long long page, int k, int axis, int& first, int& last) const {
+            const long long level = page_level(page), p = axis ? page_y(page) : page_x(page);
+            const long long size_p = texels(level, axis), size_k = texels(k, axis), tile = file.tileSize;
+            const int count = axis ? file.pagesY[k] : file.pagesX[k];
+            first = p * size_k / size_p;
+            if(first < count && !covers(p, size_p, first, size_k, tile)) ++first;
+            for(last = first; last < count && covers(p, size_p, last, size_k, tile); ++last);
+        }
+
+        // The tile of a level holding all of tile x, y of level k, if any
+        bool VirtualTexture::holding(int k, int x, int y, int level, unsigned long long& page) const {
+            const long long tile = file.tileSize;
+            const long long px = (long long)x * texels(level, 0) / texels(k, 0);
+            const long long py = (long long)y * texels(level, 1) / texels(k, 1);
+            page = page_key(level, px, py);
+            return covers(px, texels(level, 0), x, texels(k, 0), tile) && covers(py, texels(level, 1), y, texels(k, 1), tile);
+        }
+
+        // Point the tile and those under it that have nothing finer resident
+        // at the slot
+        void VirtualTexture::map_page(unsigned long long page, int slot) {
+            const int level = page_level(page);
+            for(int k = level; k >= 0; --k) {
+                int x0, x1, y0, y1;
+                covered(page, k, 0, x0, x1);
+                covered(page, k, 1, y0, y1);
+                for(int y = y0; y < y1; ++y) {
+                    for(int x = x0; x < x1; ++x) {
+                        GLubyte* e = entry(k, x, y);
+                        if(e[2] < level) continue;
+                        e[0] = slot % cache_tiles;
+                        e[1] = slot / cache_tiles;
+                        e[2] = level;
+                        e[3] = 255;
+                    }
+                }
+                if(y0 < y1) {
+                    dirty_first = std::min(dirty_first, rows[k] + y0);
+                    dirty_last = std::max(dirty_last, rows[k] + y1 - 1);
+                }
+            }
+            pages[page] = slot;
+        }
+
+        // Hand the tiles that pointed at the page to the finest coarser
+        // tile resident that holds them; the coarsest always is
+        void VirtualTexture::unmap_page(unsigned long long page) {
+            const int level = page_level(page);
+            for(int k = level; k >= 0; --k) {
+                int x0, x1, y0, y1;
+                covered(page, k, 0, x0, x1);
+                covered(page, k, 1, y0, y1);
+                for(int y = y0; y < y1; ++y) {
+                    for(int x = x0; x < x1; ++x) {
+                        GLubyte* e = entry(k, x, y);
+                        if(e[2] != level) continue;
+                        for(int j = level + 1; j < file.numLevels; ++j) {
+                            unsigned long long parent;
+                            std::map<unsigned long long, int>::iterator resident;
+                            if(!holding(k, x, y, j, parent) || (resident = pages.find(parent)) == pages.end()) continue;
+                            e[0] = resident->second % cache_tiles;
+                            e[1] = resident->second / cache_tiles;
+                            e[2] = j;
+                            break;
+                        }
+                    }
+                }
+                if(y0 < y1) {
+                    dirty_first = std::min(dirty_first, rows[k] + y0);
+                    dirty_last = std::max(dirty_last, rows[k] + y1 - 1);
+                }
+            }
+            pages.erase(page);
+        }
+
+        // Into a free slot, or the one used longest ago but not in the last
+        // two frames; the tile is dropped, to be asked for again, if none is
+        void VirtualTexture::upload_tile(const Tile& tile) {
+            int slot = -1;
+            for(size_t i = 0; i < slots.size(); ++i) {
+                if(!slots[i].used) {
+                    slot = i;
+                    break;
+                }
+                if(slots[i].last_used + 2 <= frame && page_level(slots[i].page) < file.numLevels - 1
+                        && (slot < 0 || slots[i].last_used < slots[slot].last_used)) {
+                    slot = i;
+                }
+            }
+            requested.erase(tile.page);
+            if(slot < 0) return;
+            if(slots[slot].used) unmap_page(slots[slot].page);
+
+            const int side = file.tileSize + 2 * file.border;
+            glBindTexture(GL_TEXTURE_2D, cache);
+            glTexSubImage2D(GL_TEXTURE_2D, 0, (slot % cache_tiles) * side, (slot / cache_tiles) * side, side, side,
+                GL_RGBA, GL_UNSIGNED_BYTE, &tile.texels[0]);
+            Slot s = {tile.page, frame, true};
+            slots[slot] = s;
+            map_page(tile.page, slot);
+        }
+
+        // Keep the tiles of the feedback, and the coarser tiles standing in
+        // for them, and queue the missing ones coarsest first
+        void VirtualTexture::request(const GLubyte* pixels, size_t count) {
+            std::set<unsigned long long> seen;
+            for(size_t i = 0; i < count; ++i) {
+                const GLubyte* p = &pixels[i * 4];
+                if(p[3] == 0 || p[3] > file.numLevels) continue;
+                const int level = p[3] - 1;
+                const int x = p[0] | (p[2] & 15) << 8;
+                const int y = p[1] | (p[2] >> 4) << 8;
+                if(x < file.pagesX[level] && y < file.pagesY[level]) seen.insert(page_key(level, x, y));
+            }
+
+            std::vector<unsigned long long> missing;
+            for(std::set<unsigned long long>::iterator i = seen.begin(); i != seen.end(); ++i) {
+                const int level = page_level(*i), x = page_x(*i), y = page_y(*i);
+                if(!pages.count(*i) && !requested.count(*i)) missing.push_back(*i);
+                for(int j = level; j < file.numLevels; ++j) {
+                    unsigned long long page;
+                    if(!holding(level, x, y, j, page)) continue;
+                    std::map<unsigned long long, int>::iterator resident = pages.find(page);
+                    if(resident != pages.end()) slots[resident->second].last_used = frame;
+                }
+            }
+            std::sort(missing.begin(), missing.end());
+
+            // No more than could be given a slot, so that a cache too small
+            // for the view does not read the same tiles over and over
+            size_t replaceable = 0;
+            for(size_t i = 0; i < slots.size(); ++i) {
+                if(!slots[i].used || (slots[i].last_used + 2 <= frame && page_level(slots[i].page) < file.numLevels - 1)) ++replaceable;
+            }
+            const size_t in_flight = std::min<size_t>(4 * tiles_per_frame, replaceable);
+            {
+                boost::mutex::scoped_lock lock(mutex);
+                for(std::vector<unsigned long long>::reverse_iterator i = missing.rbegin();
+                        i != missing.rend() && requested.size() < in_flight; ++i) {
+                    queue.push_back(*i);
+                    requested.insert(*i);
+                }
+            }
+            wake.notify_one();
+        }
+
+        void VirtualTexture::update() {
+            if(!valid()) return;
+            stats::Scope s("virtual texture");
+
+            // Read back this frame's feedback, and use the last one if the
+            // GPU is done with it
+            const int current = frame % 2, last = 1 - current;
+            if(drawn_frame == frame) {
+                if(readback[current] == 0) glGenBuffers(1, &readback[current]);
+                glBindBuffer(GL_PIXEL_PACK_BUFFER, readback[current]);
+                glBufferData(GL_PIXEL_PACK_BUFFER, width * height * 4, NULL, GL_STREAM_READ);
+                GLint read_framebuffer;
+                glGetIntegerv(GL_READ_FRAMEBUFFER_BINDING, &read_framebuffer);
+                glBindFramebuffer(GL_READ_FRAMEBUFFER, framebuffer);
+                glReadPixels(0, 0, width, height, GL_RGBA, GL_UNSIGNED_BYTE, 0);
+                glBindFramebuffer(GL_READ_FRAMEBUFFER, read_framebuffer);
+                if(fences[current]) glDeleteSync(fences[current]);
+                fences[current] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+            }
+            if(fences[last] && glClientWaitSync(fences[last], 0, 0) != GL_TIMEOUT_EXPIRED) {
+                glDeleteSync(fences[last]);
+                fences[last] = 0;
+                glBindBuffer(GL_PIXEL_PACK_BUFFER, readback[last]);
+                GLint size;
+                glGetBufferParameteriv(GL_PIXEL_PACK_BUFFER, GL_BUFFER_SIZE, &size);
+                const GLubyte* pixels = (const GLubyte*)glMapBufferRange(GL_PIXEL_PACK_BUFFER, 0, size, GL_MAP_READ_BIT);
+                if(pixels != NULL) {
+                    request(pixels, size / 4);
+                    glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+                }
+            }
+            glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+
+            std::deque<Tile> tiles;
+            {
+                boost::mutex::scoped_lock lock(mutex);
+                for(int i = 0; i < tiles_per_frame && !ready.empty(); ++i) {
+                    tiles.push_back(ready.front());
+                    ready.pop_front();
+                }
+            }
+            for(size_t i = 0; i < tiles.size(); ++i) upload_tile(tiles[i]);
+
+            if(dirty_first <= dirty_last) {
+                glBindTexture(GL_TEXTURE_2D, page_table);
+                glTexSubImage2D(GL_TEXTURE_2D, 0, 0, dirty_first, file.pagesX[0], dirty_last - dirty_first + 1,
+                    GL_RGBA, GL_UNSIGNED_BYTE, entry(0, 0, dirty_first));
+                dirty_first = INT_MAX;
+                dirty_last = -1;
+            }
+            ++frame;
+        }
+
+        void VirtualTexture::bind(const GLuint program, const GLuint page_unit, const GLuint cache_unit) {
+            glActiveTexture(page_unit);
+            glBindTexture(GL_TEXTURE_2D, page_table);
+            glActiveTexture(cache_unit);
+            glBindTexture(GL_TEXTURE_2D, cache);
+            glActiveTexture(GL_TEXTURE0);
+            drawStats.stateChanges += 2;
+
+            glUniform1i(glGetUniformLocation(program, "vt_pages"), page_unit - GL_TEXTURE0);
+            glUniform1i(glGetUniformLocation(program, "vt_cache"), cache_unit - GL_TEXTURE0);
+            glUniform2f(glGetUniformLocation(program, "vt_size"), file.width, file.height);
+            glUniform1i(glGetUniformLocation(program, "vt_levels"), file.numLevels);
+            glUniform1iv(glGetUniformLocation(program, "vt_rows"), rows.size(), &rows[0]);
+            glUniform1f(glGetUniformLocation(program, "vt_tile"), file.tileSize);
+            glUniform1f(glGetUniformLocation(program, "vt_border"), file.border);
+            glUniform1f(glGetUniformLocation(program, "vt_bias"), 0.0f);
+            glUniform1i(glGetUniformLocation(program, "vt_feedback"), 0);
+        }
+
+        void VirtualTexture::begin_feedback(const GLuint program) {
+            if(!valid()) return;
+            glGetIntegerv(GL_DRAW_FRAMEBUFFER_BINDING, &previous_framebuffer);
+            glGetIntegerv(GL_VIEWPORT, viewport);
+            const GLint w = std::max(1, viewport[2] / divisor), h = std::max(1, viewport[3] / divisor);
+            if(framebuffer == 0) {
+                glGenFramebuffers(1, &framebuffer);
+                glGenRenderbuffers(1, &color);
+                glGenRenderbuffers(1, &depth);
+            }
+            glBindFramebuffer(GL_DRAW_FRAMEBUFFER, framebuffer);
+            if(w != width || h != height) {
+                width = w;
+                height = h;
+                glBindRenderbuffer(GL_RENDERBUFFER, color);
+                glRenderbufferStorage(GL_RENDERBUFFER, GL_RGBA8, width, height);
+                glBindRenderbuffer(GL_RENDERBUFFER, depth);
+                glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT24, width, height);
+                glBindRenderbuffer(GL_RENDERBUFFER, 0);
+                glFramebufferRenderbuffer(GL_DRAW_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, color);
+                glFramebufferRenderbuffer(GL_DRAW_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, depth);
+            }
+            glViewport(0, 0, width, height);
+            if(drawn_frame != frame) {
+                // The first element of the frame clears the pass
+                GLfloat clear[4];
+                glGetFloatv(GL_COLOR_CLEAR_VALUE, clear);
+                glClearColor(0, 0, 0, 0);
+                glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+                glClearColor(clear[0], clear[1], clear[2], clear[3]);
+                drawn_frame = frame;
+            }
+            glUniform1i(glGetUniformLocation(program, "vt_feedback"), 1);
+            glUniform1f(glGetUniformLocation(program, "vt_bias"), -std::log(float(divisor)) / std::log(2.0f));
+        }
+
+        void VirtualTexture::end_feedback(const GLuint program) {
+            if(!valid()) return;
+            glBindFramebuffer(GL_DRAW_FRAMEBUFFER, previous_framebuffer);
+            glViewport(viewport[0], viewport[1], viewport[2], viewport[3]);
+            glUniform1i(glGetUniformLocation(program, "vt_feedback"), 0);
+            glUniform1f(glGetUniformLocation(program, "vt_bias"), 0.0f);
+        }
+
+        typedef std::map<std::string, boost::shared_ptr<VirtualTexture> > virtual_texture_map;
+        virtual_texture_map virtual_textures;
+
+        VirtualTexture* load_virtual_texture(const std::string path) {
+            virtual_texture_map::iterator found = virtual_textures.find(path);
+            if(found != virtual_textures.end()) return found->second.get();
+            std::cout << "Loading virtual texture: " << path << std::endl;
+            boost::shared_ptr<VirtualTexture> texture(new VirtualTexture(path));
+            if(!texture->valid()) {
+                std::cerr << "Failed to load virtual texture: " << path << std::endl;
+                return NULL;
+            }
+            virtual_textures[path] = texture;
+            return texture.get();
+        }
+
+        GLuint virtual_texture_shader() {
+            static GLuint shader = 0;
+            if(shader == 0) {
+                shader = glCreateShader(GL_FRAGMENT_SHADER);
+                glShaderSource(shader, 1, &shader_source, NULL);
+                glCompileShader(shader);
+                GLint compiled;
+                glGetShaderiv(shader, GL_COMPILE_STATUS, &compiled);
+                if(!compiled) {
+                    GLchar log[1024];
+                    glGetShaderInfoLog(shader, sizeof(log), NULL, log);
+                    std::cerr << "Virtual texture shader: " << log << std::endl;
+                }
+            }
+            return shader;
+        }
+
+        void update_virtual_textures() {
+            for(virtual_texture_map::iterator i = virtual_textures.begin(); i != virtual_textures.end(); ++i) {
+                i->second->update();
+            }
+        }
+    }
+}